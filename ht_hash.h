@@ -0,0 +1,84 @@
+/*
+ * Keyed hashing of 64-bit keys. A table draws a 128-bit secret from the
+ * kernel when it is created, keeps it with its other fields and hashes keys
+ * with SipHash-1-3 under it, the variant Rust's and CPython's hash tables
+ * use. Without the secret nobody can choose keys that pile up in one chain,
+ * and one 8-byte key costs five rounds of adds, rotates and xors.
+ */
+#ifndef HT_HASH_H
+#define HT_HASH_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)                                              \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 13);                                                     \
+    v1 ^= v0;                                                                  \
+    v0 = SIP_ROTL(v0, 32);                                                     \
+    v2 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 16);                                                     \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 21);                                                     \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 17);                                                     \
+    v1 ^= v2;                                                                  \
+    v2 = SIP_ROTL(v2, 32);                                                     \
+  } while (0)
+
+// SipHash-1-3 of the 8 bytes of key (little endian) under the secret k.
+static inline uint64_t siphash13(const uint64_t k[2], uint64_t key) {
+  uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+  uint64_t last = 8ULL << 56; // message length, no bytes left over
+
+  v3 ^= key;
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= key;
+  v3 ^= last;
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Maps a hash onto [0, n) with a multiply and a shift instead of a division.
+static inline uint64_t hash_range(uint64_t h, uint64_t n) {
+  return (uint64_t)(((unsigned __int128)h * n) >> 64);
+}
+
+/*
+ * Fills k with a new secret from the kernel's entropy pool, falling back to
+ * /dev/urandom on kernels without getrandom. Returns 0, or -1 with errno
+ * set.
+ */
+static inline int hash_secret(uint64_t k[2]) {
+  ssize_t n = getrandom(k, 2 * sizeof(uint64_t), 0);
+  int fd;
+
+  if (n == 2 * sizeof(uint64_t))
+    return 0;
+  if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  n = read(fd, k, 2 * sizeof(uint64_t));
+  close(fd);
+  if (n != 2 * sizeof(uint64_t)) {
+    errno = n < 0 ? errno : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+#endif
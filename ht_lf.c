@@ -0,0 +1,745 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LF_SEG_SHIFT 12 // buckets per segment of the bucket directory, log2
+#define LF_SEG_SIZE (1ULL << LF_SEG_SHIFT)
+#define LF_SEGS 4096 // segments, so at most 16M buckets
+#define LF_LOAD 2    // average keys per bucket before the bucket count doubles
+#define LF_COUNT_BATCH 64   // key count changes a thread keeps before adding
+#define LF_RETIRE_BATCH 64  // retired objects between reclamation passes
+#define LF_MAX_THREADS 256  // threads registered with the epoch scheme at once
+#define ST_STRIPES 256      // locks of the mutex-striped baseline
+#define BENCH_KEYS (1 << 18)
+#define BENCH_OPS (1 << 20) // per thread
+
+extern __inline__ uint64_t rdtsc(void) {
+  uint64_t a, d;
+  double cput_clock_ticks_per_ns = 2.6; // 2.6 Ghz TSC
+  uint64_t c;
+  __asm__ volatile("rdtscp" : "=a"(a), "=c"(c), "=d"(d) : : "memory");
+  return ((d << 32) | a) / cput_clock_ticks_per_ns;
+}
+
+/*
+ * Lock-free hash table on a split-ordered list (Shalev and Shavit). All
+ * pairs sit in one sorted list, ordered by the bit-reversed hash of their
+ * key, and each bucket is a shortcut to a dummy node in it. Doubling the
+ * bucket count never moves a pair: a new bucket's dummy is spliced in
+ * between the pairs of its parent bucket the first time it is used. Inserts
+ * and removes are Harris-Michael list operations (a removed node's next
+ * pointer is marked, then the node is unlinked), and unlinked nodes are
+ * freed by epoch based reclamation once no thread can still be reading them.
+ */
+struct lf_node {
+  uint64_t so_key; // bit-reversed hash, lowest bit set for pairs
+  uint64_t key;
+  _Atomic(char *) value;
+  _Atomic uintptr_t next; // lowest bit marks the node as removed
+};
+
+typedef _Atomic(struct lf_node *) lf_bucket_t;
+
+struct hashtable_s {
+  lf_bucket_t *_Atomic segs[LF_SEGS];
+  _Atomic uint64_t size; // buckets in use, a power of two
+  _Atomic int64_t count;
+};
+
+typedef struct hashtable_s hashtable_t;
+
+/* Something unlinked that can be freed two epochs after it was retired. */
+struct lf_retired {
+  void *ptr;
+  void (*free_fn)(void *);
+  uint64_t epoch;
+  struct lf_retired *next;
+};
+
+struct lf_thr {
+  _Atomic int used;
+  _Atomic uint64_t state; // epoch << 1 | 1 while inside an operation
+  struct lf_retired *head, *tail;
+  uint64_t nretired;
+  hashtable_t *count_ht; // table count_delta belongs to
+  int64_t count_delta;
+} __attribute__((aligned(64)));
+
+static _Atomic uint64_t lf_epoch = 0;
+static struct lf_thr lf_thrs[LF_MAX_THREADS];
+static _Atomic int lf_nthrs = 0; // high water mark of lf_thrs in use
+static __thread struct lf_thr *lf_me;
+
+static struct lf_thr *lf_self(void) {
+  if (lf_me != NULL)
+    return lf_me;
+  for (int i = 0; i < LF_MAX_THREADS; i++) {
+    int unused = 0;
+    if (atomic_compare_exchange_strong(&lf_thrs[i].used, &unused, 1)) {
+      lf_me = &lf_thrs[i];
+      int n = atomic_load(&lf_nthrs);
+      while (n < i + 1 && !atomic_compare_exchange_weak(&lf_nthrs, &n, i + 1))
+        ;
+      return lf_me;
+    }
+  }
+  fprintf(stderr, "== More than %d threads use ht_lf ==\n", LF_MAX_THREADS);
+  abort();
+}
+
+static void lf_enter(struct lf_thr *t) {
+  atomic_store(&t->state, atomic_load(&lf_epoch) << 1 | 1);
+}
+
+static void lf_exit(struct lf_thr *t) {
+  atomic_store_explicit(&t->state, 0, memory_order_release);
+}
+
+/* Move the global epoch on if every thread inside an operation has seen the
+ * current one. */
+static void lf_try_advance(void) {
+  uint64_t epoch = atomic_load(&lf_epoch);
+  int n = atomic_load(&lf_nthrs);
+  for (int i = 0; i < n; i++) {
+    uint64_t state = atomic_load(&lf_thrs[i].state);
+    if ((state & 1) && state >> 1 != epoch)
+      return;
+  }
+  atomic_compare_exchange_strong(&lf_epoch, &epoch, epoch + 1);
+}
+
+/* Free what this thread retired at least two epochs ago. */
+static void lf_reclaim(struct lf_thr *t) {
+  uint64_t epoch = atomic_load(&lf_epoch);
+  struct lf_retired *r;
+
+  while ((r = t->head) != NULL && r->epoch + 2 <= epoch) {
+    t->head = r->next;
+    r->free_fn(r->ptr);
+    free(r);
+  }
+  if (t->head == NULL)
+    t->tail = NULL;
+}
+
+/* Free ptr once no thread can still be reading it. Without memory for the
+ * record it is leaked, freeing it now could pull it from under a reader. */
+static void lf_retire(struct lf_thr *t, void *ptr, void (*free_fn)(void *)) {
+  struct lf_retired *r = malloc(sizeof(*r));
+
+  if (r == NULL)
+    return;
+  r->ptr = ptr;
+  r->free_fn = free_fn;
+  r->epoch = atomic_load(&lf_epoch);
+  r->next = NULL;
+  if (t->tail != NULL)
+    t->tail->next = r;
+  else
+    t->head = r;
+  t->tail = r;
+  if (++t->nretired % LF_RETIRE_BATCH == 0) {
+    lf_try_advance();
+    lf_reclaim(t);
+  }
+}
+
+/* Hand the calling thread's slot back, once everything it retired is freed.
+ * Threads that used a table call this before they exit. */
+void lf_thread_exit(void) {
+  struct lf_thr *t = lf_me;
+
+  if (t == NULL)
+    return;
+  if (t->count_ht != NULL && t->count_delta != 0)
+    atomic_fetch_add(&t->count_ht->count, t->count_delta);
+  while (t->head != NULL) {
+    lf_try_advance();
+    lf_reclaim(t);
+    if (t->head != NULL)
+      sched_yield();
+  }
+  t->nretired = 0;
+  t->count_ht = NULL;
+  t->count_delta = 0;
+  lf_me = NULL;
+  atomic_store(&t->used, 0);
+}
+
+static void lf_node_free(void *ptr) {
+  struct lf_node *node = ptr;
+  free(atomic_load_explicit(&node->value, memory_order_relaxed));
+  free(node);
+}
+
+static uint64_t hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccd;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53;
+  key ^= key >> 33;
+  return key;
+}
+
+static uint64_t reverse(uint64_t x) {
+  x = (x >> 1 & 0x5555555555555555ULL) | (x & 0x5555555555555555ULL) << 1;
+  x = (x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2;
+  x = (x >> 4 & 0x0f0f0f0f0f0f0f0fULL) | (x & 0x0f0f0f0f0f0f0f0fULL) << 4;
+  return __builtin_bswap64(x);
+}
+
+#define LF_MARKED(p) ((p)&1)
+#define LF_PTR(p) ((struct lf_node *)((p) & ~(uintptr_t)1))
+
+/* Find the first node at or after (so_key, key) in the list that starts
+ * after head, unlinking marked nodes on the way. Returns whether it is an
+ * exact match; *prevp is the link that points at *curp either way. */
+static bool lf_find(struct lf_thr *t, struct lf_node *head, uint64_t so_key,
+                    uint64_t key, _Atomic uintptr_t **prevp,
+                    struct lf_node **curp) {
+  _Atomic uintptr_t *prev;
+  struct lf_node *cur;
+  uintptr_t next;
+
+retry:
+  prev = &head->next;
+  cur = LF_PTR(atomic_load(prev));
+  while (cur != NULL) {
+    next = atomic_load(&cur->next);
+    if (LF_MARKED(next)) {
+      uintptr_t expected = (uintptr_t)cur;
+      if (!atomic_compare_exchange_strong(prev, &expected,
+                                          (uintptr_t)LF_PTR(next)))
+        goto retry;
+      lf_retire(t, cur, lf_node_free);
+      cur = LF_PTR(next);
+      continue;
+    }
+    if (cur->so_key > so_key || (cur->so_key == so_key && cur->key >= key))
+      break;
+    prev = &cur->next;
+    cur = LF_PTR(next);
+  }
+  *prevp = prev;
+  *curp = cur;
+  return cur != NULL && cur->so_key == so_key && cur->key == key;
+}
+
+/* The slot of a bucket, NULL if its segment can't be allocated. */
+static lf_bucket_t *lf_bucket(hashtable_t *hashtable, uint64_t bin) {
+  lf_bucket_t *seg = atomic_load(&hashtable->segs[bin >> LF_SEG_SHIFT]);
+
+  if (seg == NULL) {
+    lf_bucket_t *fresh = calloc(LF_SEG_SIZE, sizeof(lf_bucket_t));
+    if (fresh == NULL)
+      return NULL;
+    if (atomic_compare_exchange_strong(&hashtable->segs[bin >> LF_SEG_SHIFT],
+                                       &seg, fresh))
+      seg = fresh;
+    else
+      free(fresh);
+  }
+  return &seg[bin & (LF_SEG_SIZE - 1)];
+}
+
+/* The dummy node of a bucket, spliced in after its parent's on first use.
+ * The parent of a bucket is the same index without its top bit set. Out of
+ * memory, the parent's dummy is returned: the keys of the bucket follow it
+ * in the list too, only further on. Bucket 0's always exists. */
+static struct lf_node *lf_head(struct lf_thr *t, hashtable_t *hashtable,
+                               uint64_t bin) {
+  lf_bucket_t *slot = lf_bucket(hashtable, bin);
+  struct lf_node *dummy = slot != NULL ? atomic_load(slot) : NULL;
+  struct lf_node *parent, *cur;
+  _Atomic uintptr_t *prev;
+
+  if (dummy != NULL)
+    return dummy;
+
+  parent = lf_head(t, hashtable, bin & ~(1ULL << (63 - __builtin_clzll(bin))));
+  if (slot == NULL || (dummy = malloc(sizeof(struct lf_node))) == NULL)
+    return parent;
+  dummy->so_key = reverse(bin);
+  dummy->key = 0;
+  atomic_init(&dummy->value, NULL);
+  for (;;) {
+    if (lf_find(t, parent, dummy->so_key, 0, &prev, &cur)) {
+      free(dummy); // another thread got there first
+      dummy = cur;
+      break;
+    }
+    atomic_init(&dummy->next, (uintptr_t)cur);
+    uintptr_t expected = (uintptr_t)cur;
+    if (atomic_compare_exchange_strong(prev, &expected, (uintptr_t)dummy))
+      break;
+  }
+  atomic_store(slot, dummy);
+  return dummy;
+}
+
+/* Add to the key count, doubling the bucket count when the table gets too
+ * full. Threads batch their changes so the counter isn't a hot spot. */
+static void lf_count(struct lf_thr *t, hashtable_t *hashtable, int delta) {
+  if (t->count_ht != hashtable) {
+    if (t->count_ht != NULL)
+      atomic_fetch_add(&t->count_ht->count, t->count_delta);
+    t->count_ht = hashtable;
+    t->count_delta = 0;
+  }
+  t->count_delta += delta;
+  if (t->count_delta < LF_COUNT_BATCH && t->count_delta > -LF_COUNT_BATCH)
+    return;
+
+  int64_t count =
+      atomic_fetch_add(&hashtable->count, t->count_delta) + t->count_delta;
+  t->count_delta = 0;
+  uint64_t size = atomic_load(&hashtable->size);
+  if (count > (int64_t)(size * LF_LOAD) && size < LF_SEG_SIZE * LF_SEGS)
+    atomic_compare_exchange_strong(&hashtable->size, &size, size * 2);
+}
+
+/* Create a new hashtable with at least size buckets to start with. */
+hashtable_t *ht_create(int size) {
+  hashtable_t *hashtable = NULL;
+  uint64_t buckets = 1;
+
+  if (size < 1)
+    return NULL;
+  while (buckets < (uint64_t)size && buckets < LF_SEG_SIZE * LF_SEGS)
+    buckets *= 2;
+
+  if ((hashtable = calloc(1, sizeof(hashtable_t))) == NULL) {
+    return NULL;
+  }
+
+  /* Bucket 0's dummy is the head of the whole list. */
+  struct lf_node *head = calloc(1, sizeof(struct lf_node));
+  lf_bucket_t *slot = lf_bucket(hashtable, 0);
+  if (head == NULL || slot == NULL) {
+    free(head);
+    free(hashtable);
+    return NULL;
+  }
+  atomic_store(slot, head);
+  atomic_store(&hashtable->size, buckets);
+  return hashtable;
+}
+
+/* Free a table and everything in it. No other thread may be using it. */
+void ht_free(hashtable_t *hashtable) {
+  struct lf_node *node = atomic_load(lf_bucket(hashtable, 0));
+  struct lf_node *next;
+
+  for (; node != NULL; node = next) {
+    next = LF_PTR(atomic_load(&node->next));
+    lf_node_free(node);
+  }
+  for (int i = 0; i < LF_SEGS; i++)
+    free(atomic_load(&hashtable->segs[i]));
+  if (lf_me != NULL && lf_me->count_ht == hashtable) {
+    lf_me->count_ht = NULL;
+    lf_me->count_delta = 0;
+  }
+  free(hashtable);
+}
+
+/* Insert a key-value pair into a hash table, or replace the value of an
+ * existing key. Returns 0, or -1 if out of memory. */
+int ht_set(hashtable_t *hashtable, uint64_t key, char *value) {
+  struct lf_thr *t = lf_self();
+  uint64_t hashval = hash(key);
+  uint64_t so_key = reverse(hashval) | 1;
+  struct lf_node *head, *cur, *newpair = NULL;
+  _Atomic uintptr_t *prev;
+  char *copy = strdup(value);
+  bool inserted = false;
+
+  if (copy == NULL)
+    return -1;
+  lf_enter(t);
+  head = lf_head(t, hashtable, hashval & (atomic_load(&hashtable->size) - 1));
+  for (;;) {
+    if (lf_find(t, head, so_key, key, &prev, &cur)) {
+      lf_retire(t, atomic_exchange(&cur->value, copy), free);
+      free(newpair);
+      break;
+    }
+    if (newpair == NULL) {
+      if ((newpair = malloc(sizeof(struct lf_node))) == NULL) {
+        lf_exit(t);
+        free(copy);
+        return -1;
+      }
+      newpair->so_key = so_key;
+      newpair->key = key;
+      atomic_init(&newpair->value, copy);
+    }
+    atomic_init(&newpair->next, (uintptr_t)cur);
+    uintptr_t expected = (uintptr_t)cur;
+    if (atomic_compare_exchange_strong(prev, &expected, (uintptr_t)newpair)) {
+      inserted = true;
+      break;
+    }
+  }
+  lf_exit(t);
+  if (inserted)
+    lf_count(t, hashtable, 1);
+  return 0;
+}
+
+/* Copy the value of a key into buf, truncated to len - 1 bytes. Returns the
+ * length of the value, or -1 if the key isn't there. */
+int ht_get(hashtable_t *hashtable, uint64_t key, char *buf, size_t len) {
+  struct lf_thr *t = lf_self();
+  uint64_t hashval = hash(key);
+  struct lf_node *head, *cur;
+  _Atomic uintptr_t *prev;
+  int ret = -1;
+
+  lf_enter(t);
+  head = lf_head(t, hashtable, hashval & (atomic_load(&hashtable->size) - 1));
+  if (lf_find(t, head, reverse(hashval) | 1, key, &prev, &cur)) {
+    char *value = atomic_load(&cur->value);
+    size_t n = strlen(value);
+    ret = n;
+    if (len > 0) {
+      n = n < len - 1 ? n : len - 1;
+      memcpy(buf, value, n);
+      buf[n] = 0;
+    }
+  }
+  lf_exit(t);
+  return ret;
+}
+
+/* Remove a key. Returns 1 if it was there. */
+int ht_remove(hashtable_t *hashtable, uint64_t key) {
+  struct lf_thr *t = lf_self();
+  uint64_t hashval = hash(key);
+  uint64_t so_key = reverse(hashval) | 1;
+  struct lf_node *head, *cur;
+  _Atomic uintptr_t *prev;
+  uintptr_t next;
+  int ret = 0;
+
+  lf_enter(t);
+  head = lf_head(t, hashtable, hashval & (atomic_load(&hashtable->size) - 1));
+  while (lf_find(t, head, so_key, key, &prev, &cur)) {
+    next = atomic_load(&cur->next);
+    if (LF_MARKED(next))
+      continue; // someone else is removing it, let lf_find unlink it
+    if (!atomic_compare_exchange_strong(&cur->next, &next, next | 1))
+      continue;
+
+    /* Marked, so the key is gone. Unlink it, or leave that to lf_find. */
+    uintptr_t expected = (uintptr_t)cur;
+    if (atomic_compare_exchange_strong(prev, &expected, next))
+      lf_retire(t, cur, lf_node_free);
+    else
+      lf_find(t, head, so_key, key, &prev, &cur);
+    ret = 1;
+    break;
+  }
+  lf_exit(t);
+  if (ret)
+    lf_count(t, hashtable, -1);
+  return ret;
+}
+
+/*
+ * Baseline for the benchmark: the sorted chains of ht_vanilla with a fixed
+ * number of bins, each bin guarded by one of ST_STRIPES mutexes.
+ */
+struct entry_s {
+  uint64_t key;
+  char *value;
+  struct entry_s *next;
+};
+
+typedef struct entry_s entry_t;
+
+struct st_table {
+  int size;
+  entry_t **table;
+  struct {
+    pthread_mutex_t lock;
+  } __attribute__((aligned(64))) stripes[ST_STRIPES];
+};
+
+struct st_table *st_create(int size) {
+  struct st_table *st;
+
+  if (size < 1)
+    return NULL;
+  if ((st = malloc(sizeof(struct st_table))) == NULL) {
+    return NULL;
+  }
+  if ((st->table = calloc(size, sizeof(entry_t *))) == NULL) {
+    free(st);
+    return NULL;
+  }
+  for (int i = 0; i < ST_STRIPES; i++)
+    pthread_mutex_init(&st->stripes[i].lock, NULL);
+  st->size = size;
+  return st;
+}
+
+void st_free(struct st_table *st) {
+  entry_t *pair, *next;
+
+  for (int i = 0; i < st->size; i++) {
+    for (pair = st->table[i]; pair != NULL; pair = next) {
+      next = pair->next;
+      free(pair->value);
+      free(pair);
+    }
+  }
+  for (int i = 0; i < ST_STRIPES; i++)
+    pthread_mutex_destroy(&st->stripes[i].lock);
+  free(st->table);
+  free(st);
+}
+
+// Returns 0, or -1 if out of memory.
+int st_set(struct st_table *st, uint64_t key, char *value) {
+  int bin = hash(key) % st->size;
+  char *copy = strdup(value);
+  entry_t **link, *newpair;
+  int ret = 0;
+
+  if (copy == NULL)
+    return -1;
+  pthread_mutex_lock(&st->stripes[bin % ST_STRIPES].lock);
+  link = &st->table[bin];
+  while (*link != NULL && (*link)->key < key)
+    link = &(*link)->next;
+  if (*link != NULL && (*link)->key == key) {
+    free((*link)->value);
+    (*link)->value = copy;
+  } else if ((newpair = malloc(sizeof(entry_t))) != NULL) {
+    newpair->key = key;
+    newpair->value = copy;
+    newpair->next = *link;
+    *link = newpair;
+  } else {
+    free(copy);
+    ret = -1;
+  }
+  pthread_mutex_unlock(&st->stripes[bin % ST_STRIPES].lock);
+  return ret;
+}
+
+int st_get(struct st_table *st, uint64_t key, char *buf, size_t len) {
+  int bin = hash(key) % st->size;
+  entry_t *pair;
+  int ret = -1;
+
+  pthread_mutex_lock(&st->stripes[bin % ST_STRIPES].lock);
+  pair = st->table[bin];
+  while (pair != NULL && pair->key < key)
+    pair = pair->next;
+  if (pair != NULL && pair->key == key) {
+    size_t n = strlen(pair->value);
+    ret = n;
+    if (len > 0) {
+      n = n < len - 1 ? n : len - 1;
+      memcpy(buf, pair->value, n);
+      buf[n] = 0;
+    }
+  }
+  pthread_mutex_unlock(&st->stripes[bin % ST_STRIPES].lock);
+  return ret;
+}
+
+int st_remove(struct st_table *st, uint64_t key) {
+  int bin = hash(key) % st->size;
+  entry_t **link, *pair = NULL;
+
+  pthread_mutex_lock(&st->stripes[bin % ST_STRIPES].lock);
+  link = &st->table[bin];
+  while (*link != NULL && (*link)->key < key)
+    link = &(*link)->next;
+  if (*link != NULL && (*link)->key == key) {
+    pair = *link;
+    *link = pair->next;
+  }
+  pthread_mutex_unlock(&st->stripes[bin % ST_STRIPES].lock);
+  if (pair == NULL)
+    return 0;
+  free(pair->value);
+  free(pair);
+  return 1;
+}
+
+// Benchmark thread: BENCH_OPS random operations over the first BENCH_KEYS
+// keys, 90% gets, 5% sets and 5% removes, against either table.
+struct bench_job {
+  hashtable_t *lf;
+  struct st_table *st;
+  uint64_t seed;
+  uint64_t first; // Test 2: insert then remove keys [first, first + nkeys)
+  uint64_t nkeys;
+  uint64_t found;
+};
+
+static void *bench_worker(void *arg) {
+  struct bench_job *job = arg;
+  uint64_t x = job->seed;
+  char buf[64];
+
+  for (int i = 0; i < BENCH_OPS; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    uint64_t key = x % BENCH_KEYS + 1;
+    int op = (x >> 32) % 20;
+    if (job->lf != NULL) {
+      if (op == 0)
+        ht_set(job->lf, key, "value");
+      else if (op == 1)
+        ht_remove(job->lf, key);
+      else
+        job->found += ht_get(job->lf, key, buf, sizeof(buf)) >= 0;
+    } else {
+      if (op == 0)
+        st_set(job->st, key, "value");
+      else if (op == 1)
+        st_remove(job->st, key);
+      else
+        job->found += st_get(job->st, key, buf, sizeof(buf)) >= 0;
+    }
+  }
+  lf_thread_exit();
+  return NULL;
+}
+
+static void *grow_worker(void *arg) {
+  struct bench_job *job = arg;
+  char buf[32];
+
+  for (uint64_t key = job->first; key < job->first + job->nkeys; key++) {
+    snprintf(buf, sizeof(buf), "%lu", key);
+    ht_set(job->lf, key, buf);
+  }
+  for (uint64_t key = job->first; key < job->first + job->nkeys; key++) {
+    snprintf(buf, sizeof(buf), "%lu", key);
+    char value[32];
+    if (ht_get(job->lf, key, value, sizeof(value)) >= 0 && !strcmp(value, buf))
+      job->found++;
+  }
+  for (uint64_t key = job->first; key < job->first + job->nkeys; key++)
+    ht_remove(job->lf, key);
+  lf_thread_exit();
+  return NULL;
+}
+
+void perf_test(void) {
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1)
+    ncpus = 1;
+  pthread_t *threads = malloc(ncpus * sizeof(pthread_t));
+  struct bench_job *jobs = calloc(ncpus, sizeof(struct bench_job));
+
+  printf("== Test 1: %d ops per thread over %d keys, 90%% gets, 1 to %d "
+         "threads\n",
+         BENCH_OPS, BENCH_KEYS, ncpus);
+  for (int nthreads = 1;; nthreads = nthreads * 2 < ncpus ? nthreads * 2
+                                                         : ncpus) {
+    for (int lock_free = 1; lock_free >= 0; lock_free--) {
+      hashtable_t *lf = NULL;
+      struct st_table *st = NULL;
+      if (lock_free) {
+        lf = ht_create(1);
+        for (uint64_t key = 1; key <= BENCH_KEYS; key++)
+          ht_set(lf, key, "value");
+      } else {
+        st = st_create(BENCH_KEYS / LF_LOAD);
+        for (uint64_t key = 1; key <= BENCH_KEYS; key++)
+          st_set(st, key, "value");
+      }
+
+      uint64_t begin_time = rdtsc();
+      for (int i = 0; i < nthreads; i++) {
+        jobs[i].lf = lf;
+        jobs[i].st = st;
+        jobs[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        jobs[i].found = 0;
+        pthread_create(&threads[i], NULL, bench_worker, &jobs[i]);
+      }
+      for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+      uint64_t end_time = rdtsc();
+      printf(" ==== %d threads, %s: %lu kops/s ====\n", nthreads,
+             lock_free ? "lock-free" : "striped  ",
+             (uint64_t)nthreads * BENCH_OPS * 1000000 /
+                 (end_time - begin_time));
+
+      if (lock_free)
+        ht_free(lf);
+      else
+        st_free(st);
+    }
+    if (nthreads == ncpus)
+      break;
+  }
+
+  int nkeys = 1 << 20;
+  printf("== Test 2: %d threads insert, get and remove %d keys from 1 "
+         "bucket\n",
+         ncpus, nkeys);
+  hashtable_t *lf = ht_create(1);
+  uint64_t begin_time = rdtsc();
+  for (int i = 0; i < ncpus; i++) {
+    jobs[i].lf = lf;
+    jobs[i].first = 1 + (uint64_t)nkeys * i / ncpus;
+    jobs[i].nkeys = (uint64_t)nkeys * (i + 1) / ncpus + 1 - jobs[i].first;
+    jobs[i].found = 0;
+    pthread_create(&threads[i], NULL, grow_worker, &jobs[i]);
+  }
+  uint64_t found = 0;
+  for (int i = 0; i < ncpus; i++) {
+    pthread_join(threads[i], NULL);
+    found += jobs[i].found;
+  }
+  uint64_t end_time = rdtsc();
+  char buf[32];
+  int left = 0;
+  for (uint64_t key = 1; key <= nkeys; key++)
+    left += ht_get(lf, key, buf, sizeof(buf)) >= 0;
+  printf(" ==== %lu/%d keys found, %d left, %lu buckets, %lu ns ====\n", found,
+         nkeys, left, atomic_load(&lf->size), end_time - begin_time);
+  ht_free(lf);
+  lf_thread_exit();
+  free(jobs);
+  free(threads);
+}
+
+int main(int argc, char **argv) {
+  char buf[32];
+  hashtable_t *hashtable = ht_create(1);
+
+  ht_set(hashtable, 1, "Alpha");
+  ht_set(hashtable, 2, "Beta");
+  ht_set(hashtable, 3, "Omega");
+  ht_set(hashtable, 1, "kapa");
+  ht_remove(hashtable, 2);
+
+  for (uint64_t key = 1; key <= 3; key++) {
+    if (ht_get(hashtable, key, buf, sizeof(buf)) >= 0)
+      printf("%s\n", buf);
+    else
+      printf("%lu not found\n", key);
+  }
+  ht_free(hashtable);
+
+  perf_test();
+  return 0;
+}
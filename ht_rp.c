@@ -1,9 +1,15 @@
+#include <errno.h>
 #include <libpmemobj.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ht_hash.h"
+#include "pm_emul.h"
 
 #define die(...)                                                               \
   do {                                                                         \
@@ -14,6 +20,7 @@
 #define TOMBSTONE_MASK (1ULL << 63)
 #define POOL "hashtable"
 #define LAYOUT "hashtable"
+#define POOL_MAX "1T" // address space the pool grows into
 
 PMEMobjpool *pool;
 char tmp[2];
@@ -38,6 +45,7 @@ typedef struct entry_s entry_t;
 struct hashtable_s {
   int size;
   struct entry_s **table;
+  uint64_t hash_key[2]; // secret of the keyed hash, see ht_hash
 };
 
 TOID_DECLARE(struct hashtable_s, 0);
@@ -45,21 +53,32 @@ TOID_DECLARE(struct entry_s, 1);
 
 typedef struct hashtable_s hashtable_t;
 
+/*
+ * Write a poolset whose only part is the directory POOL.parts: libpmemobj
+ * starts with one small part file and adds parts as the heap fills up.
+ */
+static void pool_set_create(void) {
+  char dir[PATH_MAX];
+  FILE *f;
+
+  if (mkdir(POOL ".parts", 0777) && errno != EEXIST)
+    die("Couldn't create %s.parts: %m\n", POOL);
+  if (realpath(POOL ".parts", dir) == NULL || (f = fopen(POOL, "wx")) == NULL)
+    die("Couldn't write poolset %s: %m\n", POOL);
+  fprintf(f, "PMEMPOOLSET\nOPTION SINGLEHDR\n%s %s/\n", POOL_MAX, dir);
+  fclose(f);
+}
+
 /* Create a new hashtable. */
 union hashtable_s_toid ht_create(int size) {
 
   TOID(struct hashtable_s) hashtable;
 
-  // size_t pool_size = size * sizeof(entry_t) + sizeof(hashtable_t) + 8092; //
-  // Arbitrary size.
-  size_t pool_size = 10485760; // just put 10 MiB for now, above is too small
-
-  pool = pmemobj_open(POOL, LAYOUT);
-  if (!pool) {
-    // Pool doesn't exist
-    printf("==== Initializing pool %s with pool_size- %lu ====\n", POOL,
-           pool_size);
-    pool = pmemobj_create(POOL, LAYOUT, pool_size, 0600);
+  if (access(POOL, F_OK) != 0) {
+    // Pool doesn't exist, it grows on demand up to POOL_MAX.
+    printf("==== Initializing growing pool %s ====\n", POOL);
+    pool_set_create();
+    pool = pmemobj_create(POOL, LAYOUT, 0, 0600);
     if (!pool)
       die("Couldn't open pool: %m\n");
     struct pobj_action actv[2];
@@ -93,11 +112,17 @@ union hashtable_s_toid ht_create(int size) {
     }
 
     D_RW(hashtable)->size = size;
+    if (hash_secret(D_RW(hashtable)->hash_key))
+      die("Can't draw a hash secret: %m\n");
 
     // Publish the pool
     pmemobj_publish(pool, actv, actv_cnt);
 
   } else {
+    // A pool that can't be opened is left alone, not recreated.
+    pool = pmemobj_open(POOL, LAYOUT);
+    if (!pool)
+      die("Couldn't open pool %s: %s\n", POOL, pmemobj_errormsg());
     // Get hashtable pointer from pool and return.
     // Get the root of the pool
     PMEMoid root = pmemobj_root(pool, sizeof(struct hashtable_s));
@@ -112,20 +137,9 @@ union hashtable_s_toid ht_create(int size) {
   return hashtable;
 }
 
-// Potential collisions -- no time to check this for now!
+// Keyed by the table's secret, so keys can't be chosen to share a bin.
 int ht_hash(hashtable_t *hashtable, uint64_t key) {
-
-  unsigned long int hashval;
-  int i = 0;
-
-  /* Convert our string to an integer */
-  // while( hashval < ULONG_MAX && i < strlen( key ) ) {
-  // 	hashval = hashval << 8;
-  // 	hashval += key[ i ];
-  // 	i++;
-  // }
-
-  return key % hashtable->size;
+  return hash_range(siphash13(hashtable->hash_key, key), hashtable->size);
 }
 
 static uint64_t hash(hashtable_t hashmap, uint64_t key) {
@@ -269,6 +283,7 @@ void perf_test(hashtable_t *hashtable) {
 
 int main(int argc, char **argv) {
   int ht_size = 65536;
+  pm_emul_from_env();
 
   TOID(struct hashtable_s) hashtable = ht_create(ht_size);
   // hashtable_t *hashtable = ht_create( ht_size );
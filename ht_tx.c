@@ -1,22 +1,43 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libpmemobj.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-POBJ_LAYOUT_BEGIN(httx);
-POBJ_LAYOUT_ROOT(httx, struct root);
-// POBJ_LAYOUT_ROOT(httx, uint64_t); // To indicate incomplete migration caused
-// by crash.
-POBJ_LAYOUT_END(httx)
+#include "ht_hash.h"
+#include "ht_typed.h"
+#include "pm_emul.h"
+
+POBJ_LAYOUT_BEGIN(httx_v3);
+POBJ_LAYOUT_ROOT(httx_v3, struct root);
+// POBJ_LAYOUT_ROOT(httx_v3, uint64_t); // To indicate incomplete migration
+// caused by crash.
+POBJ_LAYOUT_END(httx_v3)
 
 #define HASHTABLE_TX_TYPE_OFFSET 1004
-#define HASH_FUNC_COEFF_P                                                      \
-  32212254719ULL // large prime number for hash coefficient
-#define POOL_SIZE                                                              \
-  (1024 * 1024 *                                                               \
-   1024) // Allocate one big pool; not dynamicaly resizing pool yet.
-//#define POOL_SIZE PMEMOBJ_MIN_POOL
+#define POOL_MAX "1T" // address space a pool can grow into, see pool_open
+#define POOL_GROW (8 * 1024 * 1024) // heap added per growth, also kept free
+#define POOL_GROW_CHECK 64 // small puts between two headroom checks
+#define NT_THRESHOLD_AUTO 0 // calibrate nt_threshold on the first pool open
+#define SCAN_PREFETCH 16 // chains a table scan keeps in flight
+#define BT_ORDER 8 // keys per index node, one cache line of keys
+#define GET_MULTI_WINDOW 16 // lookups ht_get_multi keeps in flight
+#define EXTENT_SIZE                                                            \
+  (256 * 1024 - 64) // one pmemobj chunk, less allocator and extent headers
 
 #define die(...)                                                               \
   do {                                                                         \
@@ -38,62 +59,271 @@ struct entry;
 struct buckets;
 TOID_DECLARE(struct buckets, HASHTABLE_TX_TYPE_OFFSET + 1);
 TOID_DECLARE(struct entry, HASHTABLE_TX_TYPE_OFFSET + 2);
+struct extent;
+TOID_DECLARE(struct extent, HASHTABLE_TX_TYPE_OFFSET + 3);
+struct bt_node;
+TOID_DECLARE(struct bt_node, HASHTABLE_TX_TYPE_OFFSET + 4);
 
 // prototypes
 void ht_alloc(PMEMobjpool *, TOID(struct hashtable_s) *, uint32_t, size_t,
               uint64_t);
 void ht_expand(PMEMobjpool *, TOID(struct hashtable_s), size_t);
+PMEMoid ht_get(PMEMobjpool *, TOID(struct hashtable_s), uint64_t);
+int ht_remove(PMEMobjpool *, TOID(struct hashtable_s), uint64_t);
+void ht_value_free(PMEMoid);
+void bt_insert(TOID(struct hashtable_s), uint64_t, TOID(struct entry));
+void bt_remove(TOID(struct hashtable_s), uint64_t);
+size_t ht_nt_calibrate(PMEMobjpool *, int);
+void ht_reclaim(PMEMobjpool *, TOID(struct hashtable_s) *);
+void pool_reserve(PMEMobjpool *, size_t);
+void hc_invalidate(TOID(struct hashtable_s), uint64_t);
+void hc_invalidate_all(TOID(struct hashtable_s));
+void hc_rebind(TOID(struct hashtable_s), TOID(struct hashtable_s));
+struct bf_s;
+extern int bf_nopen;
+struct bf_s *bf_find(TOID(struct hashtable_s));
+int bf_may_contain(struct bf_s *, uint64_t);
+void bf_false_positive(struct bf_s *);
+void bf_add(TOID(struct hashtable_s), uint64_t);
+void bf_invalidate(TOID(struct hashtable_s));
+struct shard_store;
+void shard_close(struct shard_store *);
 void perf_test(char *);
 
+/*
+ * Entries and bucket slots hold compact pointers: the 8-byte offset of an
+ * object in the table's pool, 0 for none. The other half of a PMEMoid, the
+ * pool's UUID, is the same for everything a table links, so ENTRY_AT and
+ * oid_at take it from an object already at hand, and chain walks translate
+ * offsets through the pool's base address instead (pool_base, pool_at).
+ * Values must live in the table's pool.
+ */
 struct entry {
   uint64_t key;
-  PMEMoid value;
-  TOID(struct entry) next;
+  uint64_t value; // offset of the value
+  uint64_t next;  // offset of the next entry
+};
+
+// Values written by ht_put: an explicit length and a chain of extents, each
+// fitting in one allocation unit. Plain TX_STRDUP values are type 0.
+struct extent {
+  uint64_t total; // length of the whole value, only set in the first extent
+  uint64_t len;   // bytes of data in this extent
+  TOID(struct extent) next;
+  char data[];
 };
 
 struct buckets {
-  size_t nbuckets;             // number of buckets
-  TOID(struct entry) bucket[]; // array of lists
+  size_t nbuckets;   // number of buckets
+  uint64_t bucket[]; // offsets of the first entries
 };
 
 struct hashtable_s {
   uint32_t seed; // Random number generator
 
-  // hash function coefficients
-  uint32_t hash_fun_a;
-  uint32_t hash_fun_b;
-  uint64_t hash_fun_p;
+  uint64_t hash_key[2]; // secret of the keyed hash, see hash
 
   uint64_t size;
   uint64_t uuid; // A unique id to identify this HT.
   TOID(struct buckets) buckets;
+  TOID(struct bt_node) index; // optional ordered index, see ht_index_create
+};
+
+// Ordered index node. Leaves map keys to the table's entries and are chained
+// for range scans, internal nodes have n + 1 children.
+struct bt_node {
+  uint64_t key[BT_ORDER];
+  uint32_t leaf;
+  uint32_t n;
+  TOID(struct bt_node) next; // next leaf
+  PMEMoid child[BT_ORDER + 1];
+};
+
+struct ht_range_iter {
+  TOID(struct bt_node) leaf;
+  uint32_t pos;
+  uint64_t hi;
+};
+
+struct ht_iter {
+  PMEMoid pool; // the table, for the UUID of values
+  char *base;
+  const struct buckets *buckets;
+  size_t next_bucket;
+  size_t last_bucket;
+  const struct entry *ring[SCAN_PREFETCH]; // chains in flight
+  int head;
+  int count;
 };
 
+static inline PMEMoid oid_at(PMEMoid ref, uint64_t off) {
+  return off ? (PMEMoid){ref.pool_uuid_lo, off} : OID_NULL;
+}
+
+#define ENTRY_AT(ref, off) ((TOID(struct entry))oid_at((ref).oid, (off)))
+
+// The address the pool of hashtable is mapped at.
+static inline char *pool_base(TOID(struct hashtable_s) hashtable) {
+  return (char *)D_RO(hashtable) - hashtable.oid.off;
+}
+
+// Translates a compact pointer, charging the read like pmemobj_direct.
+static inline void *pool_at(char *base, uint64_t off) {
+  if (off == 0)
+    return NULL;
+  if (pm_emul_on)
+    pm_emul_touch(base + off);
+  return base + off;
+}
+
+// Translates a compact pointer and prefetches the object.
+static inline void *pool_prefetch(char *base, uint64_t off) {
+  if (off == 0)
+    return NULL;
+  __builtin_prefetch(base + off);
+  if (pm_emul_on)
+    pm_emul_touch_ahead(base + off);
+  return base + off;
+}
+
+// Non-zero stops the scan.
+typedef int (*ht_scan_cb)(uint64_t key, PMEMoid value, void *arg);
+
 struct root {
   // int not_empty; // 0 if empty 1 if not.
   TOID(struct hashtable_s)
   ht_list[6]; // 6 HTs per pool for now, this can any number.
+  TOID(struct hashtable_s) loading; // table being bulk loaded, see ht_bulk_load
 };
 
 PMEMobjpool *pop;
+size_t nt_threshold = NT_THRESHOLD_AUTO; // bytes, values from here on use NT
 
-// Initialize the pool and hashtable
-// If the bucket size passed for a ht is more than previous then it'll auto
-// expand the table
-TOID(struct hashtable_s) *
-    init_pool_ht(const char *path, uint64_t ht_id, size_t buck_sz) {
+/*
+ * Pools grow on demand. A new pool is a poolset file at path whose only part
+ * is the directory <path>.parts, so it starts with one small part file and
+ * libpmemobj adds parts as the heap is extended, up to POOL_MAX. Pools
+ * created as a single fixed size file keep working, they just never grow.
+ * The size of a growing pool is that of its part files, so growth by
+ * libpmemobj's own fallback is seen as well. pool_open records the parts
+ * directory of every pool it opens in pool_grow_list.
+ */
+#define POOL_MAX_OPEN 64
+
+struct pool_grow {
+  PMEMobjpool *pop;
+  char parts[PATH_MAX];
+  uint64_t size;        // of the parts at the last look
+  pthread_mutex_t lock; // serializes the checks and extends of the pool
+};
+
+static struct pool_grow pool_grow_list[POOL_MAX_OPEN];
+static int pool_grow_next; // slot reused once the list is full
+static pthread_mutex_t pool_grow_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes in the part files of dir, 0 if it doesn't exist.
+static uint64_t pool_parts_size(const char *dir) {
+  char part[PATH_MAX + 256];
+  struct stat st;
+  uint64_t total = 0;
+  DIR *d;
+  struct dirent *de;
+
+  if ((d = opendir(dir)) == NULL)
+    return 0;
+  while ((de = readdir(d)) != NULL) {
+    snprintf(part, sizeof(part), "%s/%s", dir, de->d_name);
+    if (de->d_name[0] != '.' && !stat(part, &st))
+      total += st.st_size;
+  }
+  closedir(d);
+  return total;
+}
+
+// Records the parts of a pool just opened, replacing a closed pool that had
+// the same handle.
+static void pool_grow_add(PMEMobjpool *pop, const char *path) {
+  struct pool_grow *g = NULL;
+
+  pthread_mutex_lock(&pool_grow_list_lock);
+  for (int i = 0; i < POOL_MAX_OPEN && g == NULL; i++)
+    if (pool_grow_list[i].pop == pop)
+      g = &pool_grow_list[i];
+  if (g == NULL) {
+    g = &pool_grow_list[pool_grow_next];
+    pool_grow_next = (pool_grow_next + 1) % POOL_MAX_OPEN;
+    if (g->pop == NULL)
+      pthread_mutex_init(&g->lock, NULL);
+  }
+  pthread_mutex_lock(&g->lock);
+  g->pop = pop;
+  snprintf(g->parts, sizeof(g->parts), "%s.parts", path);
+  g->size = pool_parts_size(g->parts);
+  pthread_mutex_unlock(&g->lock);
+  pthread_mutex_unlock(&pool_grow_list_lock);
+}
+
+static struct pool_grow *pool_grow_find(PMEMobjpool *pop) {
+  struct pool_grow *g = NULL;
+
+  pthread_mutex_lock(&pool_grow_list_lock);
+  for (int i = 0; i < POOL_MAX_OPEN && g == NULL; i++)
+    if (pool_grow_list[i].pop == pop)
+      g = &pool_grow_list[i];
+  pthread_mutex_unlock(&pool_grow_list_lock);
+  return g;
+}
+
+// Writes the poolset file for a new pool at path.
+static int pool_set_create(const char *path) {
+  char dir[PATH_MAX], abs_dir[PATH_MAX];
+  FILE *f;
+
+  snprintf(dir, sizeof(dir), "%s.parts", path);
+  if (mkdir(dir, 0777) && errno != EEXIST)
+    return -1;
+  // Poolset parts need absolute paths.
+  if (realpath(dir, abs_dir) == NULL || (f = fopen(path, "wx")) == NULL)
+    return -1;
+  fprintf(f, "PMEMPOOLSET\nOPTION SINGLEHDR\n%s %s/\n", POOL_MAX, abs_dir);
+  return fclose(f);
+}
+
+// Removes a pool created by pool_open, part files and all.
+int pool_remove(const char *path) {
+  char dir[PATH_MAX], part[PATH_MAX + 256];
+  DIR *d;
+  struct dirent *de;
+
+  snprintf(dir, sizeof(dir), "%s.parts", path);
+  if ((d = opendir(dir)) != NULL) {
+    while ((de = readdir(d)) != NULL) {
+      if (de->d_name[0] == '.')
+        continue;
+      snprintf(part, sizeof(part), "%s/%s", dir, de->d_name);
+      unlink(part);
+    }
+    closedir(d);
+    rmdir(dir);
+  }
+  return unlink(path);
+}
 
-  // TOID(struct hashtable_s)* hashtable;
+// Create or open the pool at path and clean up after an interrupted bulk load
+PMEMobjpool *pool_open(const char *path) {
+  PMEMobjpool *pop;
 
   if (access(path, F_OK) != 0) {
-    pop = pmemobj_create(path, POBJ_LAYOUT_NAME(httx), POOL_SIZE, 0666);
+    if (pool_set_create(path))
+      die("failed to create poolset %s: %s\n", path, strerror(errno));
+    pop = pmemobj_create(path, POBJ_LAYOUT_NAME(httx_v3), 0, 0666);
     if (pop == NULL) {
       fprintf(stderr, "failed to create pool: %s\n", pmemobj_errormsg());
       // return 1;
       die("Exit");
     }
   } else {
-    pop = pmemobj_open(path, POBJ_LAYOUT_NAME(httx));
+    pop = pmemobj_open(path, POBJ_LAYOUT_NAME(httx_v3));
     if (pop == NULL) {
       fprintf(stderr, "failed to open pool: %s\n", pmemobj_errormsg());
       // return 1;
@@ -101,6 +331,85 @@ TOID(struct hashtable_s) *
     }
   }
 
+  // pool_reserve grows the heap ahead of the puts; libpmemobj's own on-demand
+  // growth stays on as a fallback for anything larger than the headroom.
+  uint64_t granularity = POOL_GROW;
+  int stats = 1;
+  pmemobj_ctl_set(pop, "heap.size.granularity", &granularity);
+  pmemobj_ctl_set(pop, "stats.enabled", &stats);
+
+  if (nt_threshold == NT_THRESHOLD_AUTO)
+    nt_threshold = ht_nt_calibrate(pop, 0);
+
+  pool_grow_add(pop, path);
+
+  // A bulk load that crashed before going live leaves its table here.
+  TOID(struct root) root = POBJ_ROOT(pop, struct root);
+  ht_reclaim(pop, &D_RW(root)->loading);
+  return pop;
+}
+
+/**
+ * Keeps POOL_GROW bytes of heap free beyond need, extending the pool when
+ * the allocations get closer than that. Small requests are only checked
+ * every POOL_GROW_CHECK calls. Every extension is logged with its latency,
+ * and growth by libpmemobj's fallback when the next check notices it.
+ */
+void pool_reserve(PMEMobjpool *pop, size_t need) {
+  static __thread unsigned tick;
+  struct pool_grow *g;
+  uint64_t used;
+
+  if (need < POOL_GROW / POOL_GROW_CHECK && ++tick % POOL_GROW_CHECK)
+    return;
+  if ((g = pool_grow_find(pop)) == NULL ||
+      pmemobj_ctl_get(pop, "stats.heap.curr_allocated", &used))
+    return;
+
+  pthread_mutex_lock(&g->lock);
+  // The parts only grow, so a pool with headroom by the last look has it.
+  if (g->size == 0 || used + need + POOL_GROW <= g->size)
+    goto out;
+  uint64_t heap = pool_parts_size(g->parts);
+  if (heap > g->size)
+    fprintf(stderr, "pool grew by %lu to %lu MiB inside an allocation\n",
+            (heap - g->size) >> 20, heap >> 20);
+  g->size = heap;
+  if (used + need + POOL_GROW <= heap)
+    goto out;
+
+  uint64_t grow = (need + POOL_GROW - 1) / POOL_GROW * POOL_GROW + POOL_GROW;
+  uint64_t begin_time = rdtsc();
+  if (pmemobj_ctl_exec(pop, "heap.size.extend", &grow)) {
+    fprintf(stderr, "failed to grow pool: %s\n", pmemobj_errormsg());
+    goto out;
+  }
+  uint64_t end_time = rdtsc();
+  g->size = pool_parts_size(g->parts);
+  fprintf(stderr, "pool grew by %lu to %lu MiB in %lu ns\n",
+          (g->size - heap) >> 20, g->size >> 20, end_time - begin_time);
+out:
+  pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * Share of the heap's active runs that isn't allocated, or -1 if the pool
+ * doesn't keep statistics.
+ */
+double pool_fragmentation(PMEMobjpool *pop) {
+  uint64_t allocated, active;
+
+  if (pmemobj_ctl_get(pop, "stats.heap.run_allocated", &allocated) ||
+      pmemobj_ctl_get(pop, "stats.heap.run_active", &active) || active == 0)
+    return -1;
+  return 1.0 - (double)allocated / active;
+}
+
+// Initialize the hashtable in slot ht_id of the pool, creating it if needed
+// If the bucket size passed for a ht is more than previous then it'll auto
+// expand the table
+TOID(struct hashtable_s) *
+    pool_ht(PMEMobjpool *pop, uint64_t ht_id, size_t buck_sz) {
   TOID(struct root) root = POBJ_ROOT(pop, struct root);
 
   /*
@@ -137,21 +446,33 @@ TOID(struct hashtable_s) *
   return &D_RW(root)->ht_list[ht_id];
 }
 
+// Initialize the pool and hashtable
+// If the bucket size passed for a ht is more than previous then it'll auto
+// expand the table
+TOID(struct hashtable_s) *
+    init_pool_ht(const char *path, uint64_t ht_id, size_t buck_sz) {
+  pop = pool_open(path);
+  return pool_ht(pop, ht_id, buck_sz);
+}
+
 void ht_alloc(PMEMobjpool *pop, TOID(struct hashtable_s) * hashtable,
               uint32_t seed, size_t bucket_sz, uint64_t ht_id) {
   size_t len = bucket_sz;
-  size_t sz = sizeof(struct buckets) + len * sizeof(TOID(struct entry));
+  size_t sz = sizeof(struct buckets) + len * sizeof(uint64_t);
+  uint64_t hash_key[2];
 
+  if (hash_secret(hash_key)) {
+    fprintf(stderr, "%s: can't draw a hash secret: %m\n", __func__);
+    abort();
+  }
+  pool_reserve(pop, sz);
   TX_BEGIN(pop) {
-    *hashtable = TX_NEW(struct hashtable_s);
+    *hashtable = TX_ZNEW(struct hashtable_s);
     TX_ADD(*hashtable);
     D_RW(*hashtable)->uuid = ht_id;
     D_RW(*hashtable)->seed = seed;
-    do {
-      D_RW(*hashtable)->hash_fun_a = (uint32_t)rand();
-    } while (D_RW(*hashtable)->hash_fun_a == 0);
-    D_RW(*hashtable)->hash_fun_b = (uint32_t)rand();
-    D_RW(*hashtable)->hash_fun_p = HASH_FUNC_COEFF_P;
+    D_RW(*hashtable)->hash_key[0] = hash_key[0];
+    D_RW(*hashtable)->hash_key[1] = hash_key[1];
 
     D_RW(*hashtable)->buckets = TX_ZALLOC(struct buckets, sz);
     D_RW(D_RW(*hashtable)->buckets)->nbuckets = len;
@@ -165,17 +486,13 @@ void ht_alloc(PMEMobjpool *pop, TOID(struct hashtable_s) * hashtable,
 }
 
 /**
- * hash -- A simple hashing function,
- * see https://en.wikipedia.org/wiki/Universal_hashing#Hashing_integers
+ * hash -- The bucket of value: SipHash-1-3 under the table's secret (see
+ * ht_hash.h), so chain lengths don't depend on which keys are put.
  */
 uint64_t hash(const TOID(struct hashtable_s) * hashtable,
               TOID(struct buckets) * buckets, uint64_t value) {
-  uint32_t a = D_RO(*hashtable)->hash_fun_a;
-  uint32_t b = D_RO(*hashtable)->hash_fun_b;
-  uint64_t p = D_RO(*hashtable)->hash_fun_p;
-  size_t len = D_RO(*buckets)->nbuckets;
-
-  return ((a * value + b) % p) % len;
+  return hash_range(siphash13(D_RO(*hashtable)->hash_key, value),
+                    D_RO(*buckets)->nbuckets);
 }
 
 /**
@@ -191,8 +508,12 @@ int ht_set(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable, uint64_t key,
   int num = 0;
   int ret = 0;
 
-  for (buck = D_RO(buckets)->bucket[h]; !TOID_IS_NULL(buck);
-       buck = D_RO(buck)->next) {
+  if (!OID_IS_NULL(value) && value.pool_uuid_lo != hashtable.oid.pool_uuid_lo)
+    return -1; // entries can only point into their own pool
+  hc_invalidate(hashtable, key);
+
+  for (buck = ENTRY_AT(buckets, D_RO(buckets)->bucket[h]); !TOID_IS_NULL(buck);
+       buck = ENTRY_AT(buck, D_RO(buck)->next)) {
     if (D_RO(buck)->key == key) {
       // Update the value.
       TX_BEGIN(pop) {
@@ -200,7 +521,7 @@ int ht_set(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable, uint64_t key,
         // TOID_ASSIGN(str, D_RW(buck)->value);
         // TX_FREE(str);
         // REVIEW: Super weird that it can't be freed from persistent pointer!
-        D_RW(buck)->value = value;
+        D_RW(buck)->value = value.off;
         ret = 1;
       }
       TX_ONABORT {
@@ -215,15 +536,20 @@ int ht_set(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable, uint64_t key,
   if (ret)
     return ret;
 
+  // Set before the entry is visible, an abort only leaves a false positive.
+  bf_add(hashtable, key);
+  pool_reserve(pop, sizeof(struct entry));
   TX_BEGIN(pop) {
     TX_ADD_FIELD(D_RO(hashtable)->buckets, bucket[h]);
     TX_ADD_FIELD(hashtable, size);
 
     TOID(struct entry) e = TX_NEW(struct entry);
     D_RW(e)->key = key;
-    D_RW(e)->value = value;
+    D_RW(e)->value = value.off;
     D_RW(e)->next = D_RO(buckets)->bucket[h];
-    D_RW(buckets)->bucket[h] = e;
+    D_RW(buckets)->bucket[h] = e.oid.off;
+    if (!TOID_IS_NULL(D_RO(hashtable)->index))
+      bt_insert(hashtable, key, e);
 
     D_RW(hashtable)->size++;
     num++;
@@ -252,8 +578,9 @@ void ht_expand(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
     new_len = D_RO(buckets_old)->nbuckets;
 
   size_t sz_old = sizeof(struct buckets) +
-                  D_RO(buckets_old)->nbuckets * sizeof(TOID(struct entry));
-  size_t sz_new = sizeof(struct buckets) + new_len * sizeof(TOID(struct entry));
+                  D_RO(buckets_old)->nbuckets * sizeof(uint64_t);
+  size_t sz_new = sizeof(struct buckets) + new_len * sizeof(uint64_t);
+  pool_reserve(pop, sz_new);
 
   TX_BEGIN(pop) {
     TX_ADD_FIELD(hashtable, buckets);
@@ -265,13 +592,14 @@ void ht_expand(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
 
     // Move all the old bucket entries to new bucket
     for (size_t i = 0; i < D_RO(buckets_old)->nbuckets; ++i) {
-      while (!TOID_IS_NULL(D_RO(buckets_old)->bucket[i])) {
-        TOID(struct entry) en = D_RO(buckets_old)->bucket[i];
+      while (D_RO(buckets_old)->bucket[i] != 0) {
+        TOID(struct entry) en =
+            ENTRY_AT(buckets_old, D_RO(buckets_old)->bucket[i]);
         uint64_t h = hash(&hashtable, &buckets_new, D_RO(en)->key);
         D_RW(buckets_old)->bucket[i] = D_RO(en)->next;
         TX_ADD_FIELD(en, next);
         D_RW(en)->next = D_RO(buckets_new)->bucket[h];
-        D_RW(buckets_new)->bucket[h] = en;
+        D_RW(buckets_new)->bucket[h] = en.oid.off;
       }
     }
 
@@ -290,25 +618,498 @@ void ht_expand(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
 PMEMoid ht_get(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable_s,
                uint64_t key) {
   TOID(struct buckets) buckets = D_RO(hashtable_s)->buckets;
-  TOID(struct entry) buck;
+  char *base = pool_base(hashtable_s);
+  const struct entry *en;
+  struct bf_s *bf = bf_nopen ? bf_find(hashtable_s) : NULL;
+
+  if (bf != NULL && !bf_may_contain(bf, key))
+    return OID_NULL;
 
   uint64_t h = hash(&hashtable_s, &buckets, key);
 
-  for (buck = D_RO(buckets)->bucket[h]; !TOID_IS_NULL(buck);
-       buck = D_RO(buck)->next)
-    if (D_RO(buck)->key == key)
-      return D_RO(buck)->value;
+  for (en = pool_at(base, D_RO(buckets)->bucket[h]); en != NULL;
+       en = pool_at(base, en->next))
+    if (en->key == key)
+      return oid_at(hashtable_s.oid, en->value);
+  if (bf != NULL)
+    bf_false_positive(bf);
   return OID_NULL;
 }
 
+/*
+ * Multi-gets. ht_get_multi interleaves the lookups of a batch of keys like
+ * AMAC: the bucket slots of the next GET_MULTI_WINDOW keys are prefetched
+ * while the chains of up to GET_MULTI_WINDOW lookups are walked round robin,
+ * each node prefetched a whole round before it is read. The misses of
+ * different chains then overlap instead of stalling one after another.
+ */
+struct get_multi_slot {
+  const struct entry *en;
+  size_t i; // index into keys
+};
+
+/**
+ * Looks up n keys and sets out[i] to the value of keys[i], OID_NULL if it is
+ * not present. Returns the number of keys found.
+ */
+size_t ht_get_multi(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                    const uint64_t *keys, PMEMoid *out, size_t n) {
+  const struct hashtable_s *ht = D_RO(hashtable);
+  const struct buckets *buckets = D_RO(ht->buckets);
+  char *base = pool_base(hashtable);
+  size_t len = buckets->nbuckets;
+  struct bf_s *bf = bf_nopen ? bf_find(hashtable) : NULL;
+  struct get_multi_slot ring[GET_MULTI_WINDOW];
+  size_t hq[GET_MULTI_WINDOW]; // buckets of the keys prefetched ahead
+  size_t next = 0, ahead = 0, found = 0;
+  int head = 0, count = 0;
+
+  for (;;) {
+    // Start lookups, prefetching the bucket of a key a window further on.
+    while (count < GET_MULTI_WINDOW && next < n) {
+      for (; ahead < n && ahead < next + GET_MULTI_WINDOW; ahead++) {
+        hq[ahead % GET_MULTI_WINDOW] =
+            hash_range(siphash13(ht->hash_key, keys[ahead]), len);
+        __builtin_prefetch(&buckets->bucket[hq[ahead % GET_MULTI_WINDOW]]);
+      }
+      size_t i = next++;
+      size_t h = hq[i % GET_MULTI_WINDOW];
+      int maybe = bf == NULL || bf_may_contain(bf, keys[i]);
+      const struct entry *en =
+          maybe ? pool_prefetch(base, buckets->bucket[h]) : NULL;
+      out[i] = OID_NULL;
+      if (en != NULL)
+        ring[(head + count++) % GET_MULTI_WINDOW] =
+            (struct get_multi_slot){en, i};
+      else if (maybe && bf != NULL)
+        bf_false_positive(bf);
+    }
+    if (count == 0)
+      return found;
+
+    struct get_multi_slot s = ring[head];
+    head = (head + 1) % GET_MULTI_WINDOW;
+    count--;
+    if (s.en->key == keys[s.i]) {
+      out[s.i] = oid_at(hashtable.oid, s.en->value);
+      found++;
+      continue;
+    }
+    const struct entry *en = pool_prefetch(base, s.en->next);
+    if (en != NULL)
+      ring[(head + count++) % GET_MULTI_WINDOW] =
+          (struct get_multi_slot){en, s.i};
+    else if (bf != NULL)
+      bf_false_positive(bf);
+  }
+}
+
+/**
+ * Returns 1 if the key was removed, 0 if it wasn't there, -1 if something
+ * failed. The entry and its value are freed in the same transaction.
+ */
+int ht_remove(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+              uint64_t key) {
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  TOID(struct entry) buck;
+  TOID(struct entry) prev = TOID_NULL(struct entry);
+  int ret = 0;
+
+  uint64_t h = hash(&hashtable, &buckets, key);
+
+  for (buck = ENTRY_AT(buckets, D_RO(buckets)->bucket[h]); !TOID_IS_NULL(buck);
+       prev = buck, buck = ENTRY_AT(buck, D_RO(buck)->next))
+    if (D_RO(buck)->key == key)
+      break;
+
+  if (TOID_IS_NULL(buck))
+    return 0;
+
+  hc_invalidate(hashtable, key);
+  TX_BEGIN(pop) {
+    if (TOID_IS_NULL(prev)) {
+      TX_ADD_FIELD(buckets, bucket[h]);
+      D_RW(buckets)->bucket[h] = D_RO(buck)->next;
+    } else {
+      TX_ADD_FIELD(prev, next);
+      D_RW(prev)->next = D_RO(buck)->next;
+    }
+    TX_ADD_FIELD(hashtable, size);
+    D_RW(hashtable)->size--;
+    if (!TOID_IS_NULL(D_RO(hashtable)->index))
+      bt_remove(hashtable, key);
+    ht_value_free(oid_at(buck.oid, D_RO(buck)->value));
+    TX_FREE(buck);
+    ret = 1;
+  }
+  TX_ONABORT {
+    fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+
+  return ret;
+}
+
+/*
+ * Full-table scans. The iterator keeps SCAN_PREFETCH chains in flight and
+ * visits them round robin: every node is prefetched SCAN_PREFETCH steps
+ * before it is read, so the dependent loads of many chains overlap instead
+ * of stalling one after another. Entries come out in no particular order.
+ */
+void ht_iter_init(TOID(struct hashtable_s) hashtable, size_t first,
+                  size_t last, struct ht_iter *it) {
+  it->pool = hashtable.oid;
+  it->base = pool_base(hashtable);
+  it->buckets = D_RO(D_RO(hashtable)->buckets);
+  it->next_bucket = first;
+  it->last_bucket =
+      last < it->buckets->nbuckets ? last : it->buckets->nbuckets;
+  it->head = 0;
+  it->count = 0;
+}
+
+/**
+ * Returns 1 and the next key and value, 0 once the bucket range is done.
+ * The table must not change during the scan.
+ */
+int ht_iter_next(struct ht_iter *it, uint64_t *key, PMEMoid *value) {
+  // Top up the window with the heads of the next buckets.
+  while (it->count < SCAN_PREFETCH && it->next_bucket < it->last_bucket) {
+    __builtin_prefetch(&it->buckets->bucket[it->next_bucket + SCAN_PREFETCH]);
+    const struct entry *e =
+        pool_at(it->base, it->buckets->bucket[it->next_bucket++]);
+    if (e != NULL) {
+      __builtin_prefetch(e);
+      it->ring[(it->head + it->count++) % SCAN_PREFETCH] = e;
+    }
+  }
+  if (it->count == 0)
+    return 0;
+
+  const struct entry *e = it->ring[it->head];
+  it->head = (it->head + 1) % SCAN_PREFETCH;
+  it->count--;
+  *key = e->key;
+  *value = oid_at(it->pool, e->value);
+
+  // The rest of this chain goes to the back of the window.
+  const struct entry *next = pool_at(it->base, e->next);
+  if (next != NULL) {
+    __builtin_prefetch(next);
+    it->ring[(it->head + it->count++) % SCAN_PREFETCH] = next;
+  }
+  return 1;
+}
+
+struct scan_job {
+  TOID(struct hashtable_s) hashtable;
+  size_t first;
+  size_t last;
+  ht_scan_cb cb;
+  void *arg;
+  int ret;
+};
+
+static void *scan_worker(void *arg) {
+  struct scan_job *job = arg;
+  struct ht_iter it;
+  uint64_t key;
+  PMEMoid value;
+
+  ht_iter_init(job->hashtable, job->first, job->last, &it);
+  while (ht_iter_next(&it, &key, &value))
+    if ((job->ret = job->cb(key, value, job->arg)) != 0)
+      break;
+  return NULL;
+}
+
+/**
+ * Scans the table with nthreads threads, each taking a contiguous share of
+ * the buckets and calling cb with its own args[i]. A non-zero return from
+ * cb stops that thread; the first one is returned.
+ */
+int ht_scan_parallel(TOID(struct hashtable_s) hashtable, int nthreads,
+                     ht_scan_cb cb, void *args[]) {
+  size_t nbuckets = D_RO(D_RO(hashtable)->buckets)->nbuckets;
+  struct scan_job *jobs = calloc(nthreads, sizeof(struct scan_job));
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  int ret = 0;
+
+  if (jobs == NULL || threads == NULL) {
+    free(jobs);
+    free(threads);
+    return -1;
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    jobs[i].hashtable = hashtable;
+    jobs[i].first = nbuckets * i / nthreads;
+    jobs[i].last = nbuckets * (i + 1) / nthreads;
+    jobs[i].cb = cb;
+    jobs[i].arg = args[i];
+    // Thread 0 is the caller.
+    if (i > 0 && pthread_create(&threads[i], NULL, scan_worker, &jobs[i]))
+      die("%s: can't start scan thread\n", __func__);
+  }
+  scan_worker(&jobs[0]);
+  for (int i = 0; i < nthreads; i++) {
+    if (i > 0)
+      pthread_join(threads[i], NULL);
+    if (ret == 0)
+      ret = jobs[i].ret;
+  }
+
+  free(threads);
+  free(jobs);
+  return ret;
+}
+
+/*
+ * Optional ordered index for range scans. A persistent B+-tree whose leaves
+ * point at the hash table's own entries, so updates in place don't touch it
+ * and point gets keep using the hash path. Keys of a node fill exactly one
+ * cache line. Inserts and removes run inside the caller's transaction;
+ * removes don't rebalance, emptied leaves stay in the leaf chain.
+ */
+static int bt_search(const struct bt_node *node, uint64_t key) {
+  int i = 0;
+  // First slot whose key is greater than key; BT_ORDER keys is a short scan.
+  while (i < (int)node->n && node->key[i] <= key)
+    i++;
+  return i;
+}
+
+// Inserts (key, oid) into node at pos, the node must have room.
+static void bt_node_insert(struct bt_node *node, int pos, uint64_t key,
+                           PMEMoid oid) {
+  int child = node->leaf ? pos : pos + 1;
+  memmove(&node->key[pos + 1], &node->key[pos],
+          (node->n - pos) * sizeof(uint64_t));
+  memmove(&node->child[child + 1], &node->child[child],
+          (node->n + !node->leaf - child) * sizeof(PMEMoid));
+  node->key[pos] = key;
+  node->child[child] = oid;
+  node->n++;
+}
+
+/**
+ * Splits a full node into node and a new right sibling, returns the sibling
+ * and the separator key: the first key of the right leaf, or the key moved
+ * up from an internal node.
+ */
+static TOID(struct bt_node) bt_split(TOID(struct bt_node) node, uint64_t *sep) {
+  TOID(struct bt_node) right = TX_ZNEW(struct bt_node);
+  struct bt_node *l = D_RW(node);
+  struct bt_node *r = D_RW(right);
+  int mid = BT_ORDER / 2;
+
+  r->leaf = l->leaf;
+  if (l->leaf) {
+    r->n = BT_ORDER - mid;
+    memcpy(r->key, &l->key[mid], r->n * sizeof(uint64_t));
+    memcpy(r->child, &l->child[mid], r->n * sizeof(PMEMoid));
+    r->next = l->next;
+    l->next = right;
+    *sep = r->key[0];
+  } else {
+    r->n = BT_ORDER - mid - 1;
+    memcpy(r->key, &l->key[mid + 1], r->n * sizeof(uint64_t));
+    memcpy(r->child, &l->child[mid + 1], (r->n + 1) * sizeof(PMEMoid));
+    *sep = l->key[mid];
+  }
+  l->n = mid;
+  return right;
+}
+
+// Returns a new right sibling if node had to split, TOID_NULL otherwise.
+static TOID(struct bt_node)
+    bt_insert_rec(TOID(struct bt_node) node, uint64_t key, PMEMoid oid,
+                  uint64_t *sep) {
+  TOID(struct bt_node) right = TOID_NULL(struct bt_node);
+  int pos = bt_search(D_RO(node), key);
+
+  if (!D_RO(node)->leaf) {
+    TOID(struct bt_node) child;
+    TOID_ASSIGN(child, D_RO(node)->child[pos]);
+    uint64_t child_sep;
+    TOID(struct bt_node) split = bt_insert_rec(child, key, oid, &child_sep);
+    if (TOID_IS_NULL(split))
+      return right;
+    key = child_sep;
+    oid = split.oid;
+  } else if (pos > 0 && D_RO(node)->key[pos - 1] == key) {
+    TX_ADD_FIELD(node, child[pos - 1]);
+    D_RW(node)->child[pos - 1] = oid;
+    return right;
+  }
+
+  TX_ADD(node);
+  if (D_RO(node)->n == BT_ORDER) {
+    right = bt_split(node, sep);
+    if (key >= *sep) {
+      node = right;
+    }
+    pos = bt_search(D_RO(node), key);
+  }
+  bt_node_insert(D_RW(node), pos, key, oid);
+  return right;
+}
+
+/**
+ * Maps key to its hash entry in the index, must run inside a transaction.
+ */
+void bt_insert(TOID(struct hashtable_s) hashtable, uint64_t key,
+               TOID(struct entry) e) {
+  TOID(struct bt_node) root = D_RO(hashtable)->index;
+  uint64_t sep;
+
+  TOID(struct bt_node) right = bt_insert_rec(root, key, e.oid, &sep);
+  if (TOID_IS_NULL(right))
+    return;
+
+  // The root split, grow the tree by one level.
+  TOID(struct bt_node) new_root = TX_ZNEW(struct bt_node);
+  D_RW(new_root)->n = 1;
+  D_RW(new_root)->key[0] = sep;
+  D_RW(new_root)->child[0] = root.oid;
+  D_RW(new_root)->child[1] = right.oid;
+  TX_ADD_FIELD(hashtable, index);
+  D_RW(hashtable)->index = new_root;
+}
+
+// Leaf that would hold key.
+static TOID(struct bt_node) bt_find_leaf(TOID(struct bt_node) node,
+                                         uint64_t key) {
+  while (!D_RO(node)->leaf)
+    TOID_ASSIGN(node, D_RO(node)->child[bt_search(D_RO(node), key)]);
+  return node;
+}
+
+/**
+ * Drops key from the index, must run inside a transaction.
+ */
+void bt_remove(TOID(struct hashtable_s) hashtable, uint64_t key) {
+  TOID(struct bt_node) leaf = bt_find_leaf(D_RO(hashtable)->index, key);
+  int pos = bt_search(D_RO(leaf), key) - 1;
+
+  if (pos < 0 || D_RO(leaf)->key[pos] != key)
+    return;
+  TX_ADD(leaf);
+  struct bt_node *l = D_RW(leaf);
+  memmove(&l->key[pos], &l->key[pos + 1], (l->n - pos - 1) * sizeof(uint64_t));
+  memmove(&l->child[pos], &l->child[pos + 1],
+          (l->n - pos - 1) * sizeof(PMEMoid));
+  l->n--;
+}
+
+static void bt_free(TOID(struct bt_node) node) {
+  if (!D_RO(node)->leaf) {
+    for (uint32_t i = 0; i <= D_RO(node)->n; i++) {
+      TOID(struct bt_node) child;
+      TOID_ASSIGN(child, D_RO(node)->child[i]);
+      bt_free(child);
+    }
+  }
+  TX_FREE(node);
+}
+
+/**
+ * Builds the ordered index of a table from its current entries. From then on
+ * ht_set and ht_remove keep it up to date, which adds to their latency.
+ */
+int ht_index_create(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable) {
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  int ret = 0;
+
+  if (!TOID_IS_NULL(D_RO(hashtable)->index))
+    return 0;
+
+  TX_BEGIN(pop) {
+    TX_ADD_FIELD(hashtable, index);
+    D_RW(hashtable)->index = TX_ZNEW(struct bt_node);
+    D_RW(D_RW(hashtable)->index)->leaf = 1;
+    for (size_t i = 0; i < D_RO(buckets)->nbuckets; ++i) {
+      TOID(struct entry) buck;
+      for (buck = ENTRY_AT(buckets, D_RO(buckets)->bucket[i]);
+           !TOID_IS_NULL(buck); buck = ENTRY_AT(buck, D_RO(buck)->next))
+        bt_insert(hashtable, D_RO(buck)->key, buck);
+    }
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+
+  return ret;
+}
+
+void ht_index_drop(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable) {
+  if (TOID_IS_NULL(D_RO(hashtable)->index))
+    return;
+
+  TX_BEGIN(pop) {
+    bt_free(D_RO(hashtable)->index);
+    TX_ADD_FIELD(hashtable, index);
+    D_RW(hashtable)->index = TOID_NULL(struct bt_node);
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+  }
+  TX_END
+}
+
+/**
+ * Positions it on the first key >= lo; ht_range_next then returns keys in
+ * ascending order while they are < hi. The table must not change meanwhile.
+ * Returns -1 if the table has no index.
+ */
+int ht_range_begin(TOID(struct hashtable_s) hashtable, uint64_t lo,
+                   uint64_t hi, struct ht_range_iter *it) {
+  if (TOID_IS_NULL(D_RO(hashtable)->index))
+    return -1;
+
+  it->leaf = bt_find_leaf(D_RO(hashtable)->index, lo);
+  it->pos = 0;
+  it->hi = hi;
+  while (it->pos < D_RO(it->leaf)->n && D_RO(it->leaf)->key[it->pos] < lo)
+    it->pos++;
+  return 0;
+}
+
+/**
+ * Returns 1 and the next key and value of the range, 0 at the end of it.
+ */
+int ht_range_next(struct ht_range_iter *it, uint64_t *key, PMEMoid *value) {
+  while (!TOID_IS_NULL(it->leaf) && it->pos >= D_RO(it->leaf)->n) {
+    it->leaf = D_RO(it->leaf)->next;
+    it->pos = 0;
+  }
+  if (TOID_IS_NULL(it->leaf) || D_RO(it->leaf)->key[it->pos] >= it->hi)
+    return 0;
+
+  TOID(struct entry) e;
+  TOID_ASSIGN(e, D_RO(it->leaf)->child[it->pos]);
+  *key = D_RO(it->leaf)->key[it->pos++];
+  *value = oid_at(e.oid, D_RO(e)->value);
+  return 1;
+}
+
 // Migrating data atomically from ht1 to ht2 and all ht2 will be erased.
 // During migration if system crashes the new changes will not be commited.
 int ht_migrate(TOID(struct hashtable_s) ht1, TOID(struct hashtable_s) ht2) {
 
   int finished = 0;
   TOID(struct buckets) buckets_ht1 = D_RO(ht1)->buckets;
+  hc_invalidate_all(ht1);
+  hc_invalidate_all(ht2);
+  bf_invalidate(ht1);
+  bf_invalidate(ht2);
   size_t sz = sizeof(struct buckets) +
-              D_RO(buckets_ht1)->nbuckets * sizeof(TOID(struct entry));
+              D_RO(buckets_ht1)->nbuckets * sizeof(uint64_t);
   TX_BEGIN(pop) {
     TX_ADD_FIELD(ht1, buckets);
     TOID(struct buckets) buckets_ht2 = TX_ZALLOC(struct buckets, sz);
@@ -317,22 +1118,33 @@ int ht_migrate(TOID(struct hashtable_s) ht1, TOID(struct hashtable_s) ht2) {
                          sz); // ht1 undo logged for contingency.
 
     for (size_t i = 0; i < D_RO(buckets_ht1)->nbuckets; ++i) {
-      while (!TOID_IS_NULL(D_RO(buckets_ht1)->bucket[i])) {
-        TOID(struct entry) en = D_RO(buckets_ht1)->bucket[i];
+      while (D_RO(buckets_ht1)->bucket[i] != 0) {
+        TOID(struct entry) en =
+            ENTRY_AT(buckets_ht1, D_RO(buckets_ht1)->bucket[i]);
         uint64_t h = hash(&ht2, &buckets_ht2, D_RO(en)->key);
         D_RW(buckets_ht1)->bucket[i] = D_RO(en)->next;
         TX_ADD_FIELD(en, next);
         D_RW(en)->next = D_RO(buckets_ht2)->bucket[h];
-        D_RW(buckets_ht2)->bucket[h] = en;
+        D_RW(buckets_ht2)->bucket[h] = en.oid.off;
       }
     }
     D_RW(ht2)->buckets = buckets_ht2;
+    TX_ADD_FIELD(ht2, size);
+    D_RW(ht2)->size = D_RO(ht1)->size;
+    // The index points at the entries, so it moves along with them.
+    if (!TOID_IS_NULL(D_RO(ht2)->index))
+      bt_free(D_RO(ht2)->index);
+    TX_ADD_FIELD(ht2, index);
+    D_RW(ht2)->index = D_RO(ht1)->index;
 
     // Erase ht1
     TX_FREE(buckets_ht1);
     TX_FREE(ht1);
   }
-  TX_ONCOMMIT { finished = 1; }
+  TX_ONCOMMIT {
+    finished = 1;
+    hc_rebind(ht1, TOID_NULL(struct hashtable_s));
+  }
   TX_ONABORT {
     fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
             pmemobj_errormsg());
@@ -342,35 +1154,3890 @@ int ht_migrate(TOID(struct hashtable_s) ht1, TOID(struct hashtable_s) ht2) {
   return finished;
 }
 
-TOID_DECLARE(char, 0);
-int main(int argc, char *argv[]) {
+/**
+ * Moves keys from src to dst atomically, in one transaction. Their entries
+ * are unlinked from src and linked into dst as they are, so values are not
+ * copied and only the bucket heads and next fields that change, plus both
+ * sizes, go to the undo log. A key already in dst is replaced, keys that
+ * aren't in src are skipped. Returns the number of keys moved, -1 if the
+ * transaction aborted.
+ */
+int64_t ht_move_keys(PMEMobjpool *pop, TOID(struct hashtable_s) src,
+                     TOID(struct hashtable_s) dst, const uint64_t *keys,
+                     size_t n) {
+  TOID(struct buckets) buckets_src = D_RO(src)->buckets;
+  TOID(struct buckets) buckets_dst = D_RO(dst)->buckets;
+  int64_t moved = 0, added = 0;
 
-  const char *path = argv[1];
+  if (TOID_EQUALS(src, dst))
+    return 0;
+  for (size_t i = 0; i < n; i++) {
+    hc_invalidate(src, keys[i]);
+    hc_invalidate(dst, keys[i]);
+    bf_add(dst, keys[i]);
+  }
 
-  // Simple test
-  TOID(struct hashtable_s) *ht = init_pool_ht(path, 0, 10);
-  char *test =
-      "What is the ultimate answer for life, the universe, and everything?\0";
-  PMEMoid TESToid;
+  TX_BEGIN(pop) {
+    for (size_t i = 0; i < n; i++) {
+      uint64_t key = keys[i];
+      uint64_t h = hash(&src, &buckets_src, key);
+      TOID(struct entry) en, prev = TOID_NULL(struct entry);
 
-  TX_BEGIN(pop) { TESToid = TX_STRDUP(test, 0); }
-  TX_ONABORT {
-    fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
-  }
-  TX_END
+      for (en = ENTRY_AT(buckets_src, D_RO(buckets_src)->bucket[h]);
+           !TOID_IS_NULL(en); prev = en, en = ENTRY_AT(en, D_RO(en)->next))
+        if (D_RO(en)->key == key)
+          break;
+      if (TOID_IS_NULL(en))
+        continue;
 
-  if (!ht_set(pop, *ht, 42, TESToid)) {
-    char *val = pmemobj_direct(ht_get(pop, *ht, 42));
-    printf("%s\n", val);
-  }
+      // Unlink from src.
+      if (TOID_IS_NULL(prev)) {
+        TX_ADD_FIELD(buckets_src, bucket[h]);
+        D_RW(buckets_src)->bucket[h] = D_RO(en)->next;
+      } else {
+        TX_ADD_FIELD(prev, next);
+        D_RW(prev)->next = D_RO(en)->next;
+      }
+      if (!TOID_IS_NULL(D_RO(src)->index))
+        bt_remove(src, key);
 
-  pmemobj_close(pop);
-  // FIXEME: Have to close the pool to open new HT,
+      // Link into dst, in place of its own entry for the key if it has one.
+      TOID(struct entry) old;
+      h = hash(&dst, &buckets_dst, key);
+      prev = TOID_NULL(struct entry);
+      for (old = ENTRY_AT(buckets_dst, D_RO(buckets_dst)->bucket[h]);
+           !TOID_IS_NULL(old); prev = old, old = ENTRY_AT(old, D_RO(old)->next))
+        if (D_RO(old)->key == key)
+          break;
+
+      TX_ADD_FIELD(en, next);
+      if (TOID_IS_NULL(old)) {
+        D_RW(en)->next = D_RO(buckets_dst)->bucket[h];
+        prev = TOID_NULL(struct entry); // new keys go to the head
+        added++;
+      } else {
+        D_RW(en)->next = D_RO(old)->next;
+      }
+      if (TOID_IS_NULL(prev)) {
+        TX_ADD_FIELD(buckets_dst, bucket[h]);
+        D_RW(buckets_dst)->bucket[h] = en.oid.off;
+      } else {
+        TX_ADD_FIELD(prev, next);
+        D_RW(prev)->next = en.oid.off;
+      }
+      if (!TOID_IS_NULL(D_RO(dst)->index)) {
+        if (!TOID_IS_NULL(old))
+          bt_remove(dst, key);
+        bt_insert(dst, key, en);
+      }
+      if (!TOID_IS_NULL(old)) {
+        ht_value_free(oid_at(old.oid, D_RO(old)->value));
+        TX_FREE(old);
+      }
+      moved++;
+    }
+
+    TX_ADD_FIELD(src, size);
+    D_RW(src)->size -= moved;
+    TX_ADD_FIELD(dst, size);
+    D_RW(dst)->size += added;
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    moved = -1;
+  }
+  TX_END
+
+  return moved;
+}
+
+/*
+ * Online compaction. Entries allocated over time end up far apart, so every
+ * hop of a chain is another page. A compaction step copies the entries of a
+ * few chains, in chain order, into units of a dedicated allocation class;
+ * a class's runs hand out units in address order, so each chain comes out
+ * contiguous, four entries to three cache lines. The bucket head, the next
+ * fields and the ordered index are repointed and the old entries freed in
+ * the same transaction. Chains that are already contiguous are skipped.
+ * With HT_COMPACT_VALUES the values of those chains then move into holes
+ * lower in the heap.
+ * Relocation invalidates open iterators and ht_get_iov spans, and nothing
+ * else may use the table during a step; ht_compact_start runs the steps in a
+ * background thread that takes the caller's lock for each one.
+ */
+#define HT_COMPACT_VALUES 1
+#define COMPACT_UNIT 48 // an entry and its allocation header, 16-byte aligned
+#define COMPACT_MAX_POOLS 16
+
+struct ht_compact_stats {
+  uint64_t steps;
+  uint64_t buckets;
+  uint64_t entries; // relocated entries
+  uint64_t values;  // value objects moved
+};
+
+static struct {
+  PMEMobjpool *pop;
+  unsigned class_id;
+} compact_classes[COMPACT_MAX_POOLS];
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocation flags for compacted entries. The class is made once per pool
+// handle; a handle that reuses the address of a closed one won't find the
+// old class and makes its own. Without a class they use the default ones.
+static uint64_t compact_alloc_flags(PMEMobjpool *pop) {
+  static unsigned next_slot;
+  struct pobj_alloc_class_desc desc;
+  char name[64];
+  int i;
+
+  pthread_mutex_lock(&compact_lock);
+  for (i = 0; i < COMPACT_MAX_POOLS && compact_classes[i].pop != pop; i++)
+    ;
+  if (i < COMPACT_MAX_POOLS) {
+    snprintf(name, sizeof(name), "heap.alloc_class.%u.desc",
+             compact_classes[i].class_id);
+    if (pmemobj_ctl_get(pop, name, &desc) == 0 &&
+        desc.unit_size == COMPACT_UNIT)
+      goto out;
+  } else {
+    i = next_slot++ % COMPACT_MAX_POOLS;
+  }
+
+  desc = (struct pobj_alloc_class_desc){COMPACT_UNIT, 0, 1024,
+                                        POBJ_HEADER_COMPACT, 0};
+  compact_classes[i].pop = NULL;
+  if (pmemobj_ctl_set(pop, "heap.alloc_class.new.desc", &desc) == 0) {
+    compact_classes[i].pop = pop;
+    compact_classes[i].class_id = desc.class_id;
+  }
+out:
+  pthread_mutex_unlock(&compact_lock);
+  return compact_classes[i].pop == pop
+             ? POBJ_CLASS_ID(compact_classes[i].class_id)
+             : 0;
+}
+
+// A chain whose entries follow each other in memory.
+static int compact_chain_done(TOID(struct entry) en) {
+  for (; !TOID_IS_NULL(en) && D_RO(en)->next != 0;
+       en = ENTRY_AT(en, D_RO(en)->next))
+    if (D_RO(en)->next - en.oid.off != COMPACT_UNIT)
+      return 0;
+  return 1;
+}
+
+/*
+ * Moves the first object of an entry's value to a lower address if the
+ * allocator has room for it there. pmemobj_defrag can't update the entry's
+ * compact pointer, so the copy is reserved, and published together with
+ * the new pointer and the free of the old object. Returns the value.
+ */
+static PMEMoid compact_value_head(PMEMobjpool *pop, TOID(struct entry) en,
+                                  struct ht_compact_stats *stats) {
+  PMEMoid value = oid_at(en.oid, D_RO(en)->value);
+  struct pobj_action act[3];
+
+  if (OID_IS_NULL(value))
+    return value;
+  size_t size = pmemobj_alloc_usable_size(value);
+  PMEMoid moved = pmemobj_reserve(pop, &act[0], size, pmemobj_type_num(value));
+  if (OID_IS_NULL(moved))
+    return value;
+  if (moved.off > value.off) {
+    pmemobj_cancel(pop, act, 1);
+    return value;
+  }
+  pmemobj_memcpy_persist(pop, pmemobj_direct(moved), pmemobj_direct(value),
+                         size);
+  pmemobj_set_value(pop, &act[1], &D_RW(en)->value, moved.off);
+  pmemobj_defer_free(pop, value, &act[2]);
+  if (pmemobj_publish(pop, act, 3)) {
+    pmemobj_cancel(pop, act, 1); // gives the reserved copy back
+    return value;
+  }
+  stats->values++;
+  return moved;
+}
+
+// Moves the values of a chain: first objects one by one, the extents after
+// them, which are linked by PMEMoids, through pmemobj_defrag.
+static void compact_values(PMEMobjpool *pop, TOID(struct entry) en,
+                           struct ht_compact_stats *stats) {
+  PMEMoid **oidv = NULL;
+  size_t n = 0, cap = 0;
+
+  for (; !TOID_IS_NULL(en); en = ENTRY_AT(en, D_RO(en)->next)) {
+    PMEMoid value = compact_value_head(pop, en, stats);
+    if (OID_IS_NULL(value) ||
+        pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent))
+      continue;
+    PMEMoid *p = &((struct extent *)pmemobj_direct(value))->next.oid;
+    while (!OID_IS_NULL(*p)) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 16;
+        PMEMoid **v = realloc(oidv, cap * sizeof(*oidv));
+        if (v == NULL)
+          goto out;
+        oidv = v;
+      }
+      oidv[n++] = p;
+      if (pmemobj_type_num(*p) != TOID_TYPE_NUM(struct extent))
+        break;
+      p = &((struct extent *)pmemobj_direct(*p))->next.oid;
+    }
+  }
+
+  struct pobj_defrag_result result = {0, 0};
+  if (n && pmemobj_defrag(pop, oidv, n, &result) == 0)
+    stats->values += result.relocated;
+out:
+  free(oidv);
+}
+
+/**
+ * Compacts the chains of up to nbuckets buckets from *cursor on in one
+ * transaction and advances *cursor. Returns the number of buckets covered,
+ * 0 once *cursor has passed the last bucket, or -1 if the step failed and
+ * changed nothing.
+ */
+int64_t ht_compact_step(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                        size_t *cursor, size_t nbuckets, int flags,
+                        struct ht_compact_stats *stats) {
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  size_t first = *cursor, last = first + nbuckets;
+  uint64_t aflags = compact_alloc_flags(pop);
+  int has_index = !TOID_IS_NULL(D_RO(hashtable)->index);
+  int64_t moved = 0;
+
+  if (last > D_RO(buckets)->nbuckets)
+    last = D_RO(buckets)->nbuckets;
+  if (first >= last)
+    return 0;
+
+  pool_reserve(pop, (last - first) * 4 * COMPACT_UNIT);
+  TX_BEGIN(pop) {
+    for (size_t h = first; h < last; h++) {
+      TOID(struct entry) en = ENTRY_AT(buckets, D_RO(buckets)->bucket[h]);
+      TOID(struct entry) prev = TOID_NULL(struct entry), next;
+      if (compact_chain_done(en))
+        continue;
+      TX_ADD_FIELD(buckets, bucket[h]);
+      for (; !TOID_IS_NULL(en); en = next) {
+        TOID(struct entry) e = TX_XALLOC(struct entry, sizeof(struct entry),
+                                         aflags);
+        *D_RW(e) = *D_RO(en);
+        next = ENTRY_AT(en, D_RO(en)->next);
+        if (TOID_IS_NULL(prev))
+          D_RW(buckets)->bucket[h] = e.oid.off;
+        else
+          D_RW(prev)->next = e.oid.off;
+        if (has_index)
+          bt_insert(hashtable, D_RO(e)->key, e);
+        TX_FREE(en);
+        prev = e;
+        moved++;
+      }
+    }
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    moved = -1;
+  }
+  TX_END
+
+  if (moved == -1)
+    return -1;
+  if (flags & HT_COMPACT_VALUES)
+    for (size_t h = first; h < last; h++)
+      compact_values(pop, ENTRY_AT(buckets, D_RO(buckets)->bucket[h]), stats);
+  stats->steps++;
+  stats->buckets += last - first;
+  stats->entries += moved;
+  *cursor = last;
+  return last - first;
+}
+
+/**
+ * Background compaction, one pass over the table in steps of step buckets.
+ * Every step holds lock for writing, if there is one, and the thread sleeps
+ * pause_us between steps so that it only takes a share of the table.
+ */
+struct ht_compactor {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) hashtable;
+  int flags;
+  size_t step;
+  unsigned pause_us;
+  pthread_rwlock_t *lock;
+  int stop;
+  int done;
+  int ret;
+  struct ht_compact_stats stats;
+  pthread_t thread;
+};
+
+static void *compactor(void *arg) {
+  struct ht_compactor *c = arg;
+  size_t cursor = 0;
+  int64_t ret = 1;
+
+  while (ret > 0 && !__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+    if (c->lock)
+      pthread_rwlock_wrlock(c->lock);
+    ret = ht_compact_step(c->pop, c->hashtable, &cursor, c->step, c->flags,
+                          &c->stats);
+    if (c->lock)
+      pthread_rwlock_unlock(c->lock);
+    if (ret > 0 && c->pause_us)
+      usleep(c->pause_us);
+  }
+  c->ret = ret < 0 ? -1 : 0;
+  __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Non-zero once the pass is over.
+int ht_compact_done(struct ht_compactor *c) {
+  return __atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+}
+
+struct ht_compactor *ht_compact_start(PMEMobjpool *pop,
+                                      TOID(struct hashtable_s) hashtable,
+                                      int flags, size_t step,
+                                      unsigned pause_us,
+                                      pthread_rwlock_t *lock) {
+  struct ht_compactor *c = calloc(1, sizeof(struct ht_compactor));
+  if (c == NULL)
+    return NULL;
+  c->pop = pop;
+  c->hashtable = hashtable;
+  c->flags = flags;
+  c->step = step ? step : 1;
+  c->pause_us = pause_us;
+  c->lock = lock;
+  if (pthread_create(&c->thread, NULL, compactor, c) != 0) {
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/**
+ * Waits for the pass to finish, or stops it after the current step if stop
+ * is set. Returns 0, or -1 if a step failed.
+ */
+int ht_compact_finish(struct ht_compactor *c, int stop,
+                      struct ht_compact_stats *stats) {
+  __atomic_store_n(&c->stop, stop, __ATOMIC_RELAXED);
+  pthread_join(c->thread, NULL);
+  int ret = c->ret;
+  if (stats)
+    *stats = c->stats;
+  free(c);
+  return ret;
+}
+
+/*
+ * Bulk value writes. Each value is copied into a freshly reserved allocation
+ * without a drain; values of at least nt_threshold bytes use non-temporal
+ * stores so multi-kilobyte values bypass the cache instead of being written
+ * twice. ht_vbatch_publish then issues a single drain for the whole batch
+ * and publishes the reservations, inside the caller's transaction if any.
+ */
+#define NT_CALIBRATE_MIN 128
+#define NT_CALIBRATE_MAX (256 * 1024)
+#define NT_CALIBRATE_COPIES 32
+
+struct ht_vbatch {
+  size_t n;
+  size_t cap;
+  struct pobj_action *actv;
+};
+
+static void vb_copy(PMEMobjpool *pop, void *dst, const void *src, size_t len,
+                    int nt) {
+  pmemobj_memcpy(pop, dst, src, len,
+                 PMEMOBJ_F_MEM_NODRAIN | (nt ? PMEMOBJ_F_MEM_NONTEMPORAL
+                                             : PMEMOBJ_F_MEM_TEMPORAL));
+}
+
+// Reserves size bytes of type type_num as part of the batch.
+static PMEMoid vb_reserve(PMEMobjpool *pop, struct ht_vbatch *vb, size_t size,
+                          uint64_t type_num) {
+  if (vb->n == vb->cap) {
+    size_t cap = vb->cap ? vb->cap * 2 : 64;
+    struct pobj_action *actv = realloc(vb->actv, cap * sizeof(*actv));
+    if (actv == NULL)
+      return OID_NULL;
+    vb->actv = actv;
+    vb->cap = cap;
+  }
+
+  pool_reserve(pop, size);
+  PMEMoid oid = pmemobj_reserve(pop, &vb->actv[vb->n], size, type_num);
+  if (!OID_IS_NULL(oid))
+    vb->n++;
+  return oid;
+}
+
+/**
+ * Reserves len bytes and copies value into them, the copy is not drained.
+ * Returns OID_NULL if the reservation failed.
+ */
+PMEMoid ht_vbatch_add(PMEMobjpool *pop, struct ht_vbatch *vb,
+                      const void *value, size_t len) {
+  PMEMoid oid = vb_reserve(pop, vb, len, 0);
+  if (!OID_IS_NULL(oid))
+    vb_copy(pop, pmemobj_direct(oid), value, len, len >= nt_threshold);
+  return oid;
+}
+
+/**
+ * Like ht_vbatch_add, but stores len bytes of binary data as a chain of
+ * extents with an explicit length. Returns the first extent.
+ */
+PMEMoid ht_vbatch_add_extents(PMEMobjpool *pop, struct ht_vbatch *vb,
+                              const void *value, size_t len) {
+  size_t per = EXTENT_SIZE - sizeof(struct extent);
+  size_t nextents = len ? (len + per - 1) / per : 1;
+  TOID(struct extent) next = TOID_NULL(struct extent);
+
+  // Built back to front so every extent knows its successor.
+  for (size_t i = nextents; i-- > 0;) {
+    size_t off = i * per;
+    size_t n = len - off < per ? len - off : per;
+    struct extent hdr = {i == 0 ? len : 0, n, next};
+    PMEMoid oid = vb_reserve(pop, vb, sizeof(struct extent) + n,
+                             TOID_TYPE_NUM(struct extent));
+    if (OID_IS_NULL(oid))
+      return OID_NULL;
+    struct extent *ext = pmemobj_direct(oid);
+    pmemobj_memcpy(pop, ext, &hdr, sizeof(hdr), PMEMOBJ_F_MEM_NODRAIN);
+    vb_copy(pop, ext->data, (const char *)value + off, n, n >= nt_threshold);
+    TOID_ASSIGN(next, oid);
+  }
+  return next.oid;
+}
+
+/**
+ * One drain for every copy in the batch, then publish the reservations.
+ * Inside a transaction they only become durable if the transaction commits.
+ */
+int ht_vbatch_publish(PMEMobjpool *pop, struct ht_vbatch *vb) {
+  int ret = 0;
+
+  if (vb->n == 0)
+    return 0;
+  pmemobj_drain(pop);
+  if (pmemobj_tx_stage() == TX_STAGE_WORK)
+    ret = pmemobj_tx_publish(vb->actv, vb->n);
+  else
+    ret = pmemobj_publish(pop, vb->actv, vb->n);
+  vb->n = 0;
+  return ret;
+}
+
+void ht_vbatch_cancel(PMEMobjpool *pop, struct ht_vbatch *vb) {
+  pmemobj_cancel(pop, vb->actv, vb->n);
+  vb->n = 0;
+}
+
+void ht_vbatch_free(struct ht_vbatch *vb) {
+  free(vb->actv);
+  vb->actv = NULL;
+  vb->n = vb->cap = 0;
+}
+
+// Time NT_CALIBRATE_COPIES reserve+copy+drain rounds of len bytes.
+static uint64_t nt_time_copies(PMEMobjpool *pop, struct pobj_action *actv,
+                               const char *src, size_t len, int nt) {
+  uint64_t begin = rdtsc();
+  size_t n = 0;
+
+  for (; n < NT_CALIBRATE_COPIES; n++) {
+    PMEMoid oid = pmemobj_reserve(pop, &actv[n], len, 0);
+    if (OID_IS_NULL(oid))
+      break;
+    vb_copy(pop, pmemobj_direct(oid), src, len, nt);
+  }
+  pmemobj_drain(pop);
+  uint64_t end = rdtsc();
+  pmemobj_cancel(pop, actv, n); // leaves nothing behind in the pool
+  return n == NT_CALIBRATE_COPIES ? end - begin : UINT64_MAX;
+}
+
+/**
+ * Measures cached vs. non-temporal batch copies for power of two sizes and
+ * returns the smallest size from which non-temporal stores keep winning.
+ */
+size_t ht_nt_calibrate(PMEMobjpool *pop, int verbose) {
+  struct pobj_action actv[NT_CALIBRATE_COPIES];
+  size_t threshold = NT_CALIBRATE_MAX * 2; // never, unless NT wins
+  char *src = malloc(NT_CALIBRATE_MAX);
+
+  if (src == NULL)
+    return threshold;
+  memset(src, 'V', NT_CALIBRATE_MAX);
+
+  for (size_t len = NT_CALIBRATE_MIN; len <= NT_CALIBRATE_MAX; len *= 2) {
+    // Warm up the allocator's runs for this size first.
+    nt_time_copies(pop, actv, src, len, 0);
+    uint64_t t = nt_time_copies(pop, actv, src, len, 0);
+    uint64_t nt = nt_time_copies(pop, actv, src, len, 1);
+    if (verbose)
+      printf("\t%7zu B: cached %6lu ns, non-temporal %6lu ns\n", len,
+             t / NT_CALIBRATE_COPIES, nt / NT_CALIBRATE_COPIES);
+    if (nt < t) {
+      if (threshold > len)
+        threshold = len;
+    } else {
+      threshold = NT_CALIBRATE_MAX * 2;
+    }
+  }
+  free(src);
+  return threshold;
+}
+
+/*
+ * Length-prefixed values. ht_put splits the value into extents of at most
+ * EXTENT_SIZE and ht_get_iov hands back (pointer, length) spans straight
+ * into the pool, so binary blobs are neither copied nor strlen'ed.
+ */
+
+/**
+ * Frees a value inside the current transaction, whatever its format.
+ */
+void ht_value_free(PMEMoid value) {
+  if (OID_IS_NULL(value))
+    return;
+  if (pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent)) {
+    pmemobj_tx_free(value);
+    return;
+  }
+  TOID(struct extent) ext;
+  TOID_ASSIGN(ext, value);
+  while (!TOID_IS_NULL(ext)) {
+    TOID(struct extent) next = D_RO(ext)->next;
+    TX_FREE(ext);
+    ext = next;
+  }
+}
+
+/**
+ * Returns the length of a value, without the NUL for plain strings.
+ */
+size_t ht_value_len(PMEMoid value) {
+  if (OID_IS_NULL(value))
+    return 0;
+  if (pmemobj_type_num(value) == TOID_TYPE_NUM(struct extent))
+    return ((struct extent *)pmemobj_direct(value))->total;
+  return strlen(pmemobj_direct(value));
+}
+
+/**
+ * Stores len bytes of binary data under key, replacing and freeing any old
+ * value. Returns 0/1 like ht_set, -1 if something failed.
+ */
+int ht_put(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable, uint64_t key,
+           const void *value, size_t len) {
+  struct ht_vbatch vb = {0};
+  int ret = 0;
+
+  PMEMoid oid = ht_vbatch_add_extents(pop, &vb, value, len);
+  if (OID_IS_NULL(oid)) {
+    fprintf(stderr, "%s: can't reserve value: %s\n", __func__,
+            pmemobj_errormsg());
+    ht_vbatch_cancel(pop, &vb);
+    ht_vbatch_free(&vb);
+    return -1;
+  }
+
+  TX_BEGIN(pop) {
+    ht_vbatch_publish(pop, &vb);
+    PMEMoid old = ht_get(pop, hashtable, key);
+    ret = ht_set(pop, hashtable, key, oid);
+    if (ret == -1)
+      pmemobj_tx_abort(EINVAL);
+    ht_value_free(old);
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+
+  ht_vbatch_free(&vb);
+  return ret;
+}
+
+/**
+ * Zero-copy read: fills iov with up to iovcnt spans pointing into the pool
+ * and sets *len to the value length. Returns the number of spans the value
+ * has (retry with a larger iov if that is more than iovcnt), or -1 if the
+ * key is not present. Spans stay valid until the key is overwritten or
+ * removed.
+ */
+int ht_get_iov(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+               uint64_t key, struct iovec *iov, int iovcnt, size_t *len) {
+  PMEMoid value = ht_get(pop, hashtable, key);
+  int n = 0;
+
+  if (OID_IS_NULL(value))
+    return -1;
+  *len = ht_value_len(value);
+
+  if (pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent)) {
+    if (iovcnt > 0) {
+      iov[0].iov_base = pmemobj_direct(value);
+      iov[0].iov_len = *len;
+    }
+    return 1;
+  }
+
+  TOID(struct extent) ext;
+  TOID_ASSIGN(ext, value);
+  for (; !TOID_IS_NULL(ext); ext = D_RO(ext)->next, n++) {
+    if (n < iovcnt) {
+      iov[n].iov_base = D_RW(ext)->data;
+      iov[n].iov_len = D_RO(ext)->len;
+    }
+  }
+  return n;
+}
+
+/*
+ * Fixed-width values. ht_put_u64 stores 8 bytes as a one-extent ht_put value,
+ * and from then on ht_put_u64, ht_cas and ht_fetch_add change them in place:
+ * an atomic store or read-modify-write followed by one persist, without a
+ * transaction or an allocation. They are safe against each other from any
+ * number of threads. Only the first put of a key allocates, and u64_lock
+ * serializes those inserts; ht_set, ht_remove and ht_expand on the same table
+ * still need the caller's own locking. Another thread can read a new value
+ * shortly before it is persistent. The 8 bytes live in a value object rather
+ * than in the entry so that ht_get, iterators, exports and caches get them
+ * as a PMEMoid like any other value; that costs a read more than ht_get and
+ * a 64-byte allocation per key, which Test 27 measures.
+ */
+static pthread_mutex_t u64_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The 8 bytes of key's value, NULL if it has none or it isn't fixed-width.
+static uint64_t *u64_slot(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                          uint64_t key, int *exists) {
+  PMEMoid value = ht_get(pop, hashtable, key);
+
+  *exists = !OID_IS_NULL(value);
+  if (!*exists || pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent))
+    return NULL;
+  struct extent *ext = pmemobj_direct(value);
+  if (pm_emul_on)
+    pm_emul_touch(ext);
+  if (ext->total != sizeof(uint64_t) || ext->len != sizeof(uint64_t))
+    return NULL;
+  return (uint64_t *)ext->data;
+}
+
+static void u64_persist(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                        uint64_t key, uint64_t *slot) {
+  pmemobj_persist(pop, slot, sizeof(*slot));
+  hc_invalidate(hashtable, key);
+}
+
+// Inserts key with value v, unless another thread got there first.
+static uint64_t *u64_insert(PMEMobjpool *pop,
+                            TOID(struct hashtable_s) hashtable, uint64_t key,
+                            uint64_t v, int replace) {
+  uint64_t *slot;
+  int exists;
+
+  pthread_mutex_lock(&u64_lock);
+  slot = u64_slot(pop, hashtable, key, &exists);
+  if (slot == NULL && (!exists || replace) &&
+      ht_put(pop, hashtable, key, &v, sizeof(v)) != -1)
+    slot = u64_slot(pop, hashtable, key, &exists);
+  pthread_mutex_unlock(&u64_lock);
+  return slot;
+}
+
+/**
+ * Sets key to the 8 byte value v, replacing any other value. Returns 0, or -1
+ * if something failed.
+ */
+int ht_put_u64(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+               uint64_t key, uint64_t v) {
+  int exists;
+  uint64_t *slot = u64_slot(pop, hashtable, key, &exists);
+
+  if (slot == NULL)
+    return u64_insert(pop, hashtable, key, v, 1) == NULL ? -1 : 0;
+  __atomic_store_n(slot, v, __ATOMIC_RELEASE);
+  u64_persist(pop, hashtable, key, slot);
+  return 0;
+}
+
+/**
+ * Reads a fixed-width value. Returns 0, or -1 if key has no such value.
+ */
+int ht_get_u64(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+               uint64_t key, uint64_t *v) {
+  int exists;
+  uint64_t *slot = u64_slot(pop, hashtable, key, &exists);
+
+  if (slot == NULL)
+    return -1;
+  *v = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+/**
+ * Replaces key's value with desired if it is *expected. Returns 1 if it was
+ * swapped, 0 if not, with the current value in *expected, or -1 if key has
+ * no fixed-width value.
+ */
+int ht_cas(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable, uint64_t key,
+           uint64_t *expected, uint64_t desired) {
+  int exists;
+  uint64_t *slot = u64_slot(pop, hashtable, key, &exists);
+
+  if (slot == NULL)
+    return -1;
+  if (!__atomic_compare_exchange_n(slot, expected, desired, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+  u64_persist(pop, hashtable, key, slot);
+  return 1;
+}
+
+/**
+ * Adds delta to key's value and sets *old to the value before, a missing key
+ * starting from 0. Returns 0, or -1 if key holds a value that isn't
+ * fixed-width or something failed.
+ */
+int ht_fetch_add(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                 uint64_t key, uint64_t delta, uint64_t *old) {
+  int exists;
+  uint64_t *slot = u64_slot(pop, hashtable, key, &exists);
+
+  if (slot == NULL && !exists)
+    slot = u64_insert(pop, hashtable, key, 0, 0);
+  if (slot == NULL)
+    return -1;
+  *old = __atomic_fetch_add(slot, delta, __ATOMIC_ACQ_REL);
+  u64_persist(pop, hashtable, key, slot);
+  return 0;
+}
+
+/*
+ * Write batches: puts and removes across any tables of one pool that become
+ * visible together. Puts keep a DRAM copy of the value until ht_batch_commit,
+ * which sorts the operations by table and bucket and keeps only the last one
+ * per key. Values and new entries are then reserved and written outside the
+ * transaction, with a single drain, and the transaction only publishes them
+ * and relinks chains. Every bucket head, next field and size it touches goes
+ * to the undo log once, however many operations share it.
+ */
+struct ht_batch_op {
+  TOID(struct hashtable_s) hashtable;
+  uint64_t key;
+  char *value; // NULL marks a remove
+  size_t len;  // including the terminating 0
+  size_t seq;  // order of the calls, the last one for a key wins
+  uint64_t bucket;
+  TOID(struct entry) old; // the key's entry at commit time, if any
+  TOID(struct entry) en;  // reserved entry for a new key
+  PMEMoid pval;           // reserved copy of value
+  // Bucket head before and after the commit, on the first op of a bucket.
+  TOID(struct entry) was_head;
+  TOID(struct entry) head;
+  // Set on the remove of the first entry of a run of removed entries: the
+  // survivor before the run (NULL if it starts the chain) and the one after.
+  int fix;
+  TOID(struct entry) fix_prev;
+  TOID(struct entry) fix_next;
+};
+
+struct ht_batch {
+  struct ht_batch_op *ops;
+  size_t n;
+  size_t cap;
+};
+
+static int hb_add(struct ht_batch *b, TOID(struct hashtable_s) hashtable,
+                  uint64_t key, const char *value) {
+  if (b->n == b->cap) {
+    size_t cap = b->cap ? b->cap * 2 : 64;
+    struct ht_batch_op *ops = realloc(b->ops, cap * sizeof(*ops));
+    if (ops == NULL)
+      return -1;
+    b->ops = ops;
+    b->cap = cap;
+  }
+
+  struct ht_batch_op *op = &b->ops[b->n];
+  op->hashtable = hashtable;
+  op->key = key;
+  op->value = NULL;
+  op->len = 0;
+  if (value != NULL) {
+    op->len = strlen(value) + 1;
+    if ((op->value = malloc(op->len)) == NULL)
+      return -1;
+    memcpy(op->value, value, op->len);
+  }
+  op->seq = b->n++;
+  return 0;
+}
+
+/**
+ * Adds a put of a string value to the batch. Returns -1 if out of memory.
+ */
+int ht_batch_put(struct ht_batch *b, TOID(struct hashtable_s) hashtable,
+                 uint64_t key, const char *value) {
+  return hb_add(b, hashtable, key, value);
+}
+
+int ht_batch_remove(struct ht_batch *b, TOID(struct hashtable_s) hashtable,
+                    uint64_t key) {
+  return hb_add(b, hashtable, key, NULL);
+}
+
+static int hb_cmp(const void *a, const void *b) {
+  const struct ht_batch_op *x = a, *y = b;
+
+  if (x->hashtable.oid.off != y->hashtable.oid.off)
+    return x->hashtable.oid.off < y->hashtable.oid.off ? -1 : 1;
+  if (x->bucket != y->bucket)
+    return x->bucket < y->bucket ? -1 : 1;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Drops every op but the last one for each key; ops must be sorted.
+static size_t hb_dedup(struct ht_batch *b) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < b->n; i++) {
+    struct ht_batch_op *op = &b->ops[i];
+    if (i + 1 < b->n && TOID_EQUALS(op->hashtable, b->ops[i + 1].hashtable) &&
+        op->key == b->ops[i + 1].key) {
+      free(op->value);
+      continue;
+    }
+    b->ops[n++] = *op;
+  }
+  return b->n = n;
+}
+
+static void hb_clear(struct ht_batch *b) {
+  for (size_t i = 0; i < b->n; i++)
+    free(b->ops[i].value);
+  b->n = 0;
+}
+
+// The op for key in ops[first, last), which are sorted by key.
+static struct ht_batch_op *hb_find(struct ht_batch_op *ops, size_t first,
+                                   size_t last, uint64_t key) {
+  while (first < last) {
+    size_t mid = first + (last - first) / 2;
+    if (ops[mid].key == key)
+      return &ops[mid];
+    if (ops[mid].key < key)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return NULL;
+}
+
+/**
+ * Applies the whole batch in one transaction and empties it. Returns the
+ * number of operations applied after dropping overwritten ones, or -1 if the
+ * batch was dropped because something failed.
+ */
+int64_t ht_batch_commit(PMEMobjpool *pop, struct ht_batch *b) {
+  struct ht_vbatch vb = {0};
+  struct ht_batch_op *ops = b->ops;
+  int64_t ret = 0;
+
+  for (size_t i = 0; i < b->n; i++) {
+    TOID(struct buckets) buckets = D_RO(ops[i].hashtable)->buckets;
+    ops[i].bucket = hash(&ops[i].hashtable, &buckets, ops[i].key);
+  }
+  qsort(ops, b->n, sizeof(*ops), hb_cmp);
+  hb_dedup(b);
+
+  // One walk per bucket finds the entries of the batch's keys and works out
+  // how the chain changes, then values and new entries are reserved and
+  // written, new entries chained in front of the first surviving one.
+  for (size_t first = 0, last; first < b->n; first = last) {
+    TOID(struct buckets) buckets = D_RO(ops[first].hashtable)->buckets;
+    TOID(struct entry) en, prev = TOID_NULL(struct entry);
+    TOID(struct entry) next = TOID_NULL(struct entry);
+    struct ht_batch_op *run = NULL;
+
+    for (last = first; last < b->n &&
+                       TOID_EQUALS(ops[last].hashtable,
+                                   ops[first].hashtable) &&
+                       ops[last].bucket == ops[first].bucket;
+         last++) {
+      hc_invalidate(ops[last].hashtable, ops[last].key);
+      ops[last].old = TOID_NULL(struct entry);
+      ops[last].en = TOID_NULL(struct entry);
+      ops[last].fix = 0;
+    }
+
+    ops[first].was_head =
+        ENTRY_AT(buckets, D_RO(buckets)->bucket[ops[first].bucket]);
+    for (en = ops[first].was_head; !TOID_IS_NULL(en);
+         en = ENTRY_AT(en, D_RO(en)->next)) {
+      struct ht_batch_op *op = hb_find(ops, first, last, D_RO(en)->key);
+      if (op != NULL)
+        op->old = en;
+      if (op != NULL && op->value == NULL) {
+        if (run == NULL) {
+          run = op;
+          run->fix = 1;
+          run->fix_prev = prev;
+        }
+        continue;
+      }
+      if (run != NULL) {
+        run->fix_next = en;
+        run = NULL;
+      }
+      if (TOID_IS_NULL(next))
+        next = en;
+      prev = en;
+    }
+    if (run != NULL)
+      run->fix_next = TOID_NULL(struct entry);
+
+    for (size_t i = first; i < last; i++) {
+      struct ht_batch_op *op = &ops[i];
+      if (op->value == NULL)
+        continue;
+      op->pval = ht_vbatch_add(pop, &vb, op->value, op->len);
+      if (OID_IS_NULL(op->pval))
+        goto fail;
+      if (!TOID_IS_NULL(op->old))
+        continue;
+      bf_add(op->hashtable, op->key);
+      struct entry e = {op->key, op->pval.off, next.oid.off};
+      PMEMoid oid = vb_reserve(pop, &vb, sizeof(struct entry),
+                               TOID_TYPE_NUM(struct entry));
+      if (OID_IS_NULL(oid))
+        goto fail;
+      pmemobj_memcpy(pop, pmemobj_direct(oid), &e, sizeof(e),
+                     PMEMOBJ_F_MEM_NODRAIN);
+      TOID_ASSIGN(op->en, oid);
+      next = op->en;
+    }
+    ops[first].head = next;
+  }
+
+  TX_BEGIN(pop) {
+    ht_vbatch_publish(pop, &vb);
+    for (size_t first = 0, last; first < b->n; first = last) {
+      TOID(struct hashtable_s) hashtable = ops[first].hashtable;
+      int has_index = !TOID_IS_NULL(D_RO(hashtable)->index);
+      int64_t delta = 0;
+
+      for (last = first;
+           last < b->n && TOID_EQUALS(ops[last].hashtable, hashtable);) {
+        TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+        uint64_t h = ops[last].bucket;
+        size_t bfirst = last;
+
+        if (!TOID_EQUALS(ops[bfirst].was_head, ops[bfirst].head)) {
+          TX_ADD_FIELD(buckets, bucket[h]);
+          D_RW(buckets)->bucket[h] = ops[bfirst].head.oid.off;
+        }
+        for (; last < b->n && TOID_EQUALS(ops[last].hashtable, hashtable) &&
+               ops[last].bucket == h;
+             last++) {
+          struct ht_batch_op *op = &ops[last];
+          if (op->fix && !TOID_IS_NULL(op->fix_prev)) {
+            TX_ADD_FIELD(op->fix_prev, next);
+            D_RW(op->fix_prev)->next = op->fix_next.oid.off;
+          }
+        }
+
+        for (size_t i = bfirst; i < last; i++) {
+          struct ht_batch_op *op = &ops[i];
+          if (op->value == NULL && !TOID_IS_NULL(op->old)) {
+            if (has_index)
+              bt_remove(hashtable, op->key);
+            ht_value_free(oid_at(op->old.oid, D_RO(op->old)->value));
+            TX_FREE(op->old);
+            delta--;
+          } else if (op->value != NULL && !TOID_IS_NULL(op->old)) {
+            TX_ADD_FIELD(op->old, value);
+            ht_value_free(oid_at(op->old.oid, D_RO(op->old)->value));
+            D_RW(op->old)->value = op->pval.off;
+          } else if (op->value != NULL) {
+            if (has_index)
+              bt_insert(hashtable, op->key, op->en);
+            delta++;
+          }
+        }
+      }
+      if (delta != 0) {
+        TX_ADD_FIELD(hashtable, size);
+        D_RW(hashtable)->size += delta;
+      }
+    }
+    ret = b->n;
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+
+  hb_clear(b);
+  ht_vbatch_free(&vb);
+  return ret;
+
+fail:
+  fprintf(stderr, "%s: can't reserve: %s\n", __func__, pmemobj_errormsg());
+  ht_vbatch_cancel(pop, &vb);
+  ht_vbatch_free(&vb);
+  hb_clear(b);
+  return -1;
+}
+
+void ht_batch_free(struct ht_batch *b) {
+  hb_clear(b);
+  free(b->ops);
+  b->ops = NULL;
+  b->cap = 0;
+}
+
+/*
+ * Asynchronous gets and puts. An ht_async scheduler runs up to max_inflight
+ * operations on one thread, each a small state machine that suspends where
+ * the blocking call would stall: a get after prefetching its bucket slot and
+ * each node of its chain, a put until its group is committed. Runnable
+ * operations take one step each in turn, so the misses of many gets
+ * overlap, and waiting puts are applied by one ht_batch_commit once
+ * group_max of them wait or nothing else can run. Callbacks run on the
+ * scheduler's thread, possibly before ht_async_get or ht_async_put
+ * returns. Gets
+ * don't see puts that are still waiting, and nobody else may remove keys
+ * from the tables while gets are in flight.
+ */
+#define ASYNC_BUCKET 0 // get: bucket slot prefetched
+#define ASYNC_CHAIN 1  // get: chain node prefetched
+#define ASYNC_COMMIT 2 // put: waiting for its group
+
+// status: 1 found or 0 not for gets, 0 committed or -1 failed for puts.
+typedef void (*ht_async_cb)(void *arg, uint64_t key, PMEMoid value,
+                            int status);
+
+struct ht_async_op {
+  int state;
+  int status; // of the commit, once its group is committed
+  uint64_t key;
+  char *base; // of the table's pool
+  PMEMoid pool;
+  const uint64_t *slot;
+  const struct entry *en;
+  struct bf_s *bf;
+  ht_async_cb cb;
+  void *arg;
+};
+
+struct ht_async_stats {
+  uint64_t gets;
+  uint64_t puts;
+  uint64_t steps;
+  uint64_t commits;
+};
+
+struct ht_async {
+  PMEMobjpool *pop;
+  int max_inflight;
+  int group_max;
+  struct ht_async_op *ops;
+  int *free_ops; // stack of unused ops
+  int nfree;
+  int *run; // ring of runnable gets
+  int head;
+  int nrun;
+  int *group; // puts waiting for the commit
+  int ngroup;
+  int *committed; // ring of committed puts waiting for their callbacks
+  int chead;
+  int ncommitted;
+  int in_commit; // callbacks of a commit are running
+  struct ht_batch batch;
+  struct ht_async_stats stats;
+};
+
+struct ht_async *ht_async_open(PMEMobjpool *pop, int max_inflight,
+                               int group_max) {
+  struct ht_async *s = calloc(1, sizeof(struct ht_async));
+
+  if (s == NULL || max_inflight < 1 || group_max < 1 ||
+      (s->ops = calloc(max_inflight, sizeof(struct ht_async_op))) == NULL ||
+      (s->free_ops = malloc(max_inflight * sizeof(int))) == NULL ||
+      (s->run = malloc(max_inflight * sizeof(int))) == NULL ||
+      (s->group = malloc(max_inflight * sizeof(int))) == NULL ||
+      (s->committed = malloc(max_inflight * sizeof(int))) == NULL)
+    goto err;
+
+  s->pop = pop;
+  s->max_inflight = max_inflight;
+  s->group_max = group_max;
+  for (int i = 0; i < max_inflight; i++)
+    s->free_ops[i] = max_inflight - 1 - i;
+  s->nfree = max_inflight;
+  return s;
+
+err:
+  if (s != NULL) {
+    free(s->committed);
+    free(s->group);
+    free(s->run);
+    free(s->free_ops);
+    free(s->ops);
+  }
+  free(s);
+  return NULL;
+}
+
+static void async_done(struct ht_async *s, int i, PMEMoid value,
+                       int status) {
+  struct ht_async_op *op = &s->ops[i];
+  s->free_ops[s->nfree++] = i;
+  op->cb(op->arg, op->key, value, status);
+}
+
+// Runs the callback of the oldest committed put, which frees its op.
+static void async_callback(struct ht_async *s) {
+  int i = s->committed[s->chead];
+
+  s->chead = (s->chead + 1) % s->max_inflight;
+  s->ncommitted--;
+  async_done(s, i, OID_NULL, s->ops[i].status);
+}
+
+/*
+ * The callbacks can queue and commit the next group while this one
+ * completes. A commit made from a callback only queues its callbacks,
+ * which the outermost commit runs in order after the ones before them.
+ */
+static void async_commit(struct ht_async *s) {
+  int status = ht_batch_commit(s->pop, &s->batch) < 0 ? -1 : 0;
+
+  for (int k = 0; k < s->ngroup; k++) {
+    int i = s->group[k];
+    s->ops[i].status = status;
+    s->committed[(s->chead + s->ncommitted++) % s->max_inflight] = i;
+  }
+  s->ngroup = 0;
+  s->stats.commits++;
+  if (s->in_commit)
+    return;
+  s->in_commit = 1;
+  while (s->ncommitted > 0)
+    async_callback(s);
+  s->in_commit = 0;
+}
+
+// One step of the get at the head of the run ring.
+static void async_step(struct ht_async *s) {
+  int i = s->run[s->head];
+  struct ht_async_op *op = &s->ops[i];
+  const struct entry *en;
+
+  s->head = (s->head + 1) % s->max_inflight;
+  s->nrun--;
+  s->stats.steps++;
+  if (op->state == ASYNC_BUCKET) {
+    en = pool_prefetch(op->base, *op->slot);
+  } else if (op->en->key == op->key) {
+    async_done(s, i, oid_at(op->pool, op->en->value), 1);
+    return;
+  } else {
+    en = pool_prefetch(op->base, op->en->next);
+  }
+  if (en == NULL) {
+    if (op->bf != NULL)
+      bf_false_positive(op->bf);
+    async_done(s, i, OID_NULL, 0);
+    return;
+  }
+  op->en = en;
+  op->state = ASYNC_CHAIN;
+  s->run[(s->head + s->nrun++) % s->max_inflight] = i;
+}
+
+/**
+ * Runs up to max_steps steps, a group commit counting as one, or until
+ * nothing is in flight if max_steps is 0. Returns the number of operations
+ * still in flight. Callbacks can queue operations but must not poll.
+ */
+int ht_async_poll(struct ht_async *s, int max_steps) {
+  for (int n = 0; max_steps == 0 || n < max_steps; n++) {
+    if (s->nrun == 0 && s->ngroup > 0)
+      async_commit(s);
+    else if (s->nrun > 0)
+      async_step(s);
+    else
+      break;
+  }
+  return s->max_inflight - s->nfree;
+}
+
+/*
+ * Takes an unused op, running the scheduler until one is free. Inside a
+ * callback, the puts already committed may hold every op, so their
+ * callbacks run first.
+ */
+static int async_op(struct ht_async *s, ht_async_cb cb, void *arg,
+                    uint64_t key) {
+  while (s->nfree == 0)
+    if (s->in_commit && s->ncommitted > 0)
+      async_callback(s);
+    else
+      ht_async_poll(s, 1);
+  int i = s->free_ops[--s->nfree];
+  s->ops[i].key = key;
+  s->ops[i].cb = cb;
+  s->ops[i].arg = arg;
+  return i;
+}
+
+void ht_async_get(struct ht_async *s, TOID(struct hashtable_s) hashtable,
+                  uint64_t key, ht_async_cb cb, void *arg) {
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  int i = async_op(s, cb, arg, key);
+  struct ht_async_op *op = &s->ops[i];
+
+  s->stats.gets++;
+  op->bf = bf_nopen ? bf_find(hashtable) : NULL;
+  if (op->bf != NULL && !bf_may_contain(op->bf, key)) {
+    async_done(s, i, OID_NULL, 0);
+    return;
+  }
+  op->base = pool_base(hashtable);
+  op->pool = hashtable.oid;
+  op->slot = &D_RO(buckets)->bucket[hash(&hashtable, &buckets, key)];
+  __builtin_prefetch(op->slot);
+  op->state = ASYNC_BUCKET;
+  s->run[(s->head + s->nrun++) % s->max_inflight] = i;
+}
+
+/**
+ * Queues a put of a string value, which is copied. The put that fills a
+ * group commits it, callbacks included. Returns -1 if out of memory, the
+ * callback isn't called then.
+ */
+int ht_async_put(struct ht_async *s, TOID(struct hashtable_s) hashtable,
+                 uint64_t key, const char *value, ht_async_cb cb,
+                 void *arg) {
+  int i = async_op(s, cb, arg, key);
+
+  if (ht_batch_put(&s->batch, hashtable, key, value)) {
+    s->free_ops[s->nfree++] = i;
+    return -1;
+  }
+  s->stats.puts++;
+  s->ops[i].state = ASYNC_COMMIT;
+  s->group[s->ngroup++] = i;
+  if (s->ngroup == s->group_max)
+    async_commit(s);
+  return 0;
+}
+
+void ht_async_get_stats(struct ht_async *s, struct ht_async_stats *stats) {
+  *stats = s->stats;
+}
+
+// Completes whatever is in flight and frees the scheduler.
+void ht_async_close(struct ht_async *s) {
+  ht_async_poll(s, 0);
+  ht_batch_free(&s->batch);
+  free(s->committed);
+  free(s->group);
+  free(s->run);
+  free(s->free_ops);
+  free(s->ops);
+  free(s);
+}
+
+/*
+ * DRAM read cache of hot values in front of a TX table. A miss copies the
+ * value out of the pool, and CLOCK eviction keeps the cache within
+ * max_entries and max_bytes. Entries start with their reference bit clear,
+ * so keys read only once (a scan) go before keys that were hit again.
+ * ht_set, ht_remove, ht_migrate and ht_reclaim drop the cached copies of
+ * whatever they change. A cache follows its table slot through
+ * ht_bulk_load, and a cache whose table is freed finds nothing from then
+ * on. Each cache has a lock, so hc_get can run alongside the invalidations
+ * of ht_put_u64, ht_cas and ht_fetch_add on other threads; hc_open and
+ * hc_close must not run alongside anything.
+ */
+#define HC_MAX_CACHES 16
+#define HC_VALUE_DIV 16 // values over max_bytes / HC_VALUE_DIV aren't cached
+
+struct hc_slot {
+  uint64_t key;
+  char *value;
+  size_t len;
+  int32_t next; // bin chain, or the free list
+  uint8_t used;
+  uint8_t ref; // CLOCK reference bit
+};
+
+struct hc_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  size_t entries;
+  size_t bytes; // cached values
+  size_t mem;   // values plus slots and bins
+};
+
+struct hc_s {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) hashtable;
+  size_t max_entries;
+  size_t max_bytes;
+  struct hc_slot *slots;
+  int32_t *bins;
+  size_t bin_mask;
+  int32_t free_head;
+  size_t hand;
+  struct hc_stats stats;
+  pthread_mutex_t lock;
+};
+
+static struct hc_s *hc_list[HC_MAX_CACHES];
+static int hc_nopen; // lets the table skip invalidation when no cache is open
+
+static size_t hc_bin(const struct hc_s *c, uint64_t key) {
+  return (key * 0x9E3779B97F4A7C15ULL >> 32) & c->bin_mask;
+}
+
+static int32_t hc_lookup(const struct hc_s *c, uint64_t key) {
+  int32_t i = c->bins[hc_bin(c, key)];
+  while (i >= 0 && c->slots[i].key != key)
+    i = c->slots[i].next;
+  return i;
+}
+
+static void hc_drop(struct hc_s *c, int32_t i) {
+  struct hc_slot *s = &c->slots[i];
+  int32_t *link = &c->bins[hc_bin(c, s->key)];
+
+  while (*link != i)
+    link = &c->slots[*link].next;
+  *link = s->next;
+
+  c->stats.entries--;
+  c->stats.bytes -= s->len;
+  free(s->value);
+  s->value = NULL;
+  s->used = 0;
+  s->next = c->free_head;
+  c->free_head = i;
+}
+
+// Frees one slot, clearing reference bits on the way.
+static void hc_evict(struct hc_s *c) {
+  for (;;) {
+    struct hc_slot *s = &c->slots[c->hand];
+    int32_t i = c->hand;
+    c->hand = (c->hand + 1) % c->max_entries;
+    if (!s->used)
+      continue;
+    if (s->ref) {
+      s->ref = 0;
+      continue;
+    }
+    hc_drop(c, i);
+    c->stats.evictions++;
+    return;
+  }
+}
+
+// Copies the first len bytes of a string or extent value to dst.
+static void hc_copy_value(PMEMoid value, char *dst, size_t len) {
+  pm_emul_read_bytes(len);
+  if (pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent)) {
+    memcpy(dst, pmemobj_direct(value), len);
+    return;
+  }
+
+  TOID(struct extent) ext;
+  TOID_ASSIGN(ext, value);
+  for (; len && !TOID_IS_NULL(ext); ext = D_RO(ext)->next) {
+    size_t n = D_RO(ext)->len < len ? D_RO(ext)->len : len;
+    memcpy(dst, D_RO(ext)->data, n);
+    dst += n;
+    len -= n;
+  }
+}
+
+static void hc_insert(struct hc_s *c, uint64_t key, PMEMoid value,
+                      size_t len) {
+  char *copy = malloc(len + 1);
+  if (copy == NULL)
+    return;
+  hc_copy_value(value, copy, len);
+  copy[len] = '\0';
+
+  while (c->free_head < 0 || c->stats.bytes + len > c->max_bytes)
+    hc_evict(c);
+
+  int32_t i = c->free_head;
+  struct hc_slot *s = &c->slots[i];
+  c->free_head = s->next;
+  s->key = key;
+  s->value = copy;
+  s->len = len;
+  s->used = 1;
+  s->ref = 0;
+  s->next = c->bins[hc_bin(c, key)];
+  c->bins[hc_bin(c, key)] = i;
+  c->stats.entries++;
+  c->stats.bytes += len;
+}
+
+/**
+ * Puts a cache of at most max_entries values and max_bytes of value data in
+ * front of hashtable. Returns NULL if HC_MAX_CACHES caches are open already.
+ */
+struct hc_s *hc_open(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                     size_t max_entries, size_t max_bytes) {
+  struct hc_s *c = calloc(1, sizeof(struct hc_s));
+  size_t nbins = 1;
+
+  while (nbins < max_entries)
+    nbins <<= 1;
+  if (c == NULL || max_entries == 0 || max_entries > INT32_MAX ||
+      (c->slots = calloc(max_entries, sizeof(struct hc_slot))) == NULL ||
+      (c->bins = malloc(nbins * sizeof(int32_t))) == NULL)
+    goto err;
+
+  c->pop = pop;
+  c->hashtable = hashtable;
+  c->max_entries = max_entries;
+  c->max_bytes = max_bytes;
+  c->bin_mask = nbins - 1;
+  pthread_mutex_init(&c->lock, NULL);
+  for (size_t i = 0; i < nbins; i++)
+    c->bins[i] = -1;
+  for (size_t i = 0; i < max_entries; i++)
+    c->slots[i].next = i + 1 < max_entries ? (int32_t)i + 1 : -1;
+
+  for (int i = 0; i < HC_MAX_CACHES; i++)
+    if (hc_list[i] == NULL) {
+      hc_list[i] = c;
+      hc_nopen++;
+      return c;
+    }
+  pthread_mutex_destroy(&c->lock);
+
+err:
+  if (c != NULL) {
+    free(c->bins);
+    free(c->slots);
+  }
+  free(c);
+  return NULL;
+}
+
+void hc_close(struct hc_s *c) {
+  for (int i = 0; i < HC_MAX_CACHES; i++)
+    if (hc_list[i] == c) {
+      hc_list[i] = NULL;
+      hc_nopen--;
+    }
+  for (size_t i = 0; i < c->max_entries; i++)
+    free(c->slots[i].value);
+  pthread_mutex_destroy(&c->lock);
+  free(c->bins);
+  free(c->slots);
+  free(c);
+}
+
+/**
+ * Copies up to len bytes of the value of key into buf and returns the value
+ * length (without the NUL for plain strings), or -1 if the key is not
+ * present. Reads inside a transaction don't fill the cache, the transaction
+ * could still abort.
+ */
+ssize_t hc_get(struct hc_s *c, uint64_t key, char *buf, size_t len) {
+  ssize_t ret = -1;
+
+  pthread_mutex_lock(&c->lock);
+  int32_t i = hc_lookup(c, key);
+  if (i >= 0) {
+    struct hc_slot *s = &c->slots[i];
+    s->ref = 1;
+    c->stats.hits++;
+    memcpy(buf, s->value, s->len < len ? s->len : len);
+    ret = s->len;
+    goto out;
+  }
+
+  c->stats.misses++;
+  if (TOID_IS_NULL(c->hashtable))
+    goto out;
+  PMEMoid value = ht_get(c->pop, c->hashtable, key);
+  if (OID_IS_NULL(value))
+    goto out;
+  size_t vlen = ht_value_len(value);
+  hc_copy_value(value, buf, vlen < len ? vlen : len);
+  if (vlen <= c->max_bytes / HC_VALUE_DIV &&
+      pmemobj_tx_stage() == TX_STAGE_NONE)
+    hc_insert(c, key, value, vlen);
+  ret = vlen;
+
+out:
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+// Drops key from every cache in front of hashtable.
+void hc_invalidate(TOID(struct hashtable_s) hashtable, uint64_t key) {
+  if (hc_nopen == 0)
+    return;
+  for (int i = 0; i < HC_MAX_CACHES; i++) {
+    struct hc_s *c = hc_list[i];
+    if (c == NULL || !TOID_EQUALS(c->hashtable, hashtable))
+      continue;
+    pthread_mutex_lock(&c->lock);
+    int32_t slot = hc_lookup(c, key);
+    if (slot >= 0) {
+      hc_drop(c, slot);
+      c->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+// Empties every cache in front of hashtable.
+void hc_invalidate_all(TOID(struct hashtable_s) hashtable) {
+  for (int i = 0; i < HC_MAX_CACHES; i++) {
+    struct hc_s *c = hc_list[i];
+    if (c == NULL || !TOID_EQUALS(c->hashtable, hashtable))
+      continue;
+    pthread_mutex_lock(&c->lock);
+    for (size_t j = 0; j < c->max_entries; j++)
+      if (c->slots[j].used) {
+        hc_drop(c, j);
+        c->stats.invalidations++;
+      }
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+// Empties the caches in front of old and puts them in front of new, which is
+// TOID_NULL when old is freed.
+void hc_rebind(TOID(struct hashtable_s) old, TOID(struct hashtable_s) new) {
+  hc_invalidate_all(old);
+  for (int i = 0; i < HC_MAX_CACHES; i++) {
+    struct hc_s *c = hc_list[i];
+    if (c == NULL || !TOID_EQUALS(c->hashtable, old))
+      continue;
+    pthread_mutex_lock(&c->lock);
+    c->hashtable = new;
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+void hc_get_stats(struct hc_s *c, struct hc_stats *stats) {
+  pthread_mutex_lock(&c->lock);
+  *stats = c->stats;
+  pthread_mutex_unlock(&c->lock);
+  stats->mem = c->stats.bytes + c->max_entries * sizeof(struct hc_slot) +
+               (c->bin_mask + 1) * sizeof(int32_t);
+}
+
+/*
+ * Bloom filters. bf_open keeps a DRAM filter of a table's keys that ht_get
+ * asks first, so a key that was never put costs a few bit tests instead of
+ * a walk down a chain in the pool. It is built by scanning the table, on
+ * every open, and sized for the larger of the key and bucket counts, with
+ * either bits_per_key bits per key or as many as fp_rate needs. ht_set,
+ * ht_put, ht_move_keys and ht_batch_commit add new keys before they become
+ * visible. Removed keys keep their bits, and a table changed wholesale by
+ * ht_migrate or ht_reclaim turns its filter off until bf_rebuild, which also
+ * resizes it for a table that has outgrown it, or bf_close if the table is
+ * gone. Bits are set atomically, so
+ * the lock-free u64 updates can run next to a filter, but bf_rebuild must
+ * not run next to anything else on the table.
+ */
+#define BF_MAX_FILTERS 16
+#define BF_MAX_HASHES 16
+
+struct bf_stats {
+  uint64_t lookups;
+  uint64_t negatives;       // lookups the filter answered
+  uint64_t false_positives; // lookups it let through for missing keys
+  size_t keys;              // added since the last build
+  size_t capacity;
+  size_t bits;
+  int hashes;
+  int stale;
+  double bits_per_key;
+  double fp_rate; // expected for keys, (1 - e^(-hashes * keys / bits))^hashes
+  size_t mem;
+};
+
+struct bf_s {
+  TOID(struct hashtable_s) hashtable;
+  double fp_rate;
+  double bits_per_key;
+  uint64_t *words;
+  size_t nbits;
+  int nhashes;
+  int stale;
+  size_t keys;
+  size_t capacity;
+  struct bf_stats stats;
+};
+
+static struct bf_s *bf_list[BF_MAX_FILTERS];
+int bf_nopen; // lets the table skip the filter search when none is open
+
+static uint64_t bf_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Bit i of the key's probe sequence, mapped onto nbits without a division.
+static size_t bf_bit(const struct bf_s *f, uint64_t h1, uint64_t h2, int i) {
+  return ((unsigned __int128)(h1 + i * h2) * f->nbits) >> 64;
+}
+
+static void bf_set(struct bf_s *f, uint64_t key) {
+  uint64_t h1 = bf_mix(key), h2 = bf_mix(h1) | 1;
+  for (int i = 0; i < f->nhashes; i++) {
+    size_t b = bf_bit(f, h1, h2, i);
+    __atomic_fetch_or(&f->words[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&f->keys, 1, __ATOMIC_RELAXED);
+}
+
+// Sizes the bit array for the table as it is now and fills it.
+static int bf_build(struct bf_s *f) {
+  TOID(struct hashtable_s) hashtable = f->hashtable;
+  size_t nkeys = D_RO(hashtable)->size;
+  size_t nbuckets = D_RO(D_RO(hashtable)->buckets)->nbuckets;
+  double bpk = f->bits_per_key;
+
+  if (bpk <= 0)
+    bpk = -log(f->fp_rate) / (M_LN2 * M_LN2);
+  f->capacity = nkeys > nbuckets ? nkeys : nbuckets;
+  f->nbits = (size_t)(bpk * f->capacity + 63) / 64 * 64;
+  f->nhashes = (int)lround(bpk * M_LN2);
+  if (f->nhashes < 1)
+    f->nhashes = 1;
+  if (f->nhashes > BF_MAX_HASHES)
+    f->nhashes = BF_MAX_HASHES;
+
+  free(f->words);
+  if ((f->words = calloc(f->nbits / 64, sizeof(uint64_t))) == NULL)
+    return -1;
+  f->keys = 0;
+
+  struct ht_iter it;
+  uint64_t key;
+  PMEMoid value;
+  ht_iter_init(hashtable, 0, SIZE_MAX, &it);
+  while (ht_iter_next(&it, &key, &value))
+    bf_set(f, key);
+  f->stale = 0;
+  return 0;
+}
+
+/**
+ * Puts a filter in front of hashtable. With bits_per_key > 0 it gets that
+ * many bits per key, otherwise as many as a false positive rate of fp_rate
+ * needs. Returns NULL if the table has a filter already, BF_MAX_FILTERS are
+ * open or memory runs out.
+ */
+struct bf_s *bf_open(TOID(struct hashtable_s) hashtable, double fp_rate,
+                     double bits_per_key) {
+  struct bf_s *f = calloc(1, sizeof(struct bf_s));
+
+  if (f == NULL || (bits_per_key <= 0 && (fp_rate <= 0 || fp_rate >= 1)) ||
+      bf_find(hashtable) != NULL)
+    goto err;
+  f->hashtable = hashtable;
+  f->fp_rate = fp_rate;
+  f->bits_per_key = bits_per_key;
+  if (bf_build(f))
+    goto err;
+
+  for (int i = 0; i < BF_MAX_FILTERS; i++)
+    if (bf_list[i] == NULL) {
+      bf_list[i] = f;
+      bf_nopen++;
+      return f;
+    }
+
+err:
+  if (f != NULL)
+    free(f->words);
+  free(f);
+  return NULL;
+}
+
+void bf_close(struct bf_s *f) {
+  for (int i = 0; i < BF_MAX_FILTERS; i++)
+    if (bf_list[i] == f) {
+      bf_list[i] = NULL;
+      bf_nopen--;
+    }
+  free(f->words);
+  free(f);
+}
+
+// Rebuilds the filter from the table. Returns 0, or -1 if memory ran out.
+int bf_rebuild(struct bf_s *f) {
+  f->stale = 1;
+  return bf_build(f);
+}
+
+struct bf_s *bf_find(TOID(struct hashtable_s) hashtable) {
+  for (int i = 0; i < BF_MAX_FILTERS; i++)
+    if (bf_list[i] != NULL && TOID_EQUALS(bf_list[i]->hashtable, hashtable))
+      return bf_list[i];
+  return NULL;
+}
+
+// Returns 0 if key is certainly not in the table, 1 if it may be.
+int bf_may_contain(struct bf_s *f, uint64_t key) {
+  if (f->stale)
+    return 1;
+  __atomic_fetch_add(&f->stats.lookups, 1, __ATOMIC_RELAXED);
+  uint64_t h1 = bf_mix(key), h2 = bf_mix(h1) | 1;
+  for (int i = 0; i < f->nhashes; i++) {
+    size_t b = bf_bit(f, h1, h2, i);
+    if (!(f->words[b / 64] & 1ULL << (b % 64))) {
+      __atomic_fetch_add(&f->stats.negatives, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void bf_false_positive(struct bf_s *f) {
+  if (!f->stale)
+    __atomic_fetch_add(&f->stats.false_positives, 1, __ATOMIC_RELAXED);
+}
+
+void bf_add(TOID(struct hashtable_s) hashtable, uint64_t key) {
+  struct bf_s *f;
+  if (bf_nopen && (f = bf_find(hashtable)) != NULL && !f->stale)
+    bf_set(f, key);
+}
+
+void bf_invalidate(TOID(struct hashtable_s) hashtable) {
+  struct bf_s *f;
+  if (bf_nopen && (f = bf_find(hashtable)) != NULL)
+    f->stale = 1;
+}
+
+void bf_get_stats(struct bf_s *f, struct bf_stats *stats) {
+  *stats = f->stats;
+  stats->keys = f->keys;
+  stats->capacity = f->capacity;
+  stats->bits = f->nbits;
+  stats->hashes = f->nhashes;
+  stats->stale = f->stale;
+  stats->bits_per_key = (double)f->nbits / f->capacity;
+  stats->fp_rate =
+      pow(1 - exp(-(double)f->nhashes * f->keys / f->nbits), f->nhashes);
+  stats->mem = f->nbits / 8 + sizeof(struct bf_s);
+}
+
+/*
+ * Snapshots. ht_export streams a table into a flat file:
+ *   header:  "HTSNAP1\0", nbuckets
+ *   records: key, len (SNAP_BINARY set for ht_put values), len bytes
+ *   trailer: record count, SNAP_END, FNV-1a checksum of all records
+ * ht_bulk_load builds a fresh table from such a file with atomic allocations
+ * and plain persisted stores, hanging it off root->loading while it grows.
+ * Only the final swap into ht_list is a transaction; a crash before that
+ * leaves a half built table under root->loading that the next
+ * init_pool_ht reclaims.
+ */
+#define SNAP_MAGIC "HTSNAP1"
+#define SNAP_BINARY (1ULL << 63)
+#define SNAP_END UINT64_MAX
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * FNV_PRIME;
+  return h;
+}
+
+static int snap_write(FILE *f, uint64_t *sum, const void *buf, size_t len) {
+  *sum = fnv1a(*sum, buf, len);
+  return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+static int snap_read(FILE *f, uint64_t *sum, void *buf, size_t len) {
+  if (fread(buf, 1, len, f) != len)
+    return -1;
+  *sum = fnv1a(*sum, buf, len);
+  return 0;
+}
+
+/**
+ * Writes every entry of hashtable to path. Returns the number of records,
+ * or -1 if something failed.
+ */
+int64_t ht_export(TOID(struct hashtable_s) hashtable, const char *path) {
+  FILE *f = fopen(path, "w");
+  uint64_t sum = FNV_OFFSET;
+  int64_t count = 0;
+  struct ht_iter it;
+  uint64_t key;
+  PMEMoid value;
+  char magic[8] = SNAP_MAGIC;
+  uint64_t nbuckets = D_RO(D_RO(hashtable)->buckets)->nbuckets;
+
+  if (f == NULL)
+    return -1;
+  if (fwrite(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+      fwrite(&nbuckets, 1, sizeof(nbuckets), f) != sizeof(nbuckets))
+    goto err;
+
+  ht_iter_init(hashtable, 0, SIZE_MAX, &it);
+  while (ht_iter_next(&it, &key, &value)) {
+    uint64_t len = ht_value_len(value);
+    int binary = pmemobj_type_num(value) == TOID_TYPE_NUM(struct extent);
+    uint64_t hdr[2] = {key, binary ? len | SNAP_BINARY : len};
+    if (snap_write(f, &sum, hdr, sizeof(hdr)))
+      goto err;
+    pm_emul_read_bytes(len);
+    if (!binary) {
+      if (snap_write(f, &sum, pmemobj_direct(value), len))
+        goto err;
+    } else {
+      TOID(struct extent) ext;
+      for (TOID_ASSIGN(ext, value); !TOID_IS_NULL(ext); ext = D_RO(ext)->next)
+        if (snap_write(f, &sum, D_RO(ext)->data, D_RO(ext)->len))
+          goto err;
+    }
+    count++;
+  }
+
+  uint64_t trailer[3] = {count, SNAP_END, sum};
+  if (fwrite(trailer, 1, sizeof(trailer), f) != sizeof(trailer))
+    goto err;
+  if (fclose(f))
+    return -1;
+  return count;
+
+err:
+  fclose(f);
+  return -1;
+}
+
+struct load_arg {
+  uint64_t key;
+  uint64_t next;
+  const char *data;
+  size_t len;
+  uint64_t total;
+};
+
+static int load_entry_constr(PMEMobjpool *pop, void *ptr, void *arg) {
+  struct entry *e = ptr;
+  struct load_arg *la = arg;
+  e->key = la->key;
+  e->value = 0;
+  e->next = la->next;
+  pmemobj_persist(pop, e, sizeof(*e));
+  return 0;
+}
+
+static int load_string_constr(PMEMobjpool *pop, void *ptr, void *arg) {
+  struct load_arg *la = arg;
+  pmemobj_memcpy(pop, ptr, la->data, la->len,
+                 la->len >= nt_threshold ? PMEMOBJ_F_MEM_NONTEMPORAL : 0);
+  pmemobj_memset_persist(pop, (char *)ptr + la->len, 0, 1);
+  return 0;
+}
+
+static int load_extent_constr(PMEMobjpool *pop, void *ptr, void *arg) {
+  struct extent *ext = ptr;
+  struct load_arg *la = arg;
+  ext->total = la->total;
+  ext->len = la->len;
+  ext->next = TOID_NULL(struct extent);
+  pmemobj_persist(pop, ext, sizeof(*ext));
+  pmemobj_memcpy(pop, ext->data, la->data, la->len,
+                 la->len >= nt_threshold ? PMEMOBJ_F_MEM_NONTEMPORAL : 0);
+  return 0;
+}
+
+/*
+ * pmemobj_alloc for a compact pointer: the object is reserved, built by
+ * constr and published together with the store of its offset to *offp.
+ */
+static int alloc_at(PMEMobjpool *pop, uint64_t *offp, size_t size,
+                    uint64_t type_num, pmemobj_constr constr, void *arg) {
+  struct pobj_action act[2];
+  PMEMoid oid = pmemobj_reserve(pop, &act[0], size, type_num);
+
+  if (OID_IS_NULL(oid))
+    return -1;
+  constr(pop, pmemobj_direct(oid), arg);
+  pmemobj_set_value(pop, &act[1], offp, oid.off);
+  if (pmemobj_publish(pop, act, 2)) {
+    pmemobj_cancel(pop, act, 1);
+    return -1;
+  }
+  return 0;
+}
+
+// pmemobj_free for a compact pointer, ref being any object of the pool.
+static void free_at(PMEMobjpool *pop, PMEMoid ref, uint64_t *offp) {
+  struct pobj_action act[2];
+
+  if (*offp == 0)
+    return;
+  pmemobj_defer_free(pop, oid_at(ref, *offp), &act[0]);
+  pmemobj_set_value(pop, &act[1], offp, 0);
+  pmemobj_publish(pop, act, 2);
+}
+
+// Allocates a value straight into *valuep, one extent at a time.
+static int load_value(PMEMobjpool *pop, PMEMoid ref, uint64_t *valuep,
+                      const char *data, uint64_t len, int binary) {
+  struct load_arg la = {0};
+
+  if (!binary) {
+    la.data = data;
+    la.len = len;
+    return alloc_at(pop, valuep, len + 1, 0, load_string_constr, &la);
+  }
+
+  size_t per = EXTENT_SIZE - sizeof(struct extent);
+  uint64_t off = 0;
+  PMEMoid *nextp = NULL;
+  do {
+    la.data = data + off;
+    la.len = len - off < per ? len - off : per;
+    la.total = off == 0 ? len : 0;
+    if (nextp == NULL
+            ? alloc_at(pop, valuep, sizeof(struct extent) + la.len,
+                       TOID_TYPE_NUM(struct extent), load_extent_constr, &la)
+            : pmemobj_alloc(pop, nextp, sizeof(struct extent) + la.len,
+                            TOID_TYPE_NUM(struct extent), load_extent_constr,
+                            &la))
+      return -1;
+    PMEMoid ext = nextp == NULL ? oid_at(ref, *valuep) : *nextp;
+    nextp = &((struct extent *)pmemobj_direct(ext))->next.oid;
+    off += la.len;
+  } while (off < len);
+  return 0;
+}
+
+// Frees a value through the pointer that references it, last extent first,
+// so a crash part way leaves a shorter but well formed chain.
+static void value_free_atomic(PMEMobjpool *pop, PMEMoid ref,
+                              uint64_t *valuep) {
+  while (*valuep != 0) {
+    PMEMoid value = oid_at(ref, *valuep), *last = NULL;
+    if (pmemobj_type_num(value) == TOID_TYPE_NUM(struct extent)) {
+      struct extent *ext = pmemobj_direct(value);
+      while (!TOID_IS_NULL(ext->next)) {
+        last = &ext->next.oid;
+        ext = pmemobj_direct(*last);
+      }
+    }
+    if (last != NULL)
+      pmemobj_free(last);
+    else
+      free_at(pop, ref, valuep);
+  }
+}
+
+/**
+ * Frees a whole table through *hashtable without a transaction. Every step
+ * unlinks what it frees, so it can simply be run again after a crash.
+ */
+void ht_reclaim(PMEMobjpool *pop, TOID(struct hashtable_s) * hashtable) {
+  if (TOID_IS_NULL(*hashtable))
+    return;
+
+  hc_rebind(*hashtable, TOID_NULL(struct hashtable_s));
+  bf_invalidate(*hashtable);
+  ht_index_drop(pop, *hashtable);
+  TOID(struct buckets) buckets = D_RO(*hashtable)->buckets;
+  if (!TOID_IS_NULL(buckets)) {
+    for (size_t i = 0; i < D_RO(buckets)->nbuckets; ++i) {
+      while (D_RO(buckets)->bucket[i] != 0) {
+        uint64_t *last = &D_RW(buckets)->bucket[i];
+        TOID(struct entry) en = ENTRY_AT(buckets, *last);
+        while (D_RO(en)->next != 0) {
+          last = &D_RW(en)->next;
+          en = ENTRY_AT(en, *last);
+        }
+        value_free_atomic(pop, en.oid, &D_RW(en)->value);
+        free_at(pop, en.oid, last);
+      }
+    }
+    pmemobj_free(&D_RW(*hashtable)->buckets.oid);
+  }
+  pmemobj_free(&hashtable->oid);
+}
+
+/**
+ * Replaces table ht_id with the contents of a snapshot. nbuckets of 0 keeps
+ * the bucket count of the exported table. Returns the number of entries
+ * loaded, or -1 if the file is bad or the pool ran out of space; the
+ * current table is untouched in that case.
+ */
+int64_t ht_bulk_load(PMEMobjpool *pop, uint64_t ht_id, const char *path,
+                     size_t nbuckets) {
+  TOID(struct root) root = POBJ_ROOT(pop, struct root);
+  FILE *f = fopen(path, "r");
+  uint64_t sum = FNV_OFFSET;
+  int64_t count = 0;
+  char magic[8];
+  uint64_t snap_nbuckets;
+  char *buf = NULL;
+  size_t buf_len = 0;
+  int ret = 0;
+
+  if (f == NULL)
+    return -1;
+  if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+      memcmp(magic, SNAP_MAGIC, sizeof(magic)) ||
+      fread(&snap_nbuckets, 1, sizeof(snap_nbuckets), f) !=
+          sizeof(snap_nbuckets)) {
+    fclose(f);
+    return -1;
+  }
+  if (nbuckets == 0)
+    nbuckets = snap_nbuckets;
+
+  // Leftovers of an earlier crashed load go first.
+  ht_reclaim(pop, &D_RW(root)->loading);
+  TX_BEGIN(pop) {
+    TX_ADD_FIELD(root, loading);
+    ht_alloc(pop, &D_RW(root)->loading, 0, nbuckets, ht_id);
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+  if (ret) {
+    fclose(f);
+    return -1;
+  }
+
+  TOID(struct hashtable_s) hashtable = D_RO(root)->loading;
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  uint64_t hdr[2];
+  for (;;) {
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+      goto err;
+    if (hdr[1] == SNAP_END)
+      break;
+    sum = fnv1a(sum, hdr, sizeof(hdr));
+
+    uint64_t len = hdr[1] & ~SNAP_BINARY;
+    if (len > buf_len) {
+      char *nbuf = realloc(buf, len);
+      if (nbuf == NULL)
+        goto err;
+      buf = nbuf;
+      buf_len = len;
+    }
+    if (snap_read(f, &sum, buf, len))
+      goto err;
+
+    pool_reserve(pop, sizeof(struct entry) + len);
+    // The new entry is published straight into its bucket, then its value
+    // straight into the entry, so nothing is ever unreachable.
+    uint64_t h = hash(&hashtable, &buckets, hdr[0]);
+    struct load_arg la = {hdr[0], D_RO(buckets)->bucket[h]};
+    if (alloc_at(pop, &D_RW(buckets)->bucket[h], sizeof(struct entry),
+                 TOID_TYPE_NUM(struct entry), load_entry_constr, &la))
+      goto err;
+    TOID(struct entry) e = ENTRY_AT(buckets, D_RO(buckets)->bucket[h]);
+    if (load_value(pop, e.oid, &D_RW(e)->value, buf, len,
+                   (hdr[1] & SNAP_BINARY) != 0))
+      goto err;
+    count++;
+  }
+
+  uint64_t trailer;
+  if (fread(&trailer, 1, sizeof(trailer), f) != sizeof(trailer) ||
+      hdr[0] != (uint64_t)count || trailer != sum) {
+    fprintf(stderr, "%s: snapshot %s is corrupt\n", __func__, path);
+    goto err;
+  }
+  D_RW(hashtable)->size = count;
+  pmemobj_persist(pop, &D_RW(hashtable)->size, sizeof(uint64_t));
+
+  // Go live: the old table takes the place of the loaded one and is
+  // reclaimed the same way a crashed load would be.
+  TX_BEGIN(pop) {
+    TX_ADD_FIELD(root, ht_list[ht_id]);
+    TX_ADD_FIELD(root, loading);
+    D_RW(root)->loading = D_RO(root)->ht_list[ht_id];
+    D_RW(root)->ht_list[ht_id] = hashtable;
+  }
+  TX_ONABORT {
+    fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+            pmemobj_errormsg());
+    ret = -1;
+  }
+  TX_END
+  if (ret)
+    goto err;
+  hc_rebind(D_RO(root)->loading, hashtable);
+  ht_reclaim(pop, &D_RW(root)->loading);
+
+  free(buf);
+  fclose(f);
+  return count;
+
+err:
+  ht_reclaim(pop, &D_RW(root)->loading);
+  free(buf);
+  fclose(f);
+  return -1;
+}
+
+/*
+ * Frozen tables. ht_freeze writes a table to an immutable file that any
+ * number of processes can map read-only with ht_frozen_open and share:
+ *   header:  "HTFRZ2\0", key, group and slot counts, seed, offsets of
+ *            the slots and values, file size
+ *   groups:  one uint32 displacement per group
+ *   slots:   key and value offset, offset 0 for the free ones
+ *   values:  length, the bytes and a terminating 0, padded to 8 bytes
+ * The index is a perfect hash built by hash and displace (CHD):
+ * keys are split into groups of about FRZ_GROUP_KEYS, and starting with the
+ * largest, each group gets the first displacement that sends all its keys
+ * to free slots. One slot in FRZ_SLACK is left free, without which the last
+ * keys placed need displacements in the order of the key count. A get reads
+ * the group's displacement, then its slot and the value, without walking
+ * anything.
+ */
+#define FRZ_MAGIC "HTFRZ2"
+#define FRZ_GROUP_KEYS 4
+#define FRZ_SLACK 32
+#define FRZ_MAX_DISP (1 << 16) // displacements tried before a new seed
+#define FRZ_MAX_SEEDS 8
+
+struct frz_header {
+  char magic[8];
+  uint64_t nkeys;
+  uint64_t ngroups;
+  uint64_t nslots;
+  uint64_t seed;
+  uint64_t slots_off;
+  uint64_t values_off;
+  uint64_t size;
+};
+
+struct frz_slot {
+  uint64_t key;
+  uint64_t off; // of the value's length, from the start of the file
+};
+
+struct ht_frozen {
+  const char *base;
+  const struct frz_header *hdr;
+  const uint32_t *disp;
+  const struct frz_slot *slots;
+};
+
+static uint64_t frz_range(uint64_t h, uint64_t n) {
+  return ((unsigned __int128)h * n) >> 64;
+}
+
+static uint64_t frz_group(uint64_t key, uint64_t seed, uint64_t ngroups) {
+  return frz_range(bf_mix(key ^ seed), ngroups);
+}
+
+static uint64_t frz_slot(uint64_t key, uint64_t seed, uint32_t disp,
+                         uint64_t nslots) {
+  return frz_range(bf_mix(key ^ seed ^ (disp + 1ULL) * 0x9E3779B97F4A7C15ULL),
+                   nslots);
+}
+
+/*
+ * Places every key, filling pos with the slot of each key and disp with
+ * the displacement of each group. Returns -1 if a group found no free
+ * slots with this seed, or memory ran out.
+ */
+static int frz_place(const uint64_t *keys, uint64_t nkeys, uint64_t ngroups,
+                     uint64_t nslots, uint64_t seed, uint32_t *disp,
+                     uint64_t *pos) {
+  uint64_t *start = calloc(ngroups + 1, sizeof(uint64_t));
+  uint64_t *fill = malloc(ngroups * sizeof(uint64_t));
+  uint64_t *members = malloc(nkeys * sizeof(uint64_t));
+  uint64_t *order = malloc(ngroups * sizeof(uint64_t));
+  uint8_t *taken = calloc(nslots, 1);
+  uint64_t *bysize = NULL, maxsize = 0;
+  int ret = -1;
+
+  if (start == NULL || fill == NULL || members == NULL || order == NULL ||
+      taken == NULL)
+    goto out;
+
+  // Counting sorts, of the keys by group and of the groups by size.
+  for (uint64_t i = 0; i < nkeys; i++)
+    start[frz_group(keys[i], seed, ngroups) + 1]++;
+  for (uint64_t g = 0; g < ngroups; g++) {
+    if (start[g + 1] > maxsize)
+      maxsize = start[g + 1];
+    fill[g] = start[g + 1] += start[g];
+  }
+  for (uint64_t i = nkeys; i-- > 0;)
+    members[--fill[frz_group(keys[i], seed, ngroups)]] = i;
+  if ((bysize = calloc(maxsize + 2, sizeof(uint64_t))) == NULL)
+    goto out;
+  for (uint64_t g = 0; g < ngroups; g++)
+    bysize[maxsize - (start[g + 1] - start[g]) + 1]++;
+  for (uint64_t n = 0; n <= maxsize; n++)
+    bysize[n + 1] += bysize[n];
+  for (uint64_t g = 0; g < ngroups; g++)
+    order[bysize[maxsize - (start[g + 1] - start[g])]++] = g;
+
+  for (uint64_t o = 0; o < ngroups; o++) {
+    uint64_t g = order[o], *m = &members[start[g]];
+    uint64_t n = start[g + 1] - start[g], d, j;
+    disp[g] = 0;
+    for (d = 0; n > 0 && d < FRZ_MAX_DISP; d++) {
+      // Take the slots one by one, so keys of the group can't share one.
+      for (j = 0; j < n; j++) {
+        pos[m[j]] = frz_slot(keys[m[j]], seed, d, nslots);
+        if (taken[pos[m[j]]])
+          break;
+        taken[pos[m[j]]] = 1;
+      }
+      if (j == n)
+        break;
+      while (j-- > 0)
+        taken[pos[m[j]]] = 0;
+    }
+    if (d == FRZ_MAX_DISP)
+      goto out;
+    disp[g] = d;
+  }
+  ret = 0;
+
+out:
+  free(bysize);
+  free(taken);
+  free(order);
+  free(members);
+  free(fill);
+  free(start);
+  return ret;
+}
+
+static int frz_write(FILE *f, const void *buf, size_t len) {
+  return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+/**
+ * Writes hashtable to path as a frozen table. Returns the number of keys,
+ * or -1 if something failed.
+ */
+int64_t ht_freeze(TOID(struct hashtable_s) hashtable, const char *path) {
+  uint64_t nkeys = D_RO(hashtable)->size, ngroups = nkeys / FRZ_GROUP_KEYS + 1;
+  uint64_t nslots = nkeys + nkeys / FRZ_SLACK + 1;
+  uint64_t *keys = malloc((nkeys + 1) * sizeof(uint64_t));
+  PMEMoid *values = malloc((nkeys + 1) * sizeof(PMEMoid));
+  uint64_t *pos = malloc((nkeys + 1) * sizeof(uint64_t));
+  uint64_t *byslot = malloc(nslots * sizeof(uint64_t));
+  uint32_t *disp = malloc(ngroups * sizeof(uint32_t));
+  struct frz_header hdr = {FRZ_MAGIC, nkeys, ngroups, nslots};
+  FILE *f = NULL;
+  uint64_t n = 0;
+  int64_t ret = -1;
+  struct ht_iter it;
+
+  if (keys == NULL || values == NULL || pos == NULL || byslot == NULL ||
+      disp == NULL)
+    goto out;
+  ht_iter_init(hashtable, 0, SIZE_MAX, &it);
+  while (n <= nkeys && ht_iter_next(&it, &keys[n], &values[n]))
+    n++;
+  if (n != nkeys)
+    goto out;
+
+  int seeds = 0;
+  do
+    hdr.seed = bf_mix(FNV_OFFSET + seeds);
+  while (frz_place(keys, nkeys, ngroups, nslots, hdr.seed, disp, pos) &&
+         ++seeds < FRZ_MAX_SEEDS);
+  if (seeds == FRZ_MAX_SEEDS)
+    goto out;
+  for (uint64_t p = 0; p < nslots; p++)
+    byslot[p] = UINT64_MAX;
+  for (uint64_t i = 0; i < nkeys; i++)
+    byslot[pos[i]] = i;
+
+  hdr.slots_off = (sizeof(hdr) + ngroups * sizeof(uint32_t) + 7) & ~7ULL;
+  hdr.values_off = hdr.slots_off + nslots * sizeof(struct frz_slot);
+  hdr.size = hdr.values_off;
+  for (uint64_t i = 0; i < nkeys; i++)
+    hdr.size += sizeof(uint64_t) + ((ht_value_len(values[i]) + 8) & ~7ULL);
+
+  static const char pad[8];
+  if ((f = fopen(path, "w")) == NULL || frz_write(f, &hdr, sizeof(hdr)) ||
+      frz_write(f, disp, ngroups * sizeof(uint32_t)) ||
+      frz_write(f, pad, hdr.slots_off - sizeof(hdr) -
+                            ngroups * sizeof(uint32_t)))
+    goto out;
+  uint64_t off = hdr.values_off;
+  for (uint64_t p = 0; p < nslots; p++) {
+    struct frz_slot slot = {0, 0};
+    if (byslot[p] != UINT64_MAX) {
+      slot = (struct frz_slot){keys[byslot[p]], off};
+      off += sizeof(uint64_t) + ((ht_value_len(values[byslot[p]]) + 8) & ~7ULL);
+    }
+    if (frz_write(f, &slot, sizeof(slot)))
+      goto out;
+  }
+  for (uint64_t p = 0; p < nslots; p++) {
+    if (byslot[p] == UINT64_MAX)
+      continue;
+    PMEMoid value = values[byslot[p]];
+    uint64_t len = ht_value_len(value);
+    if (frz_write(f, &len, sizeof(len)))
+      goto out;
+    pm_emul_read_bytes(len);
+    if (pmemobj_type_num(value) != TOID_TYPE_NUM(struct extent)) {
+      if (frz_write(f, pmemobj_direct(value), len))
+        goto out;
+    } else {
+      TOID(struct extent) ext;
+      for (TOID_ASSIGN(ext, value); !TOID_IS_NULL(ext); ext = D_RO(ext)->next)
+        if (frz_write(f, D_RO(ext)->data, D_RO(ext)->len))
+          goto out;
+    }
+    if (frz_write(f, pad, 8 - len % 8))
+      goto out;
+  }
+  ret = nkeys;
+
+out:
+  if (f != NULL && fclose(f))
+    ret = -1;
+  free(disp);
+  free(byslot);
+  free(pos);
+  free(values);
+  free(keys);
+  return ret;
+}
+
+/*
+ * Checks that the values of the slots follow one another in slot order and
+ * end with the file, so that gets can trust every offset and length.
+ */
+static int frz_check(const struct ht_frozen *fz) {
+  const struct frz_header *hdr = fz->hdr;
+  uint64_t off = hdr->values_off, nkeys = 0;
+
+  for (uint64_t p = 0; p < hdr->nslots; p++) {
+    if (fz->slots[p].off == 0)
+      continue;
+    if (fz->slots[p].off != off || hdr->size - off < sizeof(uint64_t))
+      return -1;
+    uint64_t len = *(const uint64_t *)(fz->base + off);
+    off += sizeof(uint64_t);
+    if (len >= hdr->size - off || ((len + 8) & ~7ULL) > hdr->size - off)
+      return -1;
+    off += (len + 8) & ~7ULL;
+    nkeys++;
+  }
+  return off == hdr->size && nkeys == hdr->nkeys ? 0 : -1;
+}
+
+/**
+ * Maps a frozen table read-only and shared, reading every slot once.
+ * Returns NULL if path isn't a frozen table or is damaged.
+ */
+struct ht_frozen *ht_frozen_open(const char *path) {
+  struct ht_frozen *fz = calloc(1, sizeof(struct ht_frozen));
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  void *base = MAP_FAILED;
+
+  if (fz == NULL || fd < 0 || fstat(fd, &st) ||
+      (size_t)st.st_size < sizeof(struct frz_header) ||
+      (base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED)
+    goto err;
+  fz->base = base;
+  fz->hdr = base;
+  if (memcmp(fz->hdr->magic, FRZ_MAGIC, sizeof(FRZ_MAGIC)) ||
+      fz->hdr->size != (uint64_t)st.st_size ||
+      fz->hdr->ngroups == 0 || fz->hdr->nslots <= fz->hdr->nkeys ||
+      fz->hdr->ngroups > fz->hdr->size / sizeof(uint32_t) ||
+      fz->hdr->nslots > fz->hdr->size / sizeof(struct frz_slot) ||
+      fz->hdr->slots_off % 8 ||
+      fz->hdr->slots_off < sizeof(struct frz_header) +
+                               fz->hdr->ngroups * sizeof(uint32_t) ||
+      fz->hdr->values_off !=
+          fz->hdr->slots_off + fz->hdr->nslots * sizeof(struct frz_slot) ||
+      fz->hdr->values_off > fz->hdr->size)
+    goto err;
+  fz->disp = (const uint32_t *)(fz->base + sizeof(struct frz_header));
+  fz->slots = (const struct frz_slot *)(fz->base + fz->hdr->slots_off);
+  if (frz_check(fz))
+    goto err;
+  close(fd);
+  return fz;
+
+err:
+  if (base != MAP_FAILED)
+    munmap(base, st.st_size);
+  if (fd >= 0)
+    close(fd);
+  free(fz);
+  return NULL;
+}
+
+/**
+ * Returns the value of key and sets *len to its length (without the
+ * terminating 0), or returns NULL if the key is not present. Values stay
+ * valid until ht_frozen_close.
+ */
+const char *ht_frozen_get(const struct ht_frozen *fz, uint64_t key,
+                          size_t *len) {
+  const struct frz_header *hdr = fz->hdr;
+
+  if (hdr->nkeys == 0)
+    return NULL;
+  uint64_t g = frz_group(key, hdr->seed, hdr->ngroups);
+  const struct frz_slot *slot =
+      &fz->slots[frz_slot(key, hdr->seed, fz->disp[g], hdr->nslots)];
+  // Charged like the pool, the file could be on the same device.
+  if (pm_emul_on)
+    pm_emul_touch(slot);
+  if (slot->key != key || slot->off == 0)
+    return NULL;
+  const uint64_t *value = (const uint64_t *)(fz->base + slot->off);
+  if (pm_emul_on)
+    pm_emul_touch(value);
+  *len = *value;
+  return (const char *)(value + 1);
+}
+
+uint64_t ht_frozen_size(const struct ht_frozen *fz) { return fz->hdr->size; }
+
+void ht_frozen_close(struct ht_frozen *fz) {
+  munmap((void *)fz->base, fz->hdr->size);
+  free(fz);
+}
+
+/*
+ * Write-behind buffer in DRAM in front of a TX table.
+ * Puts and removes land in a DRAM map and are visible to wb_get at once.
+ * A background flusher swaps the map out and drains it into the persistent
+ * table in large batched transactions. Durability lags by at most
+ * max_lag_ms (plus one flush) or max_lag_bytes of buffered values, after
+ * which puts block until the flusher catches up.
+ */
+#define WB_NBUCKETS 4096 // DRAM map bins, the map is bounded by max_lag_bytes
+#define WB_BATCH 1024    // records per flush transaction
+
+struct wb_rec {
+  uint64_t key;
+  char *value; // NULL marks a buffered remove.
+  size_t len;
+  PMEMoid pval;         // reserved persistent copy while being flushed
+  struct wb_rec *next;  // bin chain
+  struct wb_rec *lnext; // list of all records, in insertion order
+};
+
+struct wb_map {
+  struct wb_rec *bucket[WB_NBUCKETS];
+  struct wb_rec *head;
+  struct wb_rec *tail;
+  size_t nrecs;
+  size_t bytes;
+  uint64_t since; // when the first record landed, drives max_lag_ms
+};
+
+struct wb_stats {
+  uint64_t puts;
+  uint64_t removes;
+  uint64_t coalesced; // puts/removes that overwrote a buffered record
+  uint64_t stalls;    // puts that had to wait on max_lag_bytes
+  uint64_t flushes;   // flusher rounds that wrote something
+  uint64_t flush_txs;
+  uint64_t flushed_recs;
+  uint64_t flushed_bytes;
+  uint64_t flush_ns; // time spent inside flush transactions
+  size_t buffered_bytes;
+};
+
+struct wb_s {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) hashtable;
+  uint64_t max_lag_ms;
+  size_t max_lag_bytes;
+
+  pthread_mutex_t lock; // protects the maps, epochs and stats
+  pthread_cond_t kick;  // wakes the flusher
+  pthread_cond_t done;  // signalled after every flusher round
+  pthread_rwlock_t table_lock; // readers vs. flush transactions
+  pthread_t flusher;
+  int stop;
+
+  struct wb_map *active;   // takes new puts
+  struct wb_map *flushing; // being written to the table, still readable
+  uint64_t epoch;          // bumped when active is swapped out
+  uint64_t durable_epoch;  // every map up to this epoch is in the table
+  int sync_waiters;
+  struct wb_stats stats;
+};
+
+static struct wb_map *wb_map_new(void) { return calloc(1, sizeof(struct wb_map)); }
+
+static void wb_map_free(struct wb_map *map) {
+  struct wb_rec *rec = map->head;
+  while (rec != NULL) {
+    struct wb_rec *next = rec->lnext;
+    free(rec->value);
+    free(rec);
+    rec = next;
+  }
+  free(map);
+}
+
+static struct wb_rec *wb_map_find(struct wb_map *map, uint64_t key) {
+  struct wb_rec *rec;
+  for (rec = map->bucket[key % WB_NBUCKETS]; rec != NULL; rec = rec->next)
+    if (rec->key == key)
+      return rec;
+  return NULL;
+}
+
+// Drains one map into the table, WB_BATCH records per transaction. Values
+// are copied in before the transaction and share a single drain.
+static int wb_flush_map(struct wb_s *wb, struct wb_map *map) {
+  struct wb_rec *rec = map->head;
+  struct ht_vbatch vb = {0};
+  int ret = 0;
+
+  while (rec != NULL && ret == 0) {
+    struct wb_rec *first = rec;
+    size_t nrecs = 0;
+    size_t bytes = 0;
+    uint64_t begin = rdtsc();
+
+    for (rec = first; rec != NULL && nrecs < WB_BATCH; rec = rec->lnext) {
+      if (rec->value != NULL) {
+        rec->pval = ht_vbatch_add(wb->pop, &vb, rec->value, rec->len);
+        if (OID_IS_NULL(rec->pval)) {
+          fprintf(stderr, "%s: can't reserve value: %s\n", __func__,
+                  pmemobj_errormsg());
+          ht_vbatch_cancel(wb->pop, &vb);
+          ret = -1;
+          break;
+        }
+      }
+      bytes += rec->len;
+      nrecs++;
+    }
+    if (ret)
+      break;
+
+    pthread_rwlock_wrlock(&wb->table_lock);
+    TX_BEGIN(wb->pop) {
+      ht_vbatch_publish(wb->pop, &vb);
+      size_t i;
+      for (i = 0, rec = first; i < nrecs; i++, rec = rec->lnext) {
+        if (rec->value == NULL) {
+          if (ht_remove(wb->pop, wb->hashtable, rec->key) == -1)
+            pmemobj_tx_abort(EINVAL);
+        } else {
+          // The buffered copy replaces whatever is in the table, so the old
+          // value is released in the same transaction.
+          PMEMoid old = ht_get(wb->pop, wb->hashtable, rec->key);
+          if (ht_set(wb->pop, wb->hashtable, rec->key, rec->pval) == -1)
+            pmemobj_tx_abort(EINVAL);
+          ht_value_free(old);
+        }
+      }
+    }
+    TX_ONABORT {
+      fprintf(stderr, "%s: transaction aborted: %s\n", __func__,
+              pmemobj_errormsg());
+      ret = -1;
+    }
+    TX_END
+    pthread_rwlock_unlock(&wb->table_lock);
+
+    if (ret == 0) {
+      pthread_mutex_lock(&wb->lock);
+      wb->stats.flush_txs++;
+      wb->stats.flushed_recs += nrecs;
+      wb->stats.flushed_bytes += bytes;
+      wb->stats.flush_ns += rdtsc() - begin;
+      pthread_mutex_unlock(&wb->lock);
+    }
+  }
+  ht_vbatch_free(&vb);
+  return ret;
+}
+
+static uint64_t wb_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *wb_flusher(void *arg) {
+  struct wb_s *wb = arg;
+
+  pthread_mutex_lock(&wb->lock);
+  for (;;) {
+    struct wb_map *map = wb->active;
+    if (map->nrecs == 0) {
+      if (wb->stop)
+        break;
+      pthread_cond_wait(&wb->kick, &wb->lock);
+      continue;
+    }
+
+    // Start a flush once the oldest buffered write has used half the lag
+    // budget, the other half is left for the flush itself.
+    uint64_t deadline = map->since + wb->max_lag_ms * 1000000 / 2;
+    if (!wb->stop && !wb->sync_waiters &&
+        (!wb->max_lag_bytes || map->bytes < wb->max_lag_bytes) &&
+        wb_now() < deadline) {
+      struct timespec ts = {deadline / 1000000000, deadline % 1000000000};
+      pthread_cond_timedwait(&wb->kick, &wb->lock, &ts);
+      continue;
+    }
+
+    // Swap the active map out; readers still find it through `flushing`.
+    wb->flushing = map;
+    wb->active = wb_map_new();
+    uint64_t epoch = wb->epoch++;
+    wb->stats.buffered_bytes = 0;
+    pthread_cond_broadcast(&wb->done);
+    pthread_mutex_unlock(&wb->lock);
+
+    int ret = wb_flush_map(wb, map);
+
+    pthread_mutex_lock(&wb->lock);
+    if (ret)
+      die("%s: write-behind flush failed, buffered data is lost\n", __func__);
+    wb->stats.flushes++;
+    wb->flushing = NULL;
+    wb->durable_epoch = epoch + 1;
+    pthread_cond_broadcast(&wb->done);
+    pthread_mutex_unlock(&wb->lock);
+    wb_map_free(map);
+    pthread_mutex_lock(&wb->lock);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return NULL;
+}
+
+struct wb_s *wb_open(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                     uint64_t max_lag_ms, size_t max_lag_bytes) {
+  struct wb_s *wb = calloc(1, sizeof(struct wb_s));
+  if (wb == NULL)
+    return NULL;
+
+  wb->pop = pop;
+  wb->hashtable = hashtable;
+  wb->max_lag_ms = max_lag_ms ? max_lag_ms : 1;
+  wb->max_lag_bytes = max_lag_bytes;
+  wb->active = wb_map_new();
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wb->kick, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&wb->done, NULL);
+  pthread_rwlock_init(&wb->table_lock, NULL);
+
+  if (pthread_create(&wb->flusher, NULL, wb_flusher, wb) != 0) {
+    free(wb->active);
+    free(wb);
+    return NULL;
+  }
+  return wb;
+}
+
+// Buffers a put (value != NULL) or a remove (value == NULL).
+static int wb_write(struct wb_s *wb, uint64_t key, const char *value) {
+  char *copy = NULL;
+  size_t len = 0;
+
+  if (value != NULL) {
+    len = strlen(value) + 1;
+    if ((copy = malloc(len)) == NULL)
+      return -1;
+    memcpy(copy, value, len);
+  }
+
+  pthread_mutex_lock(&wb->lock);
+  // Bounded lag in bytes: wait for the flusher to swap the map out.
+  while (wb->max_lag_bytes && wb->active->bytes >= wb->max_lag_bytes) {
+    wb->stats.stalls++;
+    pthread_cond_signal(&wb->kick);
+    pthread_cond_wait(&wb->done, &wb->lock);
+  }
+
+  struct wb_map *map = wb->active;
+  struct wb_rec *rec = wb_map_find(map, key);
+  if (rec != NULL) {
+    // Coalesce with the buffered record, only the last write is flushed.
+    map->bytes -= rec->len;
+    free(rec->value);
+    wb->stats.coalesced++;
+  } else {
+    if ((rec = calloc(1, sizeof(struct wb_rec))) == NULL) {
+      pthread_mutex_unlock(&wb->lock);
+      free(copy);
+      return -1;
+    }
+    rec->key = key;
+    rec->next = map->bucket[key % WB_NBUCKETS];
+    map->bucket[key % WB_NBUCKETS] = rec;
+    if (map->tail == NULL)
+      map->head = rec;
+    else
+      map->tail->lnext = rec;
+    map->tail = rec;
+    if (map->nrecs++ == 0)
+      map->since = wb_now();
+  }
+  rec->value = copy;
+  rec->len = len;
+  map->bytes += len;
+  wb->stats.buffered_bytes = map->bytes;
+  if (value != NULL)
+    wb->stats.puts++;
+  else
+    wb->stats.removes++;
+
+  if (wb->max_lag_bytes && map->bytes >= wb->max_lag_bytes)
+    pthread_cond_signal(&wb->kick);
+  pthread_mutex_unlock(&wb->lock);
+  return 0;
+}
+
+int wb_put(struct wb_s *wb, uint64_t key, const char *value) {
+  if (value == NULL)
+    return -1;
+  return wb_write(wb, key, value);
+}
+
+int wb_remove(struct wb_s *wb, uint64_t key) { return wb_write(wb, key, NULL); }
+
+/**
+ * Copies the value of key into buf (at most len bytes, NUL terminated).
+ * Returns the value length as strlen would, or -1 if the key is not present.
+ */
+ssize_t wb_get(struct wb_s *wb, uint64_t key, char *buf, size_t len) {
+  struct wb_rec *rec = NULL;
+  const char *val = NULL;
+  ssize_t ret = -1;
+
+  pthread_mutex_lock(&wb->lock);
+  rec = wb_map_find(wb->active, key);
+  if (rec == NULL && wb->flushing != NULL)
+    rec = wb_map_find(wb->flushing, key);
+  if (rec != NULL) {
+    if (rec->value != NULL) {
+      ret = rec->len - 1;
+      snprintf(buf, len, "%s", rec->value);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return ret;
+  }
+  // Hold the table lock before dropping the map lock, so a flush that
+  // removes or replaces this key can't slip in between the two lookups.
+  pthread_rwlock_rdlock(&wb->table_lock);
+  pthread_mutex_unlock(&wb->lock);
+
+  PMEMoid valp = ht_get(wb->pop, wb->hashtable, key);
+  if (!OID_IS_NULL(valp)) {
+    val = pmemobj_direct(valp);
+    ret = strlen(val);
+    snprintf(buf, len, "%s", val);
+  }
+  pthread_rwlock_unlock(&wb->table_lock);
+  return ret;
+}
+
+/**
+ * Blocks until every put and remove issued before the call is durable.
+ */
+void wb_sync(struct wb_s *wb) {
+  pthread_mutex_lock(&wb->lock);
+  // An empty active map only has to wait for the flush in progress.
+  uint64_t target = wb->active->nrecs ? wb->epoch + 1 : wb->epoch;
+  wb->sync_waiters++;
+  while (wb->durable_epoch < target) {
+    pthread_cond_signal(&wb->kick);
+    pthread_cond_wait(&wb->done, &wb->lock);
+  }
+  wb->sync_waiters--;
+  pthread_mutex_unlock(&wb->lock);
+}
+
+void wb_get_stats(struct wb_s *wb, struct wb_stats *stats) {
+  pthread_mutex_lock(&wb->lock);
+  *stats = wb->stats;
+  pthread_mutex_unlock(&wb->lock);
+}
+
+// Flushes everything, stops the flusher and frees the buffer.
+void wb_close(struct wb_s *wb) {
+  wb_sync(wb);
+  pthread_mutex_lock(&wb->lock);
+  wb->stop = 1;
+  pthread_cond_signal(&wb->kick);
+  pthread_mutex_unlock(&wb->lock);
+  pthread_join(wb->flusher, NULL);
+
+  wb_map_free(wb->active);
+  pthread_rwlock_destroy(&wb->table_lock);
+  pthread_cond_destroy(&wb->done);
+  pthread_cond_destroy(&wb->kick);
+  pthread_mutex_destroy(&wb->lock);
+  free(wb);
+}
+
+/*
+ * Hot/cold tiering. A tier store keeps the values of hot keys in a DRAM
+ * table, chained like ht_vanilla (HT_TYPED_VOLATILE), and everything in the
+ * TX table. Every access to a key counts in a count-min sketch, and a key
+ * is promoted, its value copied into DRAM, once the sketch has seen it
+ * promote_after times. The counters are halved every TIER_AGE_MUL accesses
+ * per counter, so keys that cool off stop looking hot. Hot values, plus
+ * their slot and bin entry, are kept within max_bytes by demoting the least
+ * recently used key, or with TIER_LFU the least frequently used of
+ * TIER_LFU_SAMPLES random ones.
+ * Writes always go to the TX table, in a transaction of their own or
+ * through wb if one is given, whose lag bounds how far durability trails,
+ * and only then update the DRAM copy. Demotion just drops the copy. All
+ * writes to the table must go through the tier, and like the table a tier
+ * is not thread safe.
+ */
+#define TIER_LFU 1 // demote by access count instead of recency
+#define TIER_LFU_SAMPLES 5
+#define TIER_SKETCH_ROWS 4
+#define TIER_AGE_MUL 8
+#define TIER_MIN_ENTRY 128 // sizes the bins and the sketch from max_bytes
+
+HT_TYPED_VOLATILE(tier_map, uint64_t, int32_t, ht_typed_mix, HT_TYPED_RUNTIME)
+
+struct tier_slot {
+  uint64_t key;
+  char *value;
+  size_t len;
+  uint32_t freq; // accesses while hot, halved with the sketch
+  int32_t prev;  // recency list
+  int32_t next;  // recency list, or the free list
+  uint8_t used;
+};
+
+struct tier_stats {
+  uint64_t hot_hits;  // gets served from DRAM
+  uint64_t cold_hits; // gets served by the pool (or the write-behind buffer)
+  uint64_t misses;
+  uint64_t puts;
+  uint64_t promotions;
+  uint64_t demotions;
+  size_t entries; // hot keys
+  size_t bytes;   // charged against max_bytes
+  size_t mem;     // bytes plus the sketch, slot array and bins
+};
+
+struct tier_s {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) hashtable;
+  struct wb_s *wb;
+  int flags;
+  size_t max_bytes;
+  unsigned promote_after;
+  struct tier_map *map;
+  struct tier_slot *slots;
+  int32_t nslots;
+  int32_t free_head;
+  int32_t head; // most recently used
+  int32_t tail; // least recently used
+  uint8_t *sketch;
+  size_t sketch_mask;
+  uint64_t sketch_adds;
+  uint64_t rng;
+  char *buf; // cold reads
+  size_t buf_len;
+  struct tier_stats stats;
+};
+
+static size_t tier_cost(size_t len) {
+  return len + 1 + sizeof(struct tier_slot) + sizeof(struct tier_map_entry);
+}
+
+// Counts an access to key and returns the sketch's estimate of its count.
+// Only the smallest counters grow (conservative update).
+static unsigned tier_sketch_add(struct tier_s *t, uint64_t key) {
+  uint64_t h = ht_typed_mix(key);
+  uint32_t h1 = h, h2 = h >> 32 | 1;
+  uint8_t *c[TIER_SKETCH_ROWS];
+  unsigned min = UINT8_MAX;
+
+  for (int r = 0; r < TIER_SKETCH_ROWS; r++) {
+    c[r] = &t->sketch[r * (t->sketch_mask + 1) +
+                      ((h1 + r * h2) & t->sketch_mask)];
+    min = *c[r] < min ? *c[r] : min;
+  }
+  if (min < UINT8_MAX) {
+    for (int r = 0; r < TIER_SKETCH_ROWS; r++)
+      if (*c[r] == min)
+        (*c[r])++;
+    min++;
+  }
+  if (++t->sketch_adds >= (t->sketch_mask + 1) * TIER_AGE_MUL) {
+    for (size_t i = 0; i < TIER_SKETCH_ROWS * (t->sketch_mask + 1); i++)
+      t->sketch[i] >>= 1;
+    for (int32_t i = 0; i < t->nslots; i++)
+      t->slots[i].freq >>= 1;
+    t->sketch_adds = 0;
+  }
+  return min;
+}
+
+static void tier_unlink(struct tier_s *t, int32_t i) {
+  struct tier_slot *s = &t->slots[i];
+  if (s->prev >= 0)
+    t->slots[s->prev].next = s->next;
+  else
+    t->head = s->next;
+  if (s->next >= 0)
+    t->slots[s->next].prev = s->prev;
+  else
+    t->tail = s->prev;
+}
+
+static void tier_link_head(struct tier_s *t, int32_t i) {
+  struct tier_slot *s = &t->slots[i];
+  s->prev = -1;
+  s->next = t->head;
+  if (t->head >= 0)
+    t->slots[t->head].prev = i;
+  else
+    t->tail = i;
+  t->head = i;
+}
+
+static void tier_drop(struct tier_s *t, int32_t i) {
+  struct tier_slot *s = &t->slots[i];
+
+  tier_map_remove(t->map, s->key);
+  tier_unlink(t, i);
+  t->stats.entries--;
+  t->stats.bytes -= tier_cost(s->len);
+  free(s->value);
+  s->value = NULL;
+  s->used = 0;
+  s->next = t->free_head;
+  t->free_head = i;
+}
+
+// The key to demote next. There is at least one hot key.
+static int32_t tier_victim(struct tier_s *t) {
+  int32_t victim = t->tail;
+
+  if (!(t->flags & TIER_LFU))
+    return victim;
+  for (int n = 0, tries = 0;
+       n < TIER_LFU_SAMPLES && tries < 4 * TIER_LFU_SAMPLES; tries++) {
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    int32_t i = t->rng % t->nslots;
+    if (!t->slots[i].used)
+      continue;
+    if (n++ == 0 || t->slots[i].freq < t->slots[victim].freq)
+      victim = i;
+  }
+  return victim;
+}
+
+// Copies a value into DRAM, demoting other keys until it fits. Returns 0,
+// or -1 if it can't be cached.
+static int tier_insert(struct tier_s *t, uint64_t key, const char *value,
+                        size_t len, unsigned freq) {
+  size_t cost = tier_cost(len);
+  char *copy;
+
+  if (cost > t->max_bytes || (copy = malloc(len + 1)) == NULL)
+    return -1;
+  memcpy(copy, value, len + 1);
+  while (t->stats.bytes + cost > t->max_bytes) {
+    tier_drop(t, tier_victim(t));
+    t->stats.demotions++;
+  }
+  if (t->free_head < 0) {
+    int32_t n = t->nslots ? 2 * t->nslots : 64;
+    struct tier_slot *slots = realloc(t->slots, n * sizeof(struct tier_slot));
+    if (slots == NULL) {
+      free(copy);
+      return -1;
+    }
+    memset(slots + t->nslots, 0, (n - t->nslots) * sizeof(struct tier_slot));
+    for (int32_t i = t->nslots; i < n; i++)
+      slots[i].next = i + 1 < n ? i + 1 : -1;
+    t->free_head = t->nslots;
+    t->slots = slots;
+    t->nslots = n;
+  }
+
+  int32_t i = t->free_head;
+  struct tier_slot *s = &t->slots[i];
+  if (tier_map_set(t->map, key, &i) < 0) {
+    free(copy);
+    return -1;
+  }
+  t->free_head = s->next;
+  s->key = key;
+  s->value = copy;
+  s->len = len;
+  s->freq = freq;
+  s->used = 1;
+  tier_link_head(t, i);
+  t->stats.entries++;
+  t->stats.bytes += cost;
+  return 0;
+}
+
+// Reads key's value from the table, or from wb, into t->buf.
+static ssize_t tier_read_cold(struct tier_s *t, uint64_t key) {
+  ssize_t len;
+
+  if (t->wb != NULL) {
+    while ((len = wb_get(t->wb, key, t->buf, t->buf_len)) >= 0 &&
+           (size_t)len >= t->buf_len) {
+      char *buf = realloc(t->buf, len + 1);
+      if (buf == NULL)
+        return -1;
+      t->buf = buf;
+      t->buf_len = len + 1;
+    }
+    return len;
+  }
+
+  PMEMoid value = ht_get(t->pop, t->hashtable, key);
+  if (OID_IS_NULL(value))
+    return -1;
+  len = ht_value_len(value);
+  if ((size_t)len >= t->buf_len) {
+    char *buf = realloc(t->buf, len + 1);
+    if (buf == NULL)
+      return -1;
+    t->buf = buf;
+    t->buf_len = len + 1;
+  }
+  hc_copy_value(value, t->buf, len);
+  t->buf[len] = '\0';
+  return len;
+}
+
+/**
+ * Puts a hot tier of max_bytes in front of hashtable. Writes go through wb
+ * if it isn't NULL, which must be open on the same table. flags is 0 or
+ * TIER_LFU. Returns NULL if out of memory.
+ */
+struct tier_s *tier_open(PMEMobjpool *pop, TOID(struct hashtable_s) hashtable,
+                         struct wb_s *wb, size_t max_bytes,
+                         unsigned promote_after, int flags) {
+  struct tier_s *t = calloc(1, sizeof(struct tier_s));
+  unsigned log2 = 10;
+
+  while ((1ULL << log2) < max_bytes / TIER_MIN_ENTRY)
+    log2++;
+  if (t == NULL || (t->map = tier_map_create(log2)) == NULL ||
+      (t->sketch = calloc(TIER_SKETCH_ROWS << (log2 + 2), 1)) == NULL)
+    goto err;
+
+  t->pop = pop;
+  t->hashtable = hashtable;
+  t->wb = wb;
+  t->flags = flags;
+  t->max_bytes = max_bytes;
+  t->promote_after = promote_after ? promote_after : 1;
+  t->free_head = t->head = t->tail = -1;
+  t->sketch_mask = (1ULL << (log2 + 2)) - 1;
+  t->rng = 0x9E3779B97F4A7C15ULL;
+  return t;
+
+err:
+  if (t != NULL && t->map != NULL)
+    tier_map_free(t->map);
+  free(t);
+  return NULL;
+}
+
+// Leaves wb open, writes it still buffers are flushed by wb_close.
+void tier_close(struct tier_s *t) {
+  for (int32_t i = 0; i < t->nslots; i++)
+    free(t->slots[i].value);
+  tier_map_free(t->map);
+  free(t->slots);
+  free(t->sketch);
+  free(t->buf);
+  free(t);
+}
+
+/**
+ * Copies the value of key into buf (at most len bytes, NUL terminated).
+ * Returns the value length as strlen would, or -1 if the key is not present.
+ */
+ssize_t tier_get(struct tier_s *t, uint64_t key, char *buf, size_t len) {
+  int32_t *hot = tier_map_get(t->map, key);
+
+  if (hot != NULL) {
+    struct tier_slot *s = &t->slots[*hot];
+    if (s->freq < UINT32_MAX)
+      s->freq++;
+    tier_unlink(t, *hot);
+    tier_link_head(t, *hot);
+    t->stats.hot_hits++;
+    snprintf(buf, len, "%s", s->value);
+    return s->len;
+  }
+
+  unsigned freq = tier_sketch_add(t, key);
+  ssize_t vlen = tier_read_cold(t, key);
+  if (vlen < 0) {
+    t->stats.misses++;
+    return -1;
+  }
+  t->stats.cold_hits++;
+  snprintf(buf, len, "%s", t->buf);
+  if (freq >= t->promote_after && pmemobj_tx_stage() == TX_STAGE_NONE &&
+      !tier_insert(t, key, t->buf, vlen, freq))
+    t->stats.promotions++;
+  return vlen;
+}
+
+/**
+ * Stores a copy of the string value under key. Returns 0 once the table has
+ * it, or wb has buffered it, -1 if that failed; the DRAM copy is unchanged
+ * then.
+ */
+int tier_put(struct tier_s *t, uint64_t key, const char *value) {
+  int ret = 0;
+
+  if (t->wb != NULL) {
+    ret = wb_put(t->wb, key, value);
+  } else {
+    TX_BEGIN(t->pop) {
+      PMEMoid old = ht_get(t->pop, t->hashtable, key);
+      if (ht_set(t->pop, t->hashtable, key, TX_STRDUP(value, 0)) < 0)
+        pmemobj_tx_abort(EINVAL);
+      ht_value_free(old);
+    }
+    TX_ONABORT { ret = -1; }
+    TX_END
+  }
+  if (ret)
+    return -1;
+
+  t->stats.puts++;
+  int32_t *hot = tier_map_get(t->map, key);
+  unsigned freq;
+  if (hot != NULL) {
+    freq = t->slots[*hot].freq;
+    tier_drop(t, *hot);
+    // The caller's transaction could still abort.
+    if (pmemobj_tx_stage() == TX_STAGE_NONE)
+      tier_insert(t, key, value, strlen(value), freq);
+  } else if (pmemobj_tx_stage() == TX_STAGE_NONE &&
+             (freq = tier_sketch_add(t, key)) >= t->promote_after &&
+             !tier_insert(t, key, value, strlen(value), freq)) {
+    t->stats.promotions++;
+  }
+  return 0;
+}
+
+// Returns 0, or -1 if the remove failed.
+int tier_remove(struct tier_s *t, uint64_t key) {
+  int32_t *hot = tier_map_get(t->map, key);
+
+  if (t->wb != NULL ? wb_remove(t->wb, key)
+                    : ht_remove(t->pop, t->hashtable, key) < 0)
+    return -1;
+  if (hot != NULL)
+    tier_drop(t, *hot);
+  return 0;
+}
+
+void tier_get_stats(struct tier_s *t, struct tier_stats *stats) {
+  *stats = t->stats;
+  stats->mem = t->stats.bytes +
+               (t->nslots - t->stats.entries) * sizeof(struct tier_slot) +
+               ((size_t)1 << (64 - t->map->shift)) * sizeof(void *) +
+               TIER_SKETCH_ROWS * (t->sketch_mask + 1);
+}
+
+/*
+ * Sharded store. Keys are spread over nshards pool files, each with its own
+ * PMEMobjpool, so allocator, lanes and transactions are never shared between
+ * shards. With SHARD_WORKERS every shard gets a worker thread that owns its
+ * pool (optionally pinned to a core with SHARD_PIN) and callers queue
+ * requests to it; otherwise callers run them under a per-shard mutex. Batch
+ * calls split the keys by shard and apply each share in one transaction,
+ * all shards in parallel.
+ */
+#define SHARD_WORKERS 1 // one worker thread per shard
+#define SHARD_PIN 2     // pin worker i to core i
+
+enum shard_op_type { SHARD_SET, SHARD_GET, SHARD_REMOVE };
+
+// One request to one shard: n keys picked out of the caller's arrays by idx,
+// or keys[0..n) when idx is NULL.
+struct shard_op {
+  enum shard_op_type type;
+  size_t n;
+  const size_t *idx;
+  const uint64_t *keys;
+  const char *const *values; // SHARD_SET
+  PMEMoid *out;              // SHARD_GET
+  int ret; // SHARD_REMOVE: keys removed, -1 if a transaction failed
+  int done;
+  struct shard_op *next;
+};
+
+struct shard {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) *hashtable;
+  pthread_mutex_t lock; // queue, or the whole shard when there is no worker
+  pthread_cond_t kick;  // wakes the worker
+  pthread_cond_t done;  // signalled after every request
+  struct shard_op *head;
+  struct shard_op *tail;
+  pthread_t worker;
+  int stop;
+};
+
+struct shard_store {
+  int nshards;
+  int flags;
+  struct shard shard[];
+};
+
+// Spread keys with a multiplicative hash so the shard choice is independent
+// of the bucket hash inside each table.
+static int shard_of(const struct shard_store *store, uint64_t key) {
+  return ((key * 0x9E3779B97F4A7C15ULL) >> 32) % store->nshards;
+}
+
+static void shard_exec(struct shard *s, struct shard_op *op) {
+  op->ret = 0;
+  if (op->type == SHARD_GET) {
+    for (size_t i = 0; i < op->n; i++) {
+      size_t k = op->idx ? op->idx[i] : i;
+      op->out[k] = ht_get(s->pop, *s->hashtable, op->keys[k]);
+    }
+    return;
+  }
+
+  TX_BEGIN(s->pop) {
+    for (size_t i = 0; i < op->n; i++) {
+      size_t k = op->idx ? op->idx[i] : i;
+      if (op->type == SHARD_SET) {
+        PMEMoid old = ht_get(s->pop, *s->hashtable, op->keys[k]);
+        ht_set(s->pop, *s->hashtable, op->keys[k],
+               TX_STRDUP(op->values[k], 0));
+        ht_value_free(old);
+      } else if (ht_remove(s->pop, *s->hashtable, op->keys[k]) == 1) {
+        op->ret++;
+      }
+    }
+  }
+  TX_ONABORT {
+    fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
+    op->ret = -1;
+  }
+  TX_END
+}
+
+static void *shard_worker(void *arg) {
+  struct shard *s = arg;
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    struct shard_op *op = s->head;
+    if (op == NULL) {
+      if (s->stop)
+        break;
+      pthread_cond_wait(&s->kick, &s->lock);
+      continue;
+    }
+    if ((s->head = op->next) == NULL)
+      s->tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    shard_exec(s, op);
+
+    pthread_mutex_lock(&s->lock);
+    op->done = 1;
+    pthread_cond_broadcast(&s->done);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// Hands op to the shard's worker, or runs it right away without workers.
+static void shard_submit(struct shard_store *store, struct shard *s,
+                         struct shard_op *op) {
+  op->done = 0;
+  op->next = NULL;
+  pthread_mutex_lock(&s->lock);
+  if (store->flags & SHARD_WORKERS) {
+    if (s->tail == NULL)
+      s->head = op;
+    else
+      s->tail->next = op;
+    s->tail = op;
+    pthread_cond_signal(&s->kick);
+  } else {
+    shard_exec(s, op);
+    op->done = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void shard_wait(struct shard *s, struct shard_op *op) {
+  pthread_mutex_lock(&s->lock);
+  while (!op->done)
+    pthread_cond_wait(&s->done, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Opens (or creates) nshards pools named <path>.shard<i>, each with one table
+ * of buck_sz buckets in slot 0. flags is SHARD_WORKERS, optionally with
+ * SHARD_PIN. Returns NULL if a worker can't be started.
+ */
+struct shard_store *shard_open(const char *path, int nshards, size_t buck_sz,
+                               int flags) {
+  struct shard_store *store =
+      calloc(1, sizeof(struct shard_store) + nshards * sizeof(struct shard));
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  char shard_path[4096];
+
+  if (store == NULL)
+    return NULL;
+  store->nshards = nshards;
+  store->flags = flags;
+
+  for (int i = 0; i < nshards; i++) {
+    struct shard *s = &store->shard[i];
+    snprintf(shard_path, sizeof(shard_path), "%s.shard%d", path, i);
+    s->pop = pool_open(shard_path);
+    s->hashtable = pool_ht(s->pop, 0, buck_sz);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->kick, NULL);
+    pthread_cond_init(&s->done, NULL);
+    if (!(flags & SHARD_WORKERS))
+      continue;
+
+    if (pthread_create(&s->worker, NULL, shard_worker, s) != 0) {
+      // Stop and join the workers already running, then undo shard i.
+      pthread_cond_destroy(&s->done);
+      pthread_cond_destroy(&s->kick);
+      pthread_mutex_destroy(&s->lock);
+      pmemobj_close(s->pop);
+      store->nshards = i;
+      shard_close(store);
+      return NULL;
+    }
+    if (flags & SHARD_PIN) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % (ncpus > 0 ? ncpus : 1), &cpus);
+      pthread_setaffinity_np(s->worker, sizeof(cpus), &cpus);
+    }
+  }
+  return store;
+}
+
+// Stops the workers after their queues drain and closes every pool.
+void shard_close(struct shard_store *store) {
+  for (int i = 0; i < store->nshards; i++) {
+    struct shard *s = &store->shard[i];
+    if (store->flags & SHARD_WORKERS) {
+      pthread_mutex_lock(&s->lock);
+      s->stop = 1;
+      pthread_cond_signal(&s->kick);
+      pthread_mutex_unlock(&s->lock);
+      pthread_join(s->worker, NULL);
+    }
+    pthread_cond_destroy(&s->done);
+    pthread_cond_destroy(&s->kick);
+    pthread_mutex_destroy(&s->lock);
+    pmemobj_close(s->pop);
+  }
+  free(store);
+}
+
+// Runs a single key request on its shard and waits for it.
+static int shard_one(struct shard_store *store, struct shard_op *op) {
+  struct shard *s = &store->shard[shard_of(store, op->keys[0])];
+  op->n = 1;
+  shard_submit(store, s, op);
+  shard_wait(s, op);
+  return op->ret;
+}
+
+/**
+ * Stores a copy of the string value under key, replacing and freeing any
+ * previous value. Returns 0, or -1 if the transaction failed.
+ */
+int shard_set(struct shard_store *store, uint64_t key, const char *value) {
+  struct shard_op op = {.type = SHARD_SET, .keys = &key, .values = &value};
+  return shard_one(store, &op) < 0 ? -1 : 0;
+}
+
+/**
+ * Returns the value of key or OID_NULL. The value stays readable until the
+ * key is set or removed again.
+ */
+PMEMoid shard_get(struct shard_store *store, uint64_t key) {
+  PMEMoid value = OID_NULL;
+  struct shard_op op = {.type = SHARD_GET, .keys = &key, .out = &value};
+  shard_one(store, &op);
+  return value;
+}
+
+// Same return values as ht_remove.
+int shard_remove(struct shard_store *store, uint64_t key) {
+  struct shard_op op = {.type = SHARD_REMOVE, .keys = &key};
+  return shard_one(store, &op);
+}
+
+// Splits keys[0..n) by shard into one op per shard, runs them all and waits.
+static int shard_batch(struct shard_store *store, struct shard_op *proto,
+                       size_t n) {
+  int nshards = store->nshards;
+  struct shard_op *ops = calloc(nshards, sizeof(struct shard_op));
+  size_t *idx = malloc(n * sizeof(size_t));
+  size_t *pos = calloc(nshards + 1, sizeof(size_t));
+  int ret = 0;
+
+  if (ops == NULL || idx == NULL || pos == NULL) {
+    free(ops);
+    free(idx);
+    free(pos);
+    return -1;
+  }
+
+  // Counting sort of the key positions by shard.
+  for (size_t i = 0; i < n; i++)
+    pos[shard_of(store, proto->keys[i]) + 1]++;
+  for (int i = 0; i < nshards; i++)
+    pos[i + 1] += pos[i];
+  for (size_t i = 0; i < n; i++)
+    idx[pos[shard_of(store, proto->keys[i])]++] = i;
+
+  for (int i = 0; i < nshards; i++) {
+    size_t first = i ? pos[i - 1] : 0;
+    ops[i] = *proto;
+    ops[i].idx = idx + first;
+    ops[i].n = pos[i] - first;
+    if (ops[i].n)
+      shard_submit(store, &store->shard[i], &ops[i]);
+  }
+  for (int i = 0; i < nshards; i++) {
+    if (!ops[i].n)
+      continue;
+    shard_wait(&store->shard[i], &ops[i]);
+    if (ops[i].ret < 0 || ret < 0)
+      ret = -1;
+    else
+      ret += ops[i].ret;
+  }
+
+  free(pos);
+  free(idx);
+  free(ops);
+  return ret;
+}
+
+/**
+ * Sets n keys, one transaction per shard touched. Each shard's share is
+ * atomic, the batch as a whole is not. Returns 0 or -1.
+ */
+int shard_set_batch(struct shard_store *store, size_t n, const uint64_t *keys,
+                    const char *const *values) {
+  struct shard_op proto = {.type = SHARD_SET, .keys = keys, .values = values};
+  return shard_batch(store, &proto, n) < 0 ? -1 : 0;
+}
+
+// Looks up n keys into values[], OID_NULL for missing keys.
+int shard_get_batch(struct shard_store *store, size_t n, const uint64_t *keys,
+                    PMEMoid *values) {
+  struct shard_op proto = {.type = SHARD_GET, .keys = keys, .out = values};
+  return shard_batch(store, &proto, n);
+}
+
+// Returns the number of keys removed, or -1 if a transaction failed.
+int shard_remove_batch(struct shard_store *store, size_t n,
+                       const uint64_t *keys) {
+  struct shard_op proto = {.type = SHARD_REMOVE, .keys = keys};
+  return shard_batch(store, &proto, n);
+}
+
+TOID_DECLARE(char, 0);
+int main(int argc, char *argv[]) {
+
+  const char *path = argv[1];
+  pm_emul_from_env();
+
+  // Simple test
+  TOID(struct hashtable_s) *ht = init_pool_ht(path, 0, 10);
+  char *test =
+      "What is the ultimate answer for life, the universe, and everything?\0";
+  PMEMoid TESToid;
+
+  TX_BEGIN(pop) { TESToid = TX_STRDUP(test, 0); }
+  TX_ONABORT {
+    fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
+  }
+  TX_END
+
+  if (!ht_set(pop, *ht, 42, TESToid)) {
+    char *val = pmemobj_direct(ht_get(pop, *ht, 42));
+    printf("%s\n", val);
+  }
+
+  pmemobj_close(pop);
+  // FIXEME: Have to close the pool to open new HT,
   // simply rearanging the code should fix this dependency.
   //
   perf_test(path);
 }
 
+// Scan callback for Test 11: folds keys and the first value byte into *arg.
+static int scan_sum(uint64_t key, PMEMoid value, void *arg) {
+  *(uint64_t *)arg += key + *(char *)pmemobj_direct(value);
+  return 0;
+}
+
+static void scan_sum_all(TOID(struct hashtable_s) hashtable, uint64_t *sum) {
+  struct ht_iter it;
+  uint64_t key;
+  PMEMoid value;
+
+  ht_iter_init(hashtable, 0, SIZE_MAX, &it);
+  while (ht_iter_next(&it, &key, &value))
+    scan_sum(key, value, sum);
+}
+
+// Client thread for Test 13: sets then reads back its own range of keys in
+// batches of SHARD_TEST_BATCH.
+#define SHARD_TEST_BATCH 64
+struct shard_client {
+  struct shard_store *store;
+  uint64_t first;
+  size_t nkeys;
+  int ret;
+};
+
+static void *shard_client(void *arg) {
+  struct shard_client *c = arg;
+  uint64_t keys[SHARD_TEST_BATCH];
+  const char *values[SHARD_TEST_BATCH];
+  PMEMoid out[SHARD_TEST_BATCH];
+  char val[32];
+
+  for (size_t i = 0; i < c->nkeys && !c->ret; i += SHARD_TEST_BATCH) {
+    size_t n = c->nkeys - i < SHARD_TEST_BATCH ? c->nkeys - i
+                                               : SHARD_TEST_BATCH;
+    snprintf(val, sizeof(val), "shard value %lu", c->first + i);
+    for (size_t j = 0; j < n; j++) {
+      keys[j] = c->first + i + j;
+      values[j] = val;
+    }
+    if (shard_set_batch(c->store, n, keys, values) ||
+        shard_get_batch(c->store, n, keys, out))
+      c->ret = -1;
+    for (size_t j = 0; j < n; j++)
+      if (OID_IS_NULL(out[j]) || strcmp(pmemobj_direct(out[j]), val))
+        c->ret = -1;
+  }
+  return NULL;
+}
+
+// Thread for Test 19: increments the counters round robin.
+struct counter_client {
+  PMEMobjpool *pop;
+  TOID(struct hashtable_s) hashtable;
+  uint64_t first;
+  int ncounters;
+  int nincs;
+  int ret;
+};
+
+static void *counter_client(void *arg) {
+  struct counter_client *c = arg;
+  uint64_t old;
+
+  for (int i = 0; i < c->nincs; i++)
+    if (ht_fetch_add(c->pop, c->hashtable, c->first + i % c->ncounters, 1,
+                     &old))
+      c->ret = -1;
+  return NULL;
+}
+
+struct async_count {
+  uint64_t done;
+  uint64_t found;
+  uint64_t failed;
+};
+
+static void async_counted(void *arg, uint64_t key, PMEMoid value,
+                          int status) {
+  struct async_count *c = arg;
+  c->done++;
+  c->found += status == 1;
+  c->failed += status == -1;
+}
+
+/*
+ * Puts keys [next, end), per of them for each completed put, from the
+ * callbacks (Test 23). Completions of keys from first on are counted and
+ * summed, and with one put per callback must come in key order.
+ */
+struct async_chain {
+  struct ht_async *as;
+  TOID(struct hashtable_s) hashtable;
+  uint64_t first;
+  uint64_t next;
+  uint64_t end;
+  int per;
+  uint64_t done;
+  uint64_t sum;
+  int bad;
+};
+
+static void async_chained(void *arg, uint64_t key, PMEMoid value,
+                          int status) {
+  struct async_chain *c = arg;
+  char val[32];
+
+  c->bad += status != 0 || key < c->first || key >= c->next ||
+            (c->per == 1 && key != c->first + c->done);
+  c->done++;
+  c->sum += key - c->first;
+  // The put can run callbacks that put keys as well.
+  for (int i = 0; i < c->per && c->next < c->end; i++) {
+    uint64_t next = c->next++;
+    snprintf(val, sizeof(val), "async %lu", next);
+    if (ht_async_put(c->as, c->hashtable, next, val, async_chained, c))
+      c->bad++;
+  }
+}
+
+// Bytes on disk of the pool at path, poolset file and parts (Test 14).
+static size_t pool_footprint(const char *path) {
+  char dir[PATH_MAX];
+  struct stat st;
+
+  snprintf(dir, sizeof(dir), "%s.parts", path);
+  return (stat(path, &st) ? 0 : st.st_size) + pool_parts_size(dir);
+}
+
+// Fills out with count zipfian ranks in [0, n) of skew theta (Test 15).
+static void zipf_fill(uint32_t *out, size_t count, size_t n, double theta) {
+  double *cdf = malloc(n * sizeof(double));
+  double sum = 0;
+
+  for (size_t i = 0; i < n; i++)
+    cdf[i] = sum += 1.0 / pow(i + 1, theta);
+  for (size_t i = 0; i < count; i++) {
+    double u = rand() / (RAND_MAX + 1.0) * sum;
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    out[i] = lo;
+  }
+  free(cdf);
+}
+
+static int u64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Median of n timings, which are sorted in place.
+static uint64_t round_median(uint64_t *t, int n) {
+  qsort(t, n, sizeof(*t), u64_cmp);
+  return t[n / 2];
+}
+
+// The 63 character value of the i-th put of round cfg (Test 28).
+static void tier_value(char *out, int cfg, int i) {
+  char head[32];
+  int n = snprintf(head, sizeof(head), "%d:%d:", cfg, i);
+
+  memset(out, '.', 63);
+  memcpy(out, head, n);
+  out[63] = '\0';
+}
+
+// Sorts n timings and prints their percentiles (Test 28).
+static void print_percentiles(uint64_t *t, size_t n) {
+  qsort(t, n, sizeof(*t), u64_cmp);
+  printf("p50 %lu, p90 %lu, p99 %lu, p99.9 %lu ns", t[n / 2], t[n * 9 / 10],
+         t[n * 99 / 100], t[n * 999 / 1000]);
+}
+
+// Average time of ht_get over n keys from first on, all present or all not.
+static uint64_t get_time(TOID(struct hashtable_s) hashtable, uint64_t first,
+                         int n, int present) {
+  uint64_t total = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t begin = rdtsc();
+    PMEMoid v = ht_get(pop, hashtable, first + i);
+    total += rdtsc() - begin;
+    if (OID_IS_NULL(v) == present)
+      die("== Key %lu %s ==\n", first + i, present ? "lost" : "was never put");
+  }
+  return total / n;
+}
+
+// Entries in the longest chain of a table.
+static size_t longest_chain(TOID(struct hashtable_s) hashtable) {
+  TOID(struct buckets) buckets = D_RO(hashtable)->buckets;
+  size_t longest = 0;
+
+  for (size_t i = 0; i < D_RO(buckets)->nbuckets; i++) {
+    size_t len = 0;
+    for (TOID(struct entry) en = ENTRY_AT(buckets, D_RO(buckets)->bucket[i]);
+         !TOID_IS_NULL(en); en = ENTRY_AT(en, D_RO(en)->next))
+      len++;
+    longest = len > longest ? len : longest;
+  }
+  return longest;
+}
+
+// Typed tables of Test 25, 8 and 64 byte values in 2^16 buckets.
+struct val64 {
+  char b[64];
+};
+HT_TYPED_PERSISTENT(tt_u64, uint64_t, uint64_t, ht_typed_sip, 16,
+                    HASHTABLE_TX_TYPE_OFFSET + 8)
+HT_TYPED_PERSISTENT(tt_v64, uint64_t, struct val64, ht_typed_sip, 16,
+                    HASHTABLE_TX_TYPE_OFFSET + 11)
+
+/*
+ * Average put and get time of n new keys from first on, in t[kind][op] with
+ * kinds 8 byte values generic and typed, then 64 byte values generic and
+ * typed. The generic table gets the 64 byte values at keys first + n on.
+ */
+static void typed_time(TOID(struct hashtable_s) hashtable,
+                       TOID(struct tt_u64) tu, TOID(struct tt_v64) tv,
+                       uint64_t first, int n, uint64_t t[4][2]) {
+  struct val64 v = {{0}};
+  struct iovec iov;
+  uint64_t begin, u;
+  size_t len;
+
+  begin = rdtsc();
+  for (int i = 0; i < n; i++)
+    if (ht_put_u64(pop, hashtable, first + i, first + i))
+      die("== Put of key %lu failed ==\n", first + i);
+  t[0][0] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    u = first + i;
+    if (tt_u64_set(pop, tu, first + i, &u))
+      die("== Typed put of key %lu failed ==\n", first + i);
+  }
+  t[1][0] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    snprintf(v.b, sizeof(v.b), "typed %lu", first + i);
+    if (ht_put(pop, hashtable, first + n + i, v.b, sizeof(v.b)))
+      die("== Put of key %lu failed ==\n", first + n + i);
+  }
+  t[2][0] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    snprintf(v.b, sizeof(v.b), "typed %lu", first + i);
+    if (tt_v64_set(pop, tv, first + i, &v))
+      die("== Typed put of key %lu failed ==\n", first + i);
+  }
+  t[3][0] = (rdtsc() - begin) / n;
+
+  begin = rdtsc();
+  for (int i = 0; i < n; i++)
+    if (ht_get_u64(pop, hashtable, first + i, &u) || u != first + i)
+      die("== Key %lu lost ==\n", first + i);
+  t[0][1] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    const uint64_t *p = tt_u64_get(tu, first + i);
+    if (p == NULL || *p != first + i)
+      die("== Typed key %lu lost ==\n", first + i);
+  }
+  t[1][1] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    snprintf(v.b, sizeof(v.b), "typed %lu", first + i);
+    if (ht_get_iov(pop, hashtable, first + n + i, &iov, 1, &len) != 1 ||
+        len != sizeof(v.b) || memcmp(iov.iov_base, v.b, len))
+      die("== Key %lu lost ==\n", first + n + i);
+  }
+  t[2][1] = (rdtsc() - begin) / n;
+  begin = rdtsc();
+  for (int i = 0; i < n; i++) {
+    snprintf(v.b, sizeof(v.b), "typed %lu", first + i);
+    const struct val64 *p = tt_v64_get(tv, first + i);
+    if (p == NULL || memcmp(p->b, v.b, sizeof(v.b)))
+      die("== Typed key %lu lost ==\n", first + i);
+  }
+  t[3][1] = (rdtsc() - begin) / n;
+}
+
 void perf_test(char *path) {
 
   TOID(struct hashtable_s) *ht1 = init_pool_ht(path, 1, 10);
@@ -491,4 +5158,1335 @@ void perf_test(char *path) {
 
   // close the pool before next call.
   pmemobj_close(pop);
+
+  printf("==== Test 7: Write-behind buffer in front of the table ====\n");
+  TOID(struct hashtable_s) *ht5 = init_pool_ht(path, 5, 1024);
+  struct wb_s *wb = wb_open(pop, *ht5, 10, 1 << 20);
+  struct wb_stats wbs;
+  char buf[64];
+  if (wb == NULL)
+    die("\t*** Can't start the write-behind buffer\n");
+
+  // Every key is written twice, the second put should coalesce in DRAM.
+  w_begin_time = rdtsc();
+  for (int i = 0; i < 2 * test_size; i++) {
+    snprintf(buf, sizeof(buf), "wb-%d", i);
+    if (wb_put(wb, i % test_size + 1, buf))
+      die("Failed!");
+  }
+  for (int i = 10; i <= test_size; i += 10)
+    wb_remove(wb, i);
+  w_end_time = rdtsc();
+
+  for (int i = 1; i <= test_size; i++) {
+    ssize_t len = wb_get(wb, i, buf, sizeof(buf));
+    if ((i % 10 == 0) != (len == -1))
+      die("== Key %d has a stale value in the write-behind buffer ==\n", i);
+  }
+
+  uint64_t s_begin_time = rdtsc();
+  wb_sync(wb);
+  uint64_t s_end_time = rdtsc();
+  for (int i = 1; i <= test_size; i++) {
+    PMEMoid valp = ht_get(pop, *ht5, i);
+    snprintf(buf, sizeof(buf), "wb-%d", i - 1 + test_size);
+    if ((i % 10 == 0) != OID_IS_NULL(valp) ||
+        (!OID_IS_NULL(valp) && strcmp(pmemobj_direct(valp), buf)))
+      die("== Key %d was not flushed to hash table %d ==\n", i, 5);
+  }
+
+  wb_get_stats(wb, &wbs);
+  printf(" === Average buffered Put time: %lu ns ====\n",
+         (w_end_time - w_begin_time) / (2 * test_size));
+  printf(" ==== Sync time: %lu ns ====\n", s_end_time - s_begin_time);
+  printf("\t*** %lu puts, %lu removes, %lu coalesced, %lu stalls\n",
+         wbs.puts, wbs.removes, wbs.coalesced, wbs.stalls);
+  printf("\t*** %lu records in %lu transactions over %lu flushes\n",
+         wbs.flushed_recs, wbs.flush_txs, wbs.flushes);
+  if (wbs.flush_ns)
+    printf("\t*** Flusher throughput: %lu records/s, %lu KiB/s\n",
+           wbs.flushed_recs * 1000000000 / wbs.flush_ns,
+           wbs.flushed_bytes * 1000000000 / 1024 / wbs.flush_ns);
+  wb_close(wb);
+  pmemobj_close(pop);
+
+  printf("==== Test 8: Non-temporal bulk value writes ====\n");
+  ht5 = init_pool_ht(path, 5, 1024);
+  printf("\t*** Calibrating the non-temporal threshold:\n");
+  nt_threshold = ht_nt_calibrate(pop, 1);
+  printf("\t*** Values of %zu bytes and more use non-temporal stores\n",
+         nt_threshold);
+
+  int nvals = 64;
+  size_t vlen = 16 * 1024;
+  test = malloc(vlen);
+  memset(test, 'B', vlen - 1);
+  test[vlen - 1] = '\0';
+
+  w_begin_time = rdtsc();
+  for (int i = 0; i < nvals; i++) {
+    TX_BEGIN(pop) {
+      PMEMoid old = ht_get(pop, *ht5, i + 1);
+      TESToid = TX_STRDUP(test, 0);
+      ht_set(pop, *ht5, i + 1, TESToid);
+      ht_value_free(old);
+    }
+    TX_ONABORT {
+      fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
+    }
+    TX_END
+  }
+  w_end_time = rdtsc();
+
+  struct ht_vbatch vb = {0};
+  PMEMoid oids[64];
+  r_begin_time = rdtsc();
+  for (int i = 0; i < nvals; i++)
+    if (OID_IS_NULL(oids[i] = ht_vbatch_add(pop, &vb, test, vlen)))
+      die("Can't reserve a %zu byte value\n", vlen);
+  TX_BEGIN(pop) {
+    ht_vbatch_publish(pop, &vb);
+    for (int i = 0; i < nvals; i++) {
+      PMEMoid old = ht_get(pop, *ht5, i + 1);
+      ht_set(pop, *ht5, i + 1, oids[i]);
+      ht_value_free(old);
+    }
+  }
+  TX_ONABORT {
+    fprintf(stderr, "transaction aborted: %s\n", pmemobj_errormsg());
+  }
+  TX_END
+  r_end_time = rdtsc();
+  ht_vbatch_free(&vb);
+
+  for (int i = 0; i < nvals; i++)
+    if (strcmp(pmemobj_direct(ht_get(pop, *ht5, i + 1)), test))
+      die("== Key %d has a corrupt bulk value ==\n", i + 1);
+  printf(" === Average TX_STRDUP Put time (%zu B): %lu ns ====\n", vlen,
+         (w_end_time - w_begin_time) / nvals);
+  printf(" === Average batched Put time (%zu B): %lu ns ====\n", vlen,
+         (r_end_time - r_begin_time) / nvals);
+  free(test);
+  pmemobj_close(pop);
+
+  printf("==== Test 9: Large binary values in extents, zero-copy reads ====\n");
+  ht5 = init_pool_ht(path, 5, 1024);
+  size_t blob_sizes[] = {64 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+  size_t blob_max = 4 * 1024 * 1024;
+  unsigned char *blob = malloc(blob_max);
+  unsigned char *copy = malloc(blob_max);
+  struct iovec iov[32];
+  for (size_t i = 0; i < blob_max; i++)
+    blob[i] = (unsigned char)(i * 7); // binary, with plenty of NUL bytes
+
+  for (int b = 0; b < 3; b++) {
+    size_t blen = blob_sizes[b];
+    uint64_t key = 100000 + b;
+    w_begin_time = rdtsc();
+    if (ht_put(pop, *ht5, key, blob, blen) == -1)
+      die("Failed!");
+    w_end_time = rdtsc();
+
+    size_t len = 0;
+    r_begin_time = rdtsc();
+    int n = ht_get_iov(pop, *ht5, key, iov, 32, &len);
+    r_end_time = rdtsc();
+    if (n < 1 || n > 32 || len != blen)
+      die("== Key %lu has a bad extent list ==\n", key);
+
+    uint64_t c_begin_time = rdtsc();
+    size_t off = 0;
+    for (int j = 0; j < n; j++) {
+      memcpy(copy + off, iov[j].iov_base, iov[j].iov_len);
+      off += iov[j].iov_len;
+    }
+    pm_emul_read_bytes(off);
+    uint64_t c_end_time = rdtsc();
+    if (off != blen || memcmp(copy, blob, blen))
+      die("== Key %lu has a corrupt binary value ==\n", key);
+
+    printf("\t*** %7zu B in %2d extents: put %lu ns, zero-copy get %lu ns, "
+           "copy-out %lu ns\n",
+           blen, n, w_end_time - w_begin_time, r_end_time - r_begin_time,
+           c_end_time - c_begin_time);
+  }
+  size_t rlen;
+  if (ht_remove(pop, *ht5, 100000 + 2) != 1 ||
+      ht_get_iov(pop, *ht5, 100000 + 2, iov, 32, &rlen) != -1)
+    die("== Removing an extent value failed ==\n");
+  free(copy);
+  free(blob);
+  pmemobj_close(pop);
+
+  printf("==== Test 10: Ordered index and range scans ====\n");
+  ht5 = init_pool_ht(path, 5, 1024);
+  uint64_t base = 200000;
+  uint64_t put_time[2];
+  for (int indexed = 0; indexed < 2; indexed++) {
+    if (indexed && ht_index_create(pop, *ht5))
+      die("Failed!");
+    w_begin_time = rdtsc();
+    // Keys base, base + 3, ... inserted out of order.
+    for (int i = 0; i < test_size; i++) {
+      uint64_t k = base + 3 * ((i * 7919) % test_size);
+      TX_BEGIN(pop) { TESToid = TX_STRDUP("ranged", 0); }
+      TX_END
+      if (ht_set(pop, *ht5, k, TESToid) == -1)
+        die("Failed!");
+    }
+    put_time[indexed] = rdtsc() - w_begin_time;
+    if (!indexed)
+      for (int i = 0; i < test_size; i++)
+        ht_remove(pop, *ht5, base + 3 * i);
+  }
+
+  struct ht_range_iter it;
+  uint64_t k, prev_k = 0, lo = base + 300, hi = base + 1500;
+  int found = 0;
+  r_begin_time = rdtsc();
+  ht_range_begin(*ht5, lo, hi, &it);
+  while (ht_range_next(&it, &k, &TESToid)) {
+    if (k < lo || k >= hi || (found && k <= prev_k) ||
+        strcmp(pmemobj_direct(TESToid), "ranged"))
+      die("== Range scan returned key %lu out of order ==\n", k);
+    prev_k = k;
+    found++;
+  }
+  r_end_time = rdtsc();
+  if (found != 400)
+    die("== Range scan found %d keys instead of 400 ==\n", found);
+
+  for (int i = 0; i < test_size; i += 2)
+    ht_remove(pop, *ht5, base + 3 * i);
+  found = 0;
+  ht_range_begin(*ht5, lo, hi, &it);
+  while (ht_range_next(&it, &k, &TESToid))
+    found++;
+  if (found != 200)
+    die("== Range scan after removes found %d keys instead of 200 ==\n",
+        found);
+
+  printf(" === Average Put time without index: %lu ns ====\n",
+         put_time[0] / test_size);
+  printf(" === Average Put time with index: %lu ns ====\n",
+         put_time[1] / test_size);
+  printf(" ==== Range scan of 400 keys: %lu ns ====\n",
+         r_end_time - r_begin_time);
+  for (int i = 1; i < test_size; i += 2)
+    ht_remove(pop, *ht5, base + 3 * i);
+  ht_index_drop(pop, *ht5);
+  pmemobj_close(pop);
+
+  printf("==== Test 11: Full-table scans with prefetching ====\n");
+  ht5 = init_pool_ht(path, 5, 16384);
+  int nscan = 20 * test_size;
+  base = 300000;
+  for (int i = 0; i < nscan; i += test_size) {
+    TX_BEGIN(pop) {
+      for (int j = i; j < i + test_size; j++)
+        ht_set(pop, *ht5, base + j, TX_STRDUP("scanned", 0));
+    }
+    TX_ONABORT { die("transaction aborted: %s\n", pmemobj_errormsg()); }
+    TX_END
+  }
+
+  // One dependent load per hop, the way ht_expand walks the table.
+  uint64_t sums[4] = {0}, naive_sum = 0, iter_sum = 0, par_sum = 0;
+  uint64_t nentries = 0;
+  TOID(struct buckets) sbuckets = D_RO(*ht5)->buckets;
+  r_begin_time = rdtsc();
+  for (size_t i = 0; i < D_RO(sbuckets)->nbuckets; i++) {
+    TOID(struct entry) buck;
+    for (buck = ENTRY_AT(sbuckets, D_RO(sbuckets)->bucket[i]);
+         !TOID_IS_NULL(buck); buck = ENTRY_AT(buck, D_RO(buck)->next)) {
+      naive_sum += D_RO(buck)->key +
+                   *(char *)pmemobj_direct(oid_at(buck.oid, D_RO(buck)->value));
+      nentries++;
+    }
+  }
+  r_end_time = rdtsc();
+  uint64_t naive_time = r_end_time - r_begin_time;
+
+  r_begin_time = rdtsc();
+  scan_sum_all(*ht5, &iter_sum);
+  r_end_time = rdtsc();
+  uint64_t iter_time = r_end_time - r_begin_time;
+
+  void *sum_args[4] = {&sums[0], &sums[1], &sums[2], &sums[3]};
+  r_begin_time = rdtsc();
+  ht_scan_parallel(*ht5, 4, scan_sum, sum_args);
+  r_end_time = rdtsc();
+  for (int i = 0; i < 4; i++)
+    par_sum += sums[i];
+  if (naive_sum != iter_sum || naive_sum != par_sum)
+    die("== Scans disagree: %lu %lu %lu ==\n", naive_sum, iter_sum, par_sum);
+
+  printf("\t*** %lu entries in %lu buckets\n", nentries,
+         D_RO(sbuckets)->nbuckets);
+  printf(" === Chain walk: %lu ns per entry ====\n", naive_time / nentries);
+  printf(" === Prefetching iterator: %lu ns per entry ====\n",
+         iter_time / nentries);
+  printf(" === Parallel scan, 4 threads: %lu ns per entry ====\n",
+         (r_end_time - r_begin_time) / nentries);
+
+  for (int i = 0; i < nscan; i += test_size) {
+    TX_BEGIN(pop) {
+      for (int j = i; j < i + test_size; j++)
+        ht_remove(pop, *ht5, base + j);
+    }
+    TX_END
+  }
+  pmemobj_close(pop);
+
+  printf("==== Test 12: Snapshot export and bulk load ====\n");
+  ht4 = init_pool_ht(path, 4, 20);
+  char snap_path[4096];
+  snprintf(snap_path, sizeof(snap_path), "%s.snap", path);
+  // One binary value too, so both record formats go through the file.
+  ht_put(pop, *ht4, 100000, "\0bin\0ary", 9);
+
+  w_begin_time = rdtsc();
+  int64_t nexported = ht_export(*ht4, snap_path);
+  w_end_time = rdtsc();
+  if (nexported < 0)
+    die("== Exporting hash table 4 failed ==\n");
+
+  // A cache in front of slot 3 must move to the loaded table.
+  char cbuf[16];
+  ht3 = pool_ht(pop, 3, 20);
+  ht_put(pop, *ht3, 100000, "old", 3);
+  struct hc_s *hc3 = hc_open(pop, *ht3, 16, 1024);
+  if (hc_get(hc3, 100000, cbuf, sizeof(cbuf)) != 3)
+    die("== Cached get before the bulk load failed ==\n");
+
+  r_begin_time = rdtsc();
+  int64_t nloaded = ht_bulk_load(pop, 3, snap_path, 0);
+  r_end_time = rdtsc();
+  if (nloaded != nexported)
+    die("== Bulk load returned %ld instead of %ld ==\n", nloaded, nexported);
+  if (hc_get(hc3, 100000, cbuf, sizeof(cbuf)) != 9 || memcmp(cbuf, "\0bin", 4))
+    die("== Cache kept the table replaced by the bulk load ==\n");
+  hc_close(hc3);
+
+  ht3 = &D_RW(POBJ_ROOT(pop, struct root))->ht_list[3];
+  struct ht_iter sit;
+  uint64_t skey;
+  PMEMoid sval;
+  ht_iter_init(*ht4, 0, SIZE_MAX, &sit);
+  while (ht_iter_next(&sit, &skey, &sval)) {
+    PMEMoid lval = ht_get(pop, *ht3, skey);
+    struct iovec a, b;
+    size_t alen, blen;
+    if (OID_IS_NULL(lval) ||
+        ht_get_iov(pop, *ht4, skey, &a, 1, &alen) != 1 ||
+        ht_get_iov(pop, *ht3, skey, &b, 1, &blen) != 1 || alen != blen ||
+        memcmp(a.iov_base, b.iov_base, alen))
+      die("== Key %lu differs after the bulk load ==\n", skey);
+  }
+  if (D_RO(*ht3)->size != (uint64_t)nloaded)
+    die("== Loaded table has size %lu ==\n", D_RO(*ht3)->size);
+
+  FILE *sf = fopen(snap_path, "r");
+  fseek(sf, 0, SEEK_END);
+  printf("\t*** %ld records, %ld bytes\n", nexported, ftell(sf));
+  fclose(sf);
+  printf(" === Average export time: %lu ns ====\n",
+         (w_end_time - w_begin_time) / nexported);
+  printf(" === Average bulk load time: %lu ns ====\n",
+         (r_end_time - r_begin_time) / nloaded);
+  ht_remove(pop, *ht4, 100000);
+  unlink(snap_path);
+  pmemobj_close(pop);
+
+  printf("==== Test 13: Sharded store, set and get %d keys ====\n", 20000);
+  int nkeys = 20000;
+  char shard_path[4096];
+  for (int nshards = 1; nshards <= 4; nshards *= 2) {
+    struct shard_store *store =
+        shard_open(path, nshards, 4096, SHARD_WORKERS | SHARD_PIN);
+    if (store == NULL)
+      die("== Opening %d shards failed ==\n", nshards);
+
+    for (int nclients = 1; nclients <= 4; nclients *= 2) {
+      struct shard_client clients[4];
+      pthread_t threads[4];
+      w_begin_time = rdtsc();
+      for (int i = 0; i < nclients; i++) {
+        clients[i].store = store;
+        clients[i].first = 1 + (uint64_t)nkeys * i / nclients;
+        clients[i].nkeys = nkeys / nclients;
+        clients[i].ret = 0;
+        pthread_create(&threads[i], NULL, shard_client, &clients[i]);
+      }
+      for (int i = 0; i < nclients; i++) {
+        pthread_join(threads[i], NULL);
+        if (clients[i].ret)
+          die("== Shard client %d failed ==\n", i);
+      }
+      w_end_time = rdtsc();
+      printf(" === %d shards, %d client threads: %lu kops/s ====\n", nshards,
+             nclients,
+             2 * (uint64_t)nkeys * 1000000 / (w_end_time - w_begin_time));
+    }
+
+    if (shard_remove(store, 1) != 1 || !OID_IS_NULL(shard_get(store, 1)))
+      die("== Shard remove failed ==\n");
+    shard_set(store, 1, "back");
+    if (strcmp(pmemobj_direct(shard_get(store, 1)), "back"))
+      die("== Shard set failed ==\n");
+    uint64_t *rkeys = malloc(nkeys * sizeof(uint64_t));
+    for (int i = 0; i < nkeys; i++)
+      rkeys[i] = i + 1;
+    if (shard_remove_batch(store, nkeys, rkeys) != nkeys)
+      die("== Shard batch remove failed ==\n");
+    free(rkeys);
+    shard_close(store);
+    for (int i = 0; i < nshards; i++) {
+      snprintf(shard_path, sizeof(shard_path), "%s.shard%d", path, i);
+      pool_remove(shard_path);
+    }
+  }
+
+  printf("==== Test 14: Small pool creation and growth ====\n");
+  char small_path[4096];
+  snprintf(small_path, sizeof(small_path), "%s.small", path);
+  pool_remove(small_path);
+  w_begin_time = rdtsc();
+  PMEMobjpool *small = pool_open(small_path);
+  TOID(struct hashtable_s) *hts = pool_ht(small, 0, 10);
+  w_end_time = rdtsc();
+  printf(" === Pool creation time: %lu us ====\n",
+         (w_end_time - w_begin_time) / 1000);
+  printf("\t*** Empty pool footprint: %lu KiB\n",
+         pool_footprint(small_path) >> 10);
+
+  // Grows the pool a few times, each growth is logged on stderr.
+  char *gblob = calloc(1, 64 * 1024);
+  memset(gblob, 'G', 64 * 1024 - 1);
+  w_begin_time = rdtsc();
+  for (int i = 0; i < 512; i++)
+    if (ht_put(small, *hts, i, gblob, 64 * 1024))
+      die("== Put into the growing pool failed ==\n");
+  w_end_time = rdtsc();
+  free(gblob);
+  printf(" === Average 64 KB put time with growth: %lu ns ====\n",
+         (w_end_time - w_begin_time) / 512);
+  printf("\t*** Footprint after 32 MiB of values: %lu MiB\n",
+         pool_footprint(small_path) >> 20);
+  pmemobj_close(small);
+  pool_remove(small_path);
+
+  printf("==== Test 15: DRAM hot-key cache, zipfian reads ====\n");
+  ht5 = init_pool_ht(path, 5, 16384);
+  int nhot = 20000, nreads = 200000;
+  uint64_t hbase = 300000;
+  char hval[128], hbuf[128];
+  memset(hval, 'H', 100);
+  hval[100] = '\0';
+  for (int i = 0; i < nhot; i += 1000) {
+    TX_BEGIN(pop) {
+      for (int j = i; j < i + 1000; j++)
+        ht_set(pop, *ht5, hbase + j, TX_STRDUP(hval, 0));
+    }
+    TX_END
+  }
+  uint32_t *ranks = malloc(nreads * sizeof(uint32_t));
+  zipf_fill(ranks, nreads, nhot, 0.99);
+
+  r_begin_time = rdtsc();
+  for (int i = 0; i < nreads; i++) {
+    val = pmemobj_direct(ht_get(pop, *ht5, hbase + ranks[i]));
+    memcpy(hbuf, val, strlen(val));
+  }
+  r_end_time = rdtsc();
+  printf(" === Average uncached Get time: %lu ns ====\n",
+         (r_end_time - r_begin_time) / nreads);
+
+  struct hc_s *hc = hc_open(pop, *ht5, nhot / 10, nhot / 10 * 128);
+  r_begin_time = rdtsc();
+  for (int i = 0; i < nreads; i++)
+    if (hc_get(hc, hbase + ranks[i], hbuf, sizeof(hbuf)) != 100)
+      die("== Cached get of key %lu failed ==\n", hbase + ranks[i]);
+  r_end_time = rdtsc();
+  struct hc_stats hcs;
+  hc_get_stats(hc, &hcs);
+  printf(" === Average cached Get time (%d entries): %lu ns ====\n",
+         nhot / 10, (r_end_time - r_begin_time) / nreads);
+  printf("\t*** Hit rate %.1f%%, %lu evictions, %lu KiB in use\n",
+         100.0 * hcs.hits / (hcs.hits + hcs.misses), hcs.evictions,
+         hcs.mem >> 10);
+
+  // The hottest key is cached by now, updates and removes must reach it.
+  TX_BEGIN(pop) { ht_set(pop, *ht5, hbase, TX_STRDUP("fresh", 0)); }
+  TX_END
+  if (hc_get(hc, hbase, hbuf, sizeof(hbuf)) != 5 || memcmp(hbuf, "fresh", 5))
+    die("== Cache served a stale value ==\n");
+  ht_remove(pop, *ht5, hbase);
+  if (hc_get(hc, hbase, hbuf, sizeof(hbuf)) != -1)
+    die("== Cache served a removed key ==\n");
+  hc_close(hc);
+
+  for (int i = 0; i < nhot; i += 1000) {
+    TX_BEGIN(pop) {
+      for (int j = i; j < i + 1000; j++)
+        ht_remove(pop, *ht5, hbase + j);
+    }
+    TX_END
+  }
+  pmemobj_close(pop);
+
+  printf("==== Test 16: TX vs. reserve/publish puts under PM emulation ====\n");
+  ht5 = init_pool_ht(path, 5, 16384);
+  struct pm_emul_cfg optane = {
+      PM_EMUL_OPTANE_READ_NS, PM_EMUL_OPTANE_WRITE_NS,
+      PM_EMUL_OPTANE_READ_MBPS, PM_EMUL_OPTANE_WRITE_MBPS};
+  struct pm_emul_cfg saved = pm_emul_cfg;
+  int saved_on = pm_emul_on;
+  int nemul = 500;
+  uint64_t ebase = 400000;
+  char *ev = calloc(1, 1024);
+  memset(ev, 'E', 1023);
+
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    pm_emul_reset_stats();
+    uint64_t tx_time, rp_time, get_time;
+    uint64_t ekey = ebase + emul * 2 * nemul; // both rounds insert new keys
+
+    w_begin_time = rdtsc();
+    for (int i = 0; i < nemul; i++) {
+      TX_BEGIN(pop) {
+        PMEMoid old = ht_get(pop, *ht5, ekey + i);
+        ht_set(pop, *ht5, ekey + i, TX_STRDUP(ev, 0));
+        ht_value_free(old);
+      }
+      TX_END
+    }
+    tx_time = rdtsc() - w_begin_time;
+
+    w_begin_time = rdtsc();
+    for (int i = 0; i < nemul; i++)
+      ht_put(pop, *ht5, ekey + nemul + i, ev, 1024);
+    rp_time = rdtsc() - w_begin_time;
+
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nemul; i++) {
+      PMEMoid v = ht_get(pop, *ht5, ekey + i);
+      pm_emul_read_bytes(strlen(pmemobj_direct(v)));
+    }
+    get_time = rdtsc() - r_begin_time;
+
+    struct pm_emul_stats es;
+    pm_emul_get_stats(&es);
+    printf(" === %s: TX put %lu ns, reserve/publish put %lu ns, get %lu ns "
+           "====\n",
+           emul ? "Optane emulation" : "No emulation", tx_time / nemul,
+           rp_time / nemul, get_time / nemul);
+    if (emul)
+      printf("\t*** %lu barriers, %lu read misses, %lu us emulated\n",
+             es.barriers, es.read_misses, es.delay_ns / 1000);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  free(ev);
+
+  for (int i = 0; i < 4 * nemul; i++)
+    ht_remove(pop, *ht5, ebase + i);
+  pmemobj_close(pop);
+
+  int nmove = 499;
+  printf("==== Test 17: Move %d keys from ht4 to ht5 ====\n", nmove);
+  ht4 = init_pool_ht(path, 4, 20);
+  ht5 = pool_ht(pop, 5, 16384);
+  uint64_t *mkeys = malloc(nmove * sizeof(uint64_t));
+  PMEMoid *mvals = malloc(nmove * sizeof(PMEMoid));
+  uint64_t size4 = D_RO(*ht4)->size, size5 = D_RO(*ht5)->size;
+  for (int i = 0; i < nmove; i++) {
+    mkeys[i] = i + 1;
+    mvals[i] = ht_get(pop, *ht4, i + 1);
+    size5 += OID_IS_NULL(ht_get(pop, *ht5, i + 1)); // others are replaced
+  }
+
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    w_begin_time = rdtsc();
+    if (ht_move_keys(pop, *ht4, *ht5, mkeys, nmove) != nmove)
+      die("== Moving keys to hash table 5 failed ==\n");
+    w_end_time = rdtsc();
+    for (int i = 0; i < nmove; i++) {
+      if (!OID_IS_NULL(ht_get(pop, *ht4, i + 1)) ||
+          !OID_EQUALS(ht_get(pop, *ht5, i + 1), mvals[i]))
+        die("== Key %d wasn't moved ==\n", i + 1);
+    }
+    if (D_RO(*ht4)->size != size4 - nmove || D_RO(*ht5)->size != size5)
+      die("== Sizes wrong after the move ==\n");
+
+    // The same move back, one key at a time through copies.
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nmove; i++) {
+      TX_BEGIN(pop) {
+        PMEMoid v = ht_get(pop, *ht5, i + 1);
+        ht_set(pop, *ht4, i + 1, TX_STRDUP(pmemobj_direct(v), 0));
+        ht_remove(pop, *ht5, i + 1);
+      }
+      TX_END
+      mvals[i] = ht_get(pop, *ht4, i + 1);
+    }
+    r_end_time = rdtsc();
+    printf(" === %s: move by relinking %lu ns, by copying %lu ns per key "
+           "====\n",
+           emul ? "Optane emulation" : "No emulation",
+           (w_end_time - w_begin_time) / nmove,
+           (r_end_time - r_begin_time) / nmove);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+
+  // Out and back again with an index on ht4, which must follow the keys.
+  if (ht_index_create(pop, *ht4))
+    die("== Indexing hash table 4 failed ==\n");
+  if (ht_move_keys(pop, *ht4, *ht5, mkeys, nmove) != nmove ||
+      ht_move_keys(pop, *ht5, *ht4, mkeys, nmove) != nmove)
+    die("== Moving indexed keys failed ==\n");
+  struct ht_range_iter rit;
+  uint64_t rkey, nindexed = 0;
+  PMEMoid rval;
+  ht_range_begin(*ht4, 0, UINT64_MAX, &rit);
+  while (ht_range_next(&rit, &rkey, &rval))
+    nindexed++;
+  if (D_RO(*ht4)->size != size4 || nindexed != size4)
+    die("== Index wrong after moving keys back ==\n");
+  ht_index_drop(pop, *ht4);
+  free(mvals);
+  free(mkeys);
+  pmemobj_close(pop);
+
+  int nbatch = 64, nrounds = 50;
+  uint64_t bbase = 600000;
+  printf("==== Test 18: Batches of %d puts across ht2 and ht5 ====\n", nbatch);
+  ht2 = init_pool_ht(path, 2, 16384);
+  ht5 = pool_ht(pop, 5, 16384);
+  uint64_t size2 = D_RO(*ht2)->size;
+  size5 = D_RO(*ht5)->size;
+  struct ht_batch batch = {0};
+  uint64_t *round_time = malloc(3 * nrounds * sizeof(uint64_t));
+  char bval[32];
+  for (int emul = 0; emul < 2; emul++) {
+    uint64_t mode_barriers[3] = {0, 0, 0};
+    struct pm_emul_stats st;
+    pm_emul_set(emul ? &optane : NULL);
+    // Modes take turns so that they all see the same chain lengths, and
+    // the median round of each is reported.
+    for (int r = 0; r < nrounds; r++) {
+      for (int mode = 0; mode < 3; mode++) {
+        uint64_t bkey = bbase + ((emul * nrounds + r) * 3 + mode) * nbatch;
+        pm_emul_reset_stats();
+        w_begin_time = rdtsc();
+        if (mode == 0) { // one transaction per put
+          for (int i = 0; i < nbatch; i++) {
+            snprintf(bval, sizeof(bval), "%lu", bkey + i);
+            TX_BEGIN(pop) {
+              ht_set(pop, i % 2 ? *ht5 : *ht2, bkey + i, TX_STRDUP(bval, 0));
+            }
+            TX_END
+          }
+        } else if (mode == 1) { // all puts nested in one outer transaction
+          TX_BEGIN(pop) {
+            for (int i = 0; i < nbatch; i++) {
+              snprintf(bval, sizeof(bval), "%lu", bkey + i);
+              ht_set(pop, i % 2 ? *ht5 : *ht2, bkey + i, TX_STRDUP(bval, 0));
+            }
+          }
+          TX_END
+        } else {
+          for (int i = 0; i < nbatch; i++) {
+            snprintf(bval, sizeof(bval), "%lu", bkey + i);
+            ht_batch_put(&batch, i % 2 ? *ht5 : *ht2, bkey + i, bval);
+          }
+          if (ht_batch_commit(pop, &batch) != nbatch)
+            die("== Batch commit failed ==\n");
+        }
+        round_time[mode * nrounds + r] = rdtsc() - w_begin_time;
+        pm_emul_get_stats(&st);
+        mode_barriers[mode] += st.barriers;
+      }
+    }
+    printf(" === %s: per put %lu ns one TX each, %lu ns nested, %lu ns "
+           "batched ====\n",
+           emul ? "Optane emulation" : "No emulation",
+           round_median(round_time, nrounds) / nbatch,
+           round_median(round_time + nrounds, nrounds) / nbatch,
+           round_median(round_time + 2 * nrounds, nrounds) / nbatch);
+    if (emul)
+      printf(" === Barriers per batch: %lu one TX each, %lu nested, %lu "
+             "batched ====\n",
+             mode_barriers[0] / nrounds, mode_barriers[1] / nrounds,
+             mode_barriers[2] / nrounds);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+
+  int nbkeys = 6 * nbatch * nrounds;
+  for (int i = 0; i < nbkeys; i++) {
+    PMEMoid v = ht_get(pop, i % 2 ? *ht5 : *ht2, bbase + i);
+    snprintf(bval, sizeof(bval), "%lu", bbase + i);
+    if (OID_IS_NULL(v) || strcmp(pmemobj_direct(v), bval))
+      die("== Batched key %lu missing ==\n", bbase + i);
+  }
+  for (int i = 0; i < nbatch; i++)
+    ht_batch_put(&batch, i % 2 ? *ht5 : *ht2, bbase + i, "updated");
+  if (ht_batch_commit(pop, &batch) != nbatch ||
+      strcmp(pmemobj_direct(ht_get(pop, *ht5, bbase + 1)), "updated"))
+    die("== Batched updates failed ==\n");
+  // Remove them all in one batch; a put followed by a remove of the same
+  // key only keeps the remove.
+  for (int i = 0; i < nbkeys; i++) {
+    ht_batch_put(&batch, i % 2 ? *ht5 : *ht2, bbase + i, "overwritten");
+    ht_batch_remove(&batch, i % 2 ? *ht5 : *ht2, bbase + i);
+  }
+  if (ht_batch_commit(pop, &batch) != nbkeys || D_RO(*ht2)->size != size2 ||
+      D_RO(*ht5)->size != size5 || !OID_IS_NULL(ht_get(pop, *ht2, bbase)))
+    die("== Batched removes failed ==\n");
+  ht_batch_free(&batch);
+  free(round_time);
+
+  int ncounters = 64, nincs = 20480, ncthreads = 4;
+  uint64_t cbase = 700000, cold;
+  printf("==== Test 19: Incrementing %d 8 byte counters in ht5 ====\n",
+         ncounters);
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    // The update path of ht_set: a new string value swapped in by a
+    // transaction.
+    w_begin_time = rdtsc();
+    for (int i = 0; i < nincs; i++) {
+      uint64_t key = cbase + i % ncounters;
+      TX_BEGIN(pop) {
+        PMEMoid old = ht_get(pop, *ht5, key);
+        uint64_t count =
+            OID_IS_NULL(old) ? 0 : strtoul(pmemobj_direct(old), NULL, 10);
+        snprintf(bval, sizeof(bval), "%lu", count + 1);
+        ht_set(pop, *ht5, key, TX_STRDUP(bval, 0));
+        ht_value_free(old);
+      }
+      TX_END
+    }
+    w_end_time = rdtsc();
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nincs; i++)
+      if (ht_fetch_add(pop, *ht5, cbase + ncounters + i % ncounters, 1, &cold))
+        die("== Fetch and add failed ==\n");
+    r_end_time = rdtsc();
+    printf(" === %s: %lu kincs/s through transactions, %lu kincs/s with "
+           "ht_fetch_add ====\n",
+           emul ? "Optane emulation" : "No emulation",
+           (uint64_t)nincs * 1000000 / (w_end_time - w_begin_time),
+           (uint64_t)nincs * 1000000 / (r_end_time - r_begin_time));
+    cbase += 2 * ncounters;
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+
+  // Concurrent increments of the same counters lose nothing, while this
+  // thread reads them through a cache the increments invalidate.
+  struct counter_client cclients[4];
+  pthread_t cthreads[4];
+  struct hc_s *chc = hc_open(pop, *ht5, ncounters, 4096);
+  if (chc == NULL)
+    die("== Opening a cache of the counters failed ==\n");
+  w_begin_time = rdtsc();
+  for (int i = 0; i < ncthreads; i++) {
+    cclients[i] =
+        (struct counter_client){pop, *ht5, cbase, ncounters, nincs, 0};
+    pthread_create(&cthreads[i], NULL, counter_client, &cclients[i]);
+  }
+  for (int i = 0; i < nincs; i++)
+    hc_get(chc, cbase + i % ncounters, bval, sizeof(bval));
+  for (int i = 0; i < ncthreads; i++) {
+    pthread_join(cthreads[i], NULL);
+    if (cclients[i].ret)
+      die("== Counter thread %d failed ==\n", i);
+  }
+  w_end_time = rdtsc();
+  printf(" === %d threads: %lu kincs/s with ht_fetch_add ====\n", ncthreads,
+         (uint64_t)ncthreads * nincs * 1000000 / (w_end_time - w_begin_time));
+  uint64_t cv, ctotal = 0;
+  for (int i = 0; i < ncounters; i++) {
+    if (ht_get_u64(pop, *ht5, cbase + i, &cv) ||
+        hc_get(chc, cbase + i, bval, sizeof(bval)) != sizeof(cv) ||
+        memcmp(bval, &cv, sizeof(cv)))
+      die("== Counter %lu missing or stale in the cache ==\n", cbase + i);
+    ctotal += cv;
+  }
+  hc_close(chc);
+  if (ctotal != (uint64_t)ncthreads * nincs)
+    die("== Counters add up to %lu, not %lu ==\n", ctotal,
+        (uint64_t)ncthreads * nincs);
+
+  cv = 5;
+  if (ht_cas(pop, *ht5, cbase, &cv, 7) != 0 ||
+      cv != (uint64_t)ncthreads * nincs / ncounters ||
+      ht_cas(pop, *ht5, cbase, &cv, 7) != 1 ||
+      ht_get_u64(pop, *ht5, cbase, &cv) || cv != 7)
+    die("== Compare and swap failed ==\n");
+  if (ht_put_u64(pop, *ht5, cbase, 42) || ht_get_u64(pop, *ht5, cbase, &cv) ||
+      cv != 42)
+    die("== Fixed-width put failed ==\n");
+  // String values aren't fixed-width until ht_put_u64 replaces them.
+  uint64_t strkey = cbase - 2 * ncounters;
+  if (ht_fetch_add(pop, *ht5, strkey, 1, &cold) != -1 ||
+      ht_cas(pop, *ht5, strkey, &cv, 1) != -1 ||
+      ht_put_u64(pop, *ht5, strkey, 1) ||
+      ht_fetch_add(pop, *ht5, strkey, 1, &cold) || cold != 1)
+    die("== Fixed-width ops on a string value misbehaved ==\n");
+
+  int ncompact = 65536, nlookups = 200000;
+  uint64_t kbase = 800000;
+  char cval[128];
+  printf("==== Test 20: Compacting the chains of ht2 ====\n");
+  // Fillers put first and removed leave holes for the values to move into.
+  for (int i = 0; i < 2 * ncompact; i++) {
+    uint64_t key = kbase + (i + ncompact) % (2 * ncompact);
+    snprintf(cval, sizeof(cval), "compact %lu%*s", key, 90, "");
+    TX_BEGIN(pop) { ht_set(pop, *ht2, key, TX_STRDUP(cval, 0)); }
+    TX_END
+  }
+  for (int i = 0; i < ncompact; i++)
+    ht_remove(pop, *ht2, kbase + ncompact + i);
+  pthread_rwlock_t clock;
+  pthread_rwlock_init(&clock, NULL);
+  struct ht_compact_stats cstats;
+  uint64_t lookup_ns[3];
+  double frag[2];
+  frag[0] = pool_fragmentation(pop);
+  // Lookups before, during and after a background pass.
+  for (int phase = 0; phase < 3; phase++) {
+    struct ht_compactor *c = NULL;
+    if (phase == 1 &&
+        (c = ht_compact_start(pop, *ht2, HT_COMPACT_VALUES, 64, 100,
+                              &clock)) == NULL)
+      die("== Starting the compaction failed ==\n");
+    uint64_t x = 1, nl = 0, total = 0;
+    do {
+      for (int i = 0; i < 1000; i++, nl++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t key = kbase + (x >> 33) % ncompact;
+        pthread_rwlock_rdlock(&clock);
+        r_begin_time = rdtsc();
+        PMEMoid v = ht_get(pop, *ht2, key);
+        r_end_time = rdtsc();
+        snprintf(cval, sizeof(cval), "compact %lu%*s", key, 90, "");
+        if (OID_IS_NULL(v) || strcmp(pmemobj_direct(v), cval))
+          die("== Key %lu lost by compaction ==\n", key);
+        pthread_rwlock_unlock(&clock);
+        total += r_end_time - r_begin_time;
+      }
+    } while (phase == 1 ? !ht_compact_done(c) : nl < (uint64_t)nlookups);
+    lookup_ns[phase] = total / nl;
+    if (phase == 1 && ht_compact_finish(c, 0, &cstats))
+      die("== Compaction failed ==\n");
+  }
+  frag[1] = pool_fragmentation(pop);
+  TOID(struct buckets) cbuckets = D_RO(*ht2)->buckets;
+  size_t ncontig = 0, nb = D_RO(cbuckets)->nbuckets;
+  for (size_t h = 0; h < nb; h++)
+    ncontig +=
+        compact_chain_done(ENTRY_AT(cbuckets, D_RO(cbuckets)->bucket[h]));
+  printf(" === %lu entries and %lu values relocated in %lu steps, %zu of "
+         "%zu chains contiguous ====\n",
+         cstats.entries, cstats.values, cstats.steps, ncontig, nb);
+  printf(" === Lookup %lu ns before, %lu ns during, %lu ns after ====\n",
+         lookup_ns[0], lookup_ns[1], lookup_ns[2]);
+  printf(" === Heap fragmentation %.1f%% before, %.1f%% after ====\n",
+         frag[0] * 100, frag[1] * 100);
+  if (ncontig != nb || D_RO(*ht2)->size != size2 + ncompact)
+    die("== Compaction left chains scattered ==\n");
+
+  // A second pass finds nothing to do, and the index of ht4 follows.
+  size_t cursor = 0;
+  memset(&cstats, 0, sizeof(cstats));
+  while (ht_compact_step(pop, *ht2, &cursor, 4096, 0, &cstats) > 0)
+    ;
+  if (cstats.entries != 0)
+    die("== Compacted chains were moved again ==\n");
+  ht4 = pool_ht(pop, 4, 20);
+  if (ht_index_create(pop, *ht4))
+    die("== Indexing hash table 4 failed ==\n");
+  for (cursor = 0; ht_compact_step(pop, *ht4, &cursor, 4, 0, &cstats) > 0;)
+    ;
+  uint64_t nranged = 0;
+  ht_range_begin(*ht4, 0, UINT64_MAX, &rit);
+  while (ht_range_next(&rit, &rkey, &rval)) {
+    if (!OID_EQUALS(rval, ht_get(pop, *ht4, rkey)))
+      die("== Index of ht4 points at a moved entry ==\n");
+    nranged++;
+  }
+  if (nranged != D_RO(*ht4)->size || cstats.entries == 0)
+    die("== Index of ht4 lost keys in compaction ==\n");
+  ht_index_drop(pop, *ht4);
+  pthread_rwlock_destroy(&clock);
+
+  int nprobe = 200000;
+  uint64_t mbase = 1ULL << 40, miss_ns[3], hit_ns = 0;
+  double bf_fp[2];
+  struct bf_stats bst;
+  struct bf_s *bf = NULL;
+  printf("==== Test 21: Bloom filter in front of ht2 ====\n");
+  // Keys that were never put, without a filter, at 1%, then at 4 bits/key.
+  miss_ns[0] = get_time(*ht2, mbase, nprobe, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    if ((bf = bf_open(*ht2, 0.01, pass ? 4 : 0)) == NULL)
+      die("== Opening the filter of ht2 failed ==\n");
+    miss_ns[pass + 1] = get_time(*ht2, mbase, nprobe, 0);
+    bf_get_stats(bf, &bst);
+    bf_fp[pass] = (double)bst.false_positives / bst.lookups;
+    printf(" === %.1f bits/key, %d hashes, %zu KB for %zu keys: expected fp "
+           "%.2f%%, measured %.2f%% ====\n",
+           bst.bits_per_key, bst.hashes, bst.mem / 1024, bst.keys,
+           bst.fp_rate * 100, bf_fp[pass] * 100);
+    // No false negatives, a new key is found and a removed one isn't.
+    if (pass == 0)
+      hit_ns = get_time(*ht2, kbase, ncompact, 1);
+    if (ht_put(pop, *ht2, mbase - 1, "bloom", 5) ||
+        OID_IS_NULL(ht_get(pop, *ht2, mbase - 1)) ||
+        ht_remove(pop, *ht2, mbase - 1) != 1 ||
+        !OID_IS_NULL(ht_get(pop, *ht2, mbase - 1)))
+      die("== Filter of ht2 out of step with the table ==\n");
+    bf_close(bf);
+  }
+  printf(" === Miss %lu ns without a filter, %lu ns at 1%%, %lu ns at 4 "
+         "bits/key, hit %lu ns ====\n",
+         miss_ns[0], miss_ns[1], miss_ns[2], hit_ns);
+  if (bf_fp[0] > 0.02)
+    die("== Filter of ht2 lets too many misses through ==\n");
+
+  int nmulti = 65536, batch_sizes[] = {8, 16, 32, 64};
+  uint64_t *mgkeys = malloc(nmulti * sizeof(uint64_t)), mx = 7;
+  PMEMoid *mgout = malloc(nmulti * sizeof(PMEMoid));
+  size_t mgfound = 0;
+  printf("==== Test 22: Multi-gets of %d keys of ht2, a quarter missing "
+         "====\n",
+         nmulti);
+  for (int i = 0; i < nmulti; i++) {
+    mx = mx * 6364136223846793005ULL + 1442695040888963407ULL;
+    mgkeys[i] = (i % 4 ? kbase : mbase) + (mx >> 33) % ncompact;
+  }
+  for (int i = 0; i < nmulti; i += 64)
+    mgfound += ht_get_multi(pop, *ht2, mgkeys + i, mgout + i, 64);
+  for (int i = 0; i < nmulti; i++)
+    if (!OID_EQUALS(mgout[i], ht_get(pop, *ht2, mgkeys[i])))
+      die("== Multi-get of key %lu differs from ht_get ==\n", mgkeys[i]);
+  if (mgfound != (size_t)nmulti / 4 * 3)
+    die("== Multi-get found %zu keys ==\n", mgfound);
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    pm_emul_reset_stats();
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nmulti; i++)
+      mgout[i] = ht_get(pop, *ht2, mgkeys[i]);
+    r_end_time = rdtsc();
+    printf(" === %s: ht_get %lu ns/key", emul ? "Optane" : "No emulation",
+           (r_end_time - r_begin_time) / nmulti);
+    for (int j = 0; j < 4; j++) {
+      pm_emul_reset_stats();
+      r_begin_time = rdtsc();
+      for (int i = 0; i < nmulti; i += batch_sizes[j])
+        ht_get_multi(pop, *ht2, mgkeys + i, mgout + i, batch_sizes[j]);
+      r_end_time = rdtsc();
+      printf(", by %d %lu", batch_sizes[j],
+             (r_end_time - r_begin_time) / nmulti);
+    }
+    printf(" ====\n");
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+
+  int nasync_puts = 8192, inflight[] = {16, 256, 4096};
+  uint64_t abase = 900000;
+  struct async_count acount;
+  struct ht_async *as;
+  struct ht_async_stats astats;
+  printf("==== Test 23: Asynchronous gets and puts on ht2, one thread ====\n");
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    // The keys of Test 22, blocking and with more and more gets in flight.
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nmulti; i++)
+      mgout[i] = ht_get(pop, *ht2, mgkeys[i]);
+    r_end_time = rdtsc();
+    printf(" === %s: gets %lu ns blocking", emul ? "Optane" : "No emulation",
+           (r_end_time - r_begin_time) / nmulti);
+    for (int j = 0; j < 3; j++) {
+      if ((as = ht_async_open(pop, inflight[j], 64)) == NULL)
+        die("== Opening an async scheduler failed ==\n");
+      memset(&acount, 0, sizeof(acount));
+      r_begin_time = rdtsc();
+      for (int i = 0; i < nmulti; i++)
+        ht_async_get(as, *ht2, mgkeys[i], async_counted, &acount);
+      ht_async_poll(as, 0);
+      r_end_time = rdtsc();
+      ht_async_close(as);
+      if (acount.done != (uint64_t)nmulti || acount.found != mgfound)
+        die("== Async gets found %lu of %lu keys ==\n", acount.found,
+            mgfound);
+      printf(", %lu with %d in flight", (r_end_time - r_begin_time) / nmulti,
+             inflight[j]);
+    }
+    // One transaction per put, then puts committed 64 at a time.
+    w_begin_time = rdtsc();
+    for (int i = 0; i < nasync_puts; i++) {
+      snprintf(cval, sizeof(cval), "async %lu", abase + i);
+      TX_BEGIN(pop) { ht_set(pop, *ht2, abase + i, TX_STRDUP(cval, 0)); }
+      TX_END
+    }
+    w_end_time = rdtsc();
+    if ((as = ht_async_open(pop, 256, 64)) == NULL)
+      die("== Opening an async scheduler failed ==\n");
+    memset(&acount, 0, sizeof(acount));
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nasync_puts; i++) {
+      snprintf(cval, sizeof(cval), "async %lu", abase + nasync_puts + i);
+      if (ht_async_put(as, *ht2, abase + nasync_puts + i, cval,
+                       async_counted, &acount))
+        die("== Queueing an async put failed ==\n");
+    }
+    ht_async_poll(as, 0);
+    r_end_time = rdtsc();
+    ht_async_get_stats(as, &astats);
+    ht_async_close(as);
+    if (acount.done != (uint64_t)nasync_puts || acount.failed)
+      die("== %lu async puts failed ==\n", acount.failed);
+    printf("; puts %lu ns blocking, %lu async in %lu commits ====\n",
+           (w_end_time - w_begin_time) / nasync_puts,
+           (r_end_time - r_begin_time) / nasync_puts, astats.commits);
+    abase += 2 * nasync_puts;
+  }
+  // Callbacks that fill the next group commit it from inside a commit, and
+  // with two puts each, find every op held by committed puts.
+  for (int per = 1; per <= 2; per++) {
+    uint64_t nchain = 1000;
+    struct async_chain chain = {.hashtable = *ht2, .first = abase,
+                                .next = abase + 2, .end = abase + nchain,
+                                .per = per};
+    if ((chain.as = ht_async_open(pop, per == 1 ? 4 : 2, 2)) == NULL)
+      die("== Opening an async scheduler failed ==\n");
+    for (uint64_t key = abase; key < abase + 2; key++) {
+      snprintf(cval, sizeof(cval), "async %lu", key);
+      ht_async_put(chain.as, *ht2, key, cval, async_chained, &chain);
+    }
+    ht_async_close(chain.as);
+    if (chain.bad || chain.done != nchain ||
+        chain.sum != nchain * (nchain - 1) / 2)
+      die("== Chained async puts, %d per callback, went wrong ==\n", per);
+    abase = chain.end;
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  for (uint64_t key = 900000; key < abase; key++) {
+    snprintf(cval, sizeof(cval), "async %lu", key);
+    PMEMoid v = ht_get(pop, *ht2, key);
+    if (OID_IS_NULL(v) || strcmp(pmemobj_direct(v), cval))
+      die("== Put of key %lu lost ==\n", key);
+  }
+
+  char frz_path[4096];
+  snprintf(frz_path, sizeof(frz_path), "%s.frozen", path);
+  printf("==== Test 24: Freezing ht2 into %s ====\n", frz_path);
+  w_begin_time = rdtsc();
+  int64_t nfrozen = ht_freeze(*ht2, frz_path);
+  w_end_time = rdtsc();
+  struct ht_frozen *fz = ht_frozen_open(frz_path);
+  if (nfrozen != (int64_t)D_RO(*ht2)->size || fz == NULL)
+    die("== Freezing ht2 failed ==\n");
+  // Entries, bucket slots and values, without allocator headers.
+  size_t live_bytes = D_RO(D_RO(*ht2)->buckets)->nbuckets * sizeof(uint64_t) +
+                      nfrozen * sizeof(struct entry);
+  ht_iter_init(*ht2, 0, SIZE_MAX, &sit);
+  while (ht_iter_next(&sit, &rkey, &rval))
+    live_bytes += pmemobj_alloc_usable_size(rval);
+  printf(" === %ld keys frozen in %lu ms: %lu bytes/key, the live table "
+         "%zu ====\n",
+         nfrozen, (w_end_time - w_begin_time) / 1000000,
+         ht_frozen_size(fz) / nfrozen, live_bytes / nfrozen);
+  for (int i = 0; i < nmulti; i++) {
+    size_t flen;
+    const char *fv = ht_frozen_get(fz, mgkeys[i], &flen);
+    if ((fv == NULL) != OID_IS_NULL(mgout[i]) ||
+        (fv != NULL && (flen != ht_value_len(mgout[i]) ||
+                        memcmp(fv, pmemobj_direct(mgout[i]), flen + 1))))
+      die("== Frozen value of key %lu differs ==\n", mgkeys[i]);
+  }
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    pm_emul_reset_stats();
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nmulti; i++)
+      mgout[i] = ht_get(pop, *ht2, mgkeys[i]);
+    r_end_time = rdtsc();
+    pm_emul_reset_stats();
+    w_begin_time = rdtsc();
+    size_t flen, nfound = 0;
+    for (int i = 0; i < nmulti; i++)
+      nfound += ht_frozen_get(fz, mgkeys[i], &flen) != NULL;
+    w_end_time = rdtsc();
+    if (nfound != mgfound)
+      die("== Frozen table found %zu keys ==\n", nfound);
+    printf(" === %s: get %lu ns live, %lu ns frozen ====\n",
+           emul ? "Optane" : "No emulation",
+           (r_end_time - r_begin_time) / nmulti,
+           (w_end_time - w_begin_time) / nmulti);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  // Another process maps the same file and sees the same values.
+  pid_t child = fork();
+  if (child == 0) {
+    struct ht_frozen *cfz = ht_frozen_open(frz_path);
+    size_t flen, nfound = 0;
+    for (int i = 0; cfz != NULL && i < nmulti; i++)
+      nfound += ht_frozen_get(cfz, mgkeys[i], &flen) != NULL;
+    _exit(nfound == mgfound ? 0 : 1);
+  }
+  int cstatus;
+  if (child < 0 || waitpid(child, &cstatus, 0) != child ||
+      !WIFEXITED(cstatus) || WEXITSTATUS(cstatus) != 0)
+    die("== Frozen table unreadable from another process ==\n");
+  ht_frozen_close(fz);
+  // A slot pointing past the end of the file is refused at open.
+  struct frz_header fhdr;
+  int ffd = open(frz_path, O_RDWR);
+  if (ffd < 0 || pread(ffd, &fhdr, sizeof(fhdr), 0) != sizeof(fhdr) ||
+      pwrite(ffd, &fhdr.size, sizeof(uint64_t),
+             fhdr.slots_off + sizeof(uint64_t)) != sizeof(uint64_t) ||
+      close(ffd) || (fz = ht_frozen_open(frz_path)) != NULL)
+    die("== Frozen table with a bad slot opened ==\n");
+  unlink(frz_path);
+
+  int ntyped = 65536;
+  uint64_t tbase = 1ULL << 41, tt_ns[4][2];
+  TOID(struct hashtable_s) *ht0 = pool_ht(pop, 0, 65536);
+  TOID(struct tt_u64) tu;
+  TOID(struct tt_v64) tv;
+  printf("==== Test 25: Typed tables against the generic engine ====\n");
+  if (tt_u64_new(pop, &tu, 0) || tt_v64_new(pop, &tv, 0))
+    die("== Creating the typed tables failed ==\n");
+  for (int emul = 0; emul < 2; emul++) {
+    pm_emul_set(emul ? &optane : NULL);
+    typed_time(*ht0, tu, tv, tbase, ntyped, tt_ns);
+    tbase += 2 * ntyped;
+    for (int wide = 0; wide < 2; wide++)
+      printf(" === %s, %d byte values: put %lu ns generic, %lu ns typed, "
+             "get %lu ns generic, %lu ns typed ====\n",
+             emul ? "Optane" : "No emulation", wide ? 64 : 8,
+             tt_ns[2 * wide][0], tt_ns[2 * wide + 1][0], tt_ns[2 * wide][1],
+             tt_ns[2 * wide + 1][1]);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  // Updates keep the size, removes shrink it.
+  uint64_t tval = 7;
+  if (tt_u64_set(pop, tu, 1ULL << 41, &tval) != 1 ||
+      *tt_u64_get(tu, 1ULL << 41) != 7 ||
+      tt_u64_remove(pop, tu, 1ULL << 41) != 1 ||
+      tt_u64_get(tu, 1ULL << 41) != NULL ||
+      tt_u64_remove(pop, tu, 1ULL << 41) != 0 ||
+      D_RO(tu)->size != 2 * (uint64_t)ntyped - 1 ||
+      D_RO(tv)->size != 2 * (uint64_t)ntyped)
+    die("== Typed tables out of step ==\n");
+  if (tt_u64_free(pop, tu) || tt_v64_free(pop, tv))
+    die("== Freeing the typed tables failed ==\n");
+
+  /*
+   * Keys an attacker would pick: multiples of the bucket count, which share
+   * a bucket under key % size, and keys that all hit bucket 0 of the
+   * universal hash ht_alloc used before, whose coefficients were the first
+   * two rand() values of every process since nothing seeded it.
+   */
+  int nadv = 4096;
+  uint64_t *adv = malloc(nadv * sizeof(uint64_t)), adv_max[3], adv_ns[3];
+  const char *adv_names[] = {"Sequential keys", "Multiples of the bucket count",
+                             "Collisions of the old hash"};
+  printf("==== Test 26: Chain lengths under adversarial keys ====\n");
+  for (int set = 0; set < 3; set++) {
+    uint64_t key = 1;
+    for (int n = 0; n < nadv; key++) {
+      if (set == 0)
+        adv[n++] = tbase + key;
+      else if (set == 1)
+        adv[n++] = key * nadv;
+      else if (((1804289383U * key + 846930886U) % 32212254719ULL) % nadv == 0)
+        adv[n++] = key;
+    }
+    // A new table, with a new secret, of one bucket per key.
+    ht_reclaim(pop, ht0);
+    ht0 = pool_ht(pop, 0, nadv);
+    for (int i = 0; i < nadv; i++)
+      if (ht_put_u64(pop, *ht0, adv[i], i))
+        die("== Put of key %lu failed ==\n", adv[i]);
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nadv; i++) {
+      uint64_t v;
+      if (ht_get_u64(pop, *ht0, adv[i], &v) || v != (uint64_t)i)
+        die("== Key %lu lost ==\n", adv[i]);
+    }
+    r_end_time = rdtsc();
+    adv_max[set] = longest_chain(*ht0);
+    adv_ns[set] = (r_end_time - r_begin_time) / nadv;
+    printf(" === %s: longest chain %lu of %d keys, get %lu ns ====\n",
+           adv_names[set], adv_max[set], nadv, adv_ns[set]);
+  }
+  // Balls into bins: the longest chain stays around ln n / ln ln n.
+  for (int set = 0; set < 3; set++)
+    if (adv_max[set] > 16)
+      die("== %s share a chain ==\n", adv_names[set]);
+
+  printf("==== Test 27: Bytes per key and gets with 8-byte pointers ====\n");
+  int nslim = 65536;
+  uint64_t *skeys = malloc(nslim * sizeof(uint64_t));
+  if (skeys == NULL)
+    die("== Out of memory ==\n");
+  ht_reclaim(pop, ht0);
+  ht0 = pool_ht(pop, 0, nslim);
+  for (int i = 0; i < nslim; i++) {
+    skeys[i] = tbase + 2 * (uint64_t)i;
+    if (ht_put_u64(pop, *ht0, skeys[i], i))
+      die("== Put of key %lu failed ==\n", skeys[i]);
+  }
+  // Every allocation also costs a 16-byte header and rounding up to 16.
+  size_t entry_bytes = 0, value_bytes = 0;
+  ht_iter_init(*ht0, 0, SIZE_MAX, &sit);
+  while (ht_iter_next(&sit, &rkey, &rval))
+    value_bytes += 16 + pmemobj_alloc_usable_size(rval);
+  TOID(struct buckets) kbuckets = D_RO(*ht0)->buckets;
+  for (size_t i = 0; i < D_RO(kbuckets)->nbuckets; i++)
+    for (TOID(struct entry) en = ENTRY_AT(kbuckets, D_RO(kbuckets)->bucket[i]);
+         !TOID_IS_NULL(en); en = ENTRY_AT(en, D_RO(en)->next))
+      entry_bytes += 16 + pmemobj_alloc_usable_size(en.oid);
+  size_t slot_bytes = D_RO(kbuckets)->nbuckets * sizeof(uint64_t);
+  // The same table with a PMEMoid in every slot and entry field.
+  size_t wide_bytes = D_RO(kbuckets)->nbuckets * sizeof(PMEMoid) +
+                      nslim * (16 + (sizeof(uint64_t) + 2 * sizeof(PMEMoid) +
+                                        15) / 16 * 16);
+  printf(" === Index %zu bytes/key (entries %zu, slots %zu), with PMEMoids "
+         "%zu; values %zu ====\n",
+         (slot_bytes + entry_bytes) / nslim, entry_bytes / nslim,
+         slot_bytes / nslim, wide_bytes / nslim, value_bytes / nslim);
+  for (int i = nslim - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    uint64_t k = skeys[i];
+    skeys[i] = skeys[j];
+    skeys[j] = k;
+  }
+  for (int emul = 0; emul < 2; emul++) {
+    struct pm_emul_stats sst;
+    pm_emul_set(emul ? &optane : NULL);
+    pm_emul_reset_stats();
+    r_begin_time = rdtsc();
+    for (int i = 0; i < nslim; i++)
+      if (OID_IS_NULL(ht_get(pop, *ht0, skeys[i])))
+        die("== Key %lu lost ==\n", skeys[i]);
+    r_end_time = rdtsc();
+    pm_emul_get_stats(&sst);
+    // ht_get_u64 also reads the value, one more dependent miss.
+    uint64_t sv;
+    w_begin_time = rdtsc();
+    for (int i = 0; i < nslim; i++)
+      if (ht_get_u64(pop, *ht0, skeys[i], &sv))
+        die("== Key %lu lost ==\n", skeys[i]);
+    w_end_time = rdtsc();
+    printf(" === %s: get %lu ns, %.2f read misses/key, ht_get_u64 %lu ns "
+           "====\n",
+           emul ? "Optane" : "No emulation",
+           (r_end_time - r_begin_time) / nslim,
+           (double)sst.read_misses / nslim,
+           (w_end_time - w_begin_time) / nslim);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  free(skeys);
+
+  printf("==== Test 28: Hot/cold tiers under zipfian gets and puts ====\n");
+  int ntier = 50000, ntops = 200000;
+  const char *tier_names[] = {"No hot tier", "LRU", "LFU",
+                              "LFU, write-behind"};
+  char tstr[64], tbuf[64];
+  uint32_t *tranks = malloc(ntops * sizeof(uint32_t));
+  uint64_t *tlat = malloc(ntops * sizeof(uint64_t));
+  int *tlast = malloc(ntier * sizeof(int));
+  if (tranks == NULL || tlat == NULL || tlast == NULL)
+    die("== Out of memory ==\n");
+  ht_reclaim(pop, ht0);
+  ht0 = pool_ht(pop, 0, ntier);
+  for (int i = 0; i < ntier; i += 1000) {
+    TX_BEGIN(pop) {
+      for (int j = i; j < i + 1000; j++) {
+        tier_value(tstr, -1, j);
+        ht_set(pop, *ht0, tbase + j, TX_STRDUP(tstr, 0));
+      }
+    }
+    TX_ONABORT { die("transaction aborted: %s\n", pmemobj_errormsg()); }
+    TX_END
+  }
+  zipf_fill(tranks, ntops, ntier, 0.99);
+  // A tenth of the keys fit in DRAM.
+  size_t tier_budget = ntier / 10 * tier_cost(sizeof(tstr) - 1);
+  pm_emul_set(&optane);
+  for (int cfg = 0; cfg < 4; cfg++) {
+    struct wb_s *twb = cfg == 3 ? wb_open(pop, *ht0, 10, 1 << 20) : NULL;
+    struct tier_s *tier =
+        tier_open(pop, *ht0, twb, cfg ? tier_budget : 0, 2,
+                  cfg >= 2 ? TIER_LFU : 0);
+    if (tier == NULL || (cfg == 3 && twb == NULL))
+      die("== Opening the tiers failed ==\n");
+    for (int i = 0; i < ntier; i++)
+      tlast[i] = -1;
+    for (int i = 0; i < ntops; i++) {
+      uint64_t begin = rdtsc();
+      if (i % 10 == 0) {
+        tier_value(tstr, cfg, i);
+        if (tier_put(tier, tbase + tranks[i], tstr))
+          die("== Tier put of key %lu failed ==\n", tbase + tranks[i]);
+        tlast[tranks[i]] = i;
+      } else if (tier_get(tier, tbase + tranks[i], tbuf, sizeof(tbuf)) !=
+                 (ssize_t)sizeof(tstr) - 1) {
+        die("== Tier get of key %lu failed ==\n", tbase + tranks[i]);
+      }
+      tlat[i] = rdtsc() - begin;
+    }
+    struct tier_stats tst;
+    tier_get_stats(tier, &tst);
+    uint64_t tgets = tst.hot_hits + tst.cold_hits + tst.misses;
+    printf(" === %s: %.1f%% hot, %.1f%% cold, %lu promotions, %lu "
+           "demotions, %zu KiB; ",
+           tier_names[cfg], 100.0 * tst.hot_hits / tgets,
+           100.0 * tst.cold_hits / tgets, tst.promotions, tst.demotions,
+           tst.mem >> 10);
+    print_percentiles(tlat, ntops);
+    printf(" ====\n");
+
+    // The table and the hot tier both hold the last put of every key.
+    if (twb != NULL)
+      wb_sync(twb);
+    for (int k = 0; k < ntier; k++) {
+      tier_value(tstr, tlast[k] < 0 ? -1 : cfg, tlast[k] < 0 ? k : tlast[k]);
+      PMEMoid tvalue = ht_get(pop, *ht0, tbase + k);
+      if (OID_IS_NULL(tvalue) || strcmp(pmemobj_direct(tvalue), tstr) ||
+          tier_get(tier, tbase + k, tbuf, sizeof(tbuf)) < 0 ||
+          strcmp(tbuf, tstr))
+        die("== Key %lu is stale ==\n", tbase + k);
+    }
+    tier_close(tier);
+    if (twb != NULL)
+      wb_close(twb);
+  }
+  pm_emul_cfg = saved;
+  pm_emul_on = saved_on;
+  free(tlast);
+  free(tlat);
+  free(tranks);
+  free(adv);
+  free(mgout);
+  free(mgkeys);
+  pmemobj_close(pop);
+  free(ranks);
 }
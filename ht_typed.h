@@ -0,0 +1,291 @@
+/*
+ * Typed tables, specialized at compile time. The engines store uint64_t
+ * keys and untyped values, and read their bucket count and hash
+ * coefficients on every lookup. The macros below instead define a table for
+ * one key type, one value type, one hash and one bucket sizing policy, so
+ * values are stored inline in the entries and the compiler sees the whole
+ * probe loop:
+ *
+ *   HT_TYPED_VOLATILE(u64map, uint64_t, uint64_t, ht_typed_mix, 20)
+ *
+ * defines struct u64map with u64map_create, _set, _get, _remove and _free,
+ * chaining like ht_vanilla. HT_TYPED_PERSISTENT does the same over
+ * libpmemobj with transactions like ht_tx, and is available when
+ * libpmemobj.h is included first.
+ *
+ * K is an integer type compared with ==, V any type copied by assignment.
+ * HASH maps the key, converted to uint64_t, to 64 bits of which the top
+ * ones pick the bucket. A persistent table lives as long as its pool, so its
+ * HASH is keyed: it also gets a 128-bit secret the table draws when it is
+ * created, as with ht_typed_sip. LOG2 fixes the bucket count at 2^LOG2, or
+ * is HT_TYPED_RUNTIME to take it from the create call instead.
+ */
+#ifndef HT_TYPED_H
+#define HT_TYPED_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ht_hash.h"
+
+#define HT_TYPED_RUNTIME 0 // bucket count given at create time
+
+// Hash policies. The murmur3 finalizer, and Fibonacci hashing for keys
+// that are spread well already.
+static inline uint64_t ht_typed_mix(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  return key ^ (key >> 33);
+}
+
+static inline uint64_t ht_typed_fib(uint64_t key) {
+  return key * 0x9E3779B97F4A7C15ULL;
+}
+
+// Keyed policy, SipHash-1-3 under the table's secret k.
+static inline uint64_t ht_typed_sip(const uint64_t k[2], uint64_t key) {
+  return siphash13(k, key);
+}
+
+// A constant when LOG2 is, so the bucket is a multiply and a shift.
+#define HT_TYPED_SHIFT(LOG2, shift) ((LOG2) ? 64 - (LOG2) : (shift))
+
+#define HT_TYPED_VOLATILE(name, K, V, HASH, LOG2)                              \
+  struct name##_entry {                                                        \
+    K key;                                                                     \
+    struct name##_entry *next;                                                 \
+    V value;                                                                   \
+  };                                                                           \
+                                                                               \
+  struct name {                                                                \
+    unsigned shift;                                                            \
+    size_t size;                                                               \
+    struct name##_entry **bins;                                                \
+  };                                                                           \
+                                                                               \
+  /* 2^log2 buckets, log2 is ignored if LOG2 fixes it. */                      \
+  static inline struct name *name##_create(unsigned log2) {                    \
+    struct name *t = malloc(sizeof(struct name));                              \
+    log2 = (LOG2) ? (LOG2) : log2;                                             \
+    if (t == NULL || log2 < 1 || log2 > 40 ||                                  \
+        (t->bins = calloc(1ULL << log2, sizeof(*t->bins))) == NULL) {          \
+      free(t);                                                                 \
+      return NULL;                                                             \
+    }                                                                          \
+    t->shift = 64 - log2;                                                      \
+    t->size = 0;                                                               \
+    return t;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline size_t name##_bin(const struct name *t, K key) {               \
+    return HASH((uint64_t)key) >> HT_TYPED_SHIFT(LOG2, t->shift);              \
+  }                                                                            \
+                                                                               \
+  /* Returns the value in place, NULL if key is not present. */                \
+  static inline V *name##_get(const struct name *t, K key) {                   \
+    struct name##_entry *e = t->bins[name##_bin(t, key)];                      \
+    while (e != NULL && e->key != key)                                         \
+      e = e->next;                                                             \
+    return e != NULL ? &e->value : NULL;                                       \
+  }                                                                            \
+                                                                               \
+  /* Returns 1 if key was updated, 0 if added, -1 if out of memory. */         \
+  static inline int name##_set(struct name *t, K key, const V *value) {        \
+    V *old = name##_get(t, key);                                               \
+    if (old != NULL) {                                                         \
+      *old = *value;                                                           \
+      return 1;                                                                \
+    }                                                                          \
+    struct name##_entry *e = malloc(sizeof(struct name##_entry));              \
+    if (e == NULL)                                                             \
+      return -1;                                                               \
+    size_t bin = name##_bin(t, key);                                           \
+    e->key = key;                                                              \
+    e->value = *value;                                                         \
+    e->next = t->bins[bin];                                                    \
+    t->bins[bin] = e;                                                          \
+    t->size++;                                                                 \
+    return 0;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline int name##_remove(struct name *t, K key) {                     \
+    struct name##_entry **link = &t->bins[name##_bin(t, key)], *e;             \
+    while ((e = *link) != NULL && e->key != key)                               \
+      link = &e->next;                                                         \
+    if (e == NULL)                                                             \
+      return 0;                                                                \
+    *link = e->next;                                                           \
+    free(e);                                                                   \
+    t->size--;                                                                 \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  static inline void name##_free(struct name *t) {                             \
+    for (size_t i = 0; i < 1ULL << (64 - t->shift); i++)                       \
+      while (t->bins[i] != NULL) {                                             \
+        struct name##_entry *e = t->bins[i];                                   \
+        t->bins[i] = e->next;                                                  \
+        free(e);                                                               \
+      }                                                                        \
+    free(t->bins);                                                             \
+    free(t);                                                                   \
+  }
+
+#ifdef TOID_DECLARE
+/*
+ * Uses the type numbers TYPE_NUM to TYPE_NUM + 2. A new table isn't linked
+ * anywhere, the caller stores it in its own persistent structure.
+ */
+#define HT_TYPED_PERSISTENT(name, K, V, HASH, LOG2, TYPE_NUM)                  \
+  struct name##_entry;                                                         \
+  struct name##_bins;                                                          \
+  struct name;                                                                 \
+  TOID_DECLARE(struct name##_entry, (TYPE_NUM));                               \
+  TOID_DECLARE(struct name##_bins, (TYPE_NUM) + 1);                            \
+  TOID_DECLARE(struct name, (TYPE_NUM) + 2);                                   \
+                                                                               \
+  struct name##_entry {                                                        \
+    K key;                                                                     \
+    TOID(struct name##_entry) next;                                            \
+    V value;                                                                   \
+  };                                                                           \
+                                                                               \
+  struct name##_bins {                                                         \
+    TOID(struct name##_entry) bin[1];                                          \
+  };                                                                           \
+                                                                               \
+  struct name {                                                                \
+    uint64_t shift;                                                            \
+    uint64_t size;                                                             \
+    uint64_t secret[2];                                                        \
+    TOID(struct name##_bins) bins;                                             \
+  };                                                                           \
+                                                                               \
+  /* 2^log2 buckets, log2 is ignored if LOG2 fixes it. Returns 0 or -1. */     \
+  static inline int name##_new(PMEMobjpool *pop, TOID(struct name) *t,         \
+                               unsigned log2) {                                \
+    uint64_t secret[2];                                                        \
+    int ret = 0;                                                               \
+    log2 = (LOG2) ? (LOG2) : log2;                                             \
+    if (log2 < 1 || log2 > 40 || hash_secret(secret))                          \
+      return -1;                                                               \
+    TX_BEGIN(pop) {                                                            \
+      *t = TX_NEW(struct name);                                                \
+      D_RW(*t)->shift = 64 - log2;                                             \
+      D_RW(*t)->size = 0;                                                      \
+      D_RW(*t)->secret[0] = secret[0];                                         \
+      D_RW(*t)->secret[1] = secret[1];                                         \
+      D_RW(*t)->bins = TX_ZALLOC(                                              \
+          struct name##_bins, sizeof(TOID(struct name##_entry)) << log2);      \
+    }                                                                          \
+    TX_ONABORT { ret = -1; }                                                   \
+    TX_END                                                                     \
+    return ret;                                                                \
+  }                                                                            \
+                                                                               \
+  static inline size_t name##_bin(const struct name *t, K key) {               \
+    return HASH(t->secret, (uint64_t)key) >> HT_TYPED_SHIFT(LOG2, t->shift);   \
+  }                                                                            \
+                                                                               \
+  /* The entry of key, and through prev the one before it in the chain. */     \
+  static inline struct name##_entry *                                          \
+      name##_find(const struct name *t, K key, struct name##_entry **prev) {   \
+    struct name##_entry *e =                                                   \
+        pmemobj_direct(D_RO(t->bins)->bin[name##_bin(t, key)].oid);            \
+    *prev = NULL;                                                              \
+    while (e != NULL && e->key != key) {                                       \
+      *prev = e;                                                               \
+      e = pmemobj_direct(e->next.oid);                                         \
+    }                                                                          \
+    return e;                                                                  \
+  }                                                                            \
+                                                                               \
+  /* Returns the value in the pool, NULL if key is not present. */             \
+  static inline const V *name##_get(TOID(struct name) t, K key) {              \
+    struct name##_entry *prev, *e = name##_find(D_RO(t), key, &prev);          \
+    return e != NULL ? &e->value : NULL;                                       \
+  }                                                                            \
+                                                                               \
+  /* Returns 1 if key was updated, 0 if added, -1 if the transaction */       \
+  /* aborted. */                                                               \
+  static inline int name##_set(PMEMobjpool *pop, TOID(struct name) t, K key,   \
+                               const V *value) {                               \
+    struct name##_entry *prev, *e = name##_find(D_RO(t), key, &prev);          \
+    TOID(struct name##_bins) bins = D_RO(t)->bins;                             \
+    size_t bin = name##_bin(D_RO(t), key);                                     \
+    int ret = e != NULL;                                                       \
+    TX_BEGIN(pop) {                                                            \
+      if (e != NULL) {                                                         \
+        TX_ADD_DIRECT(&e->value);                                              \
+        e->value = *value;                                                     \
+      } else {                                                                 \
+        TOID(struct name##_entry) ne = TX_NEW(struct name##_entry);            \
+        D_RW(ne)->key = key;                                                   \
+        D_RW(ne)->value = *value;                                              \
+        D_RW(ne)->next = D_RO(bins)->bin[bin];                                 \
+        TX_ADD_FIELD(bins, bin[bin]);                                          \
+        D_RW(bins)->bin[bin] = ne;                                             \
+        TX_ADD_FIELD(t, size);                                                 \
+        D_RW(t)->size++;                                                       \
+      }                                                                        \
+    }                                                                          \
+    TX_ONABORT { ret = -1; }                                                   \
+    TX_END                                                                     \
+    return ret;                                                                \
+  }                                                                            \
+                                                                               \
+  /* Returns 1 if key was removed, 0 if it wasn't there, -1 if the */         \
+  /* transaction aborted. */                                                   \
+  static inline int name##_remove(PMEMobjpool *pop, TOID(struct name) t,       \
+                                  K key) {                                     \
+    struct name##_entry *prev, *e = name##_find(D_RO(t), key, &prev);          \
+    TOID(struct name##_bins) bins = D_RO(t)->bins;                             \
+    size_t bin = name##_bin(D_RO(t), key);                                     \
+    int ret = 1;                                                               \
+    if (e == NULL)                                                             \
+      return 0;                                                                \
+    TX_BEGIN(pop) {                                                            \
+      TOID(struct name##_entry) en;                                            \
+      if (prev == NULL) {                                                      \
+        en = D_RO(bins)->bin[bin];                                             \
+        TX_ADD_FIELD(bins, bin[bin]);                                          \
+        D_RW(bins)->bin[bin] = e->next;                                        \
+      } else {                                                                 \
+        en = prev->next;                                                       \
+        TX_ADD_DIRECT(&prev->next);                                            \
+        prev->next = e->next;                                                  \
+      }                                                                        \
+      TX_ADD_FIELD(t, size);                                                   \
+      D_RW(t)->size--;                                                         \
+      TX_FREE(en);                                                             \
+    }                                                                          \
+    TX_ONABORT { ret = -1; }                                                   \
+    TX_END                                                                     \
+    return ret;                                                                \
+  }                                                                            \
+                                                                               \
+  /* Frees the table and its entries in one transaction. */                   \
+  static inline int name##_free(PMEMobjpool *pop, TOID(struct name) t) {       \
+    int ret = 0;                                                               \
+    TX_BEGIN(pop) {                                                            \
+      TOID(struct name##_bins) bins = D_RO(t)->bins;                           \
+      for (size_t i = 0; i < 1ULL << (64 - D_RO(t)->shift); i++) {             \
+        TOID(struct name##_entry) en = D_RO(bins)->bin[i];                     \
+        while (!TOID_IS_NULL(en)) {                                            \
+          TOID(struct name##_entry) next = D_RO(en)->next;                     \
+          TX_FREE(en);                                                         \
+          en = next;                                                           \
+        }                                                                      \
+      }                                                                        \
+      TX_FREE(bins);                                                           \
+      TX_FREE(t);                                                              \
+    }                                                                          \
+    TX_ONABORT { ret = -1; }                                                   \
+    TX_END                                                                     \
+    return ret;                                                                \
+  }
+#endif
+
+#endif
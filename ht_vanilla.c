@@ -5,7 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "ht_hash.h"
+#include "ht_typed.h"
+
 #define TOMBSTONE_MASK (1ULL << 63)
+#define SCAN_PREFETCH 16 // chains a table scan keeps in flight
+#define GET_MULTI_WINDOW 16 // lookups ht_get_multi keeps in flight
+#define REHASH_STEP 1     // old bins each operation moves during a rehash
+#define HT_MOVE_REPLACE 0 // ht_move: a moved key replaces the target's value
+#define HT_MOVE_KEEP 1    // ht_move: the target keeps its own value
 
 extern __inline__ uint64_t rdtsc(void) {
   uint64_t a, d;
@@ -27,10 +35,23 @@ typedef struct entry_s entry_t;
 struct hashtable_s {
   int size;
   struct entry_s **table;
+  struct entry_s **old; // table still being rehashed into table, or NULL
+  int old_size;
+  int rehash_idx; // next bin of old to move
+  int pause;      // open iterators, no bins move while there are any
+  uint64_t hash_key[2]; // secret of the keyed hash, see ht_hash
 };
 
 typedef struct hashtable_s hashtable_t;
 
+struct ht_iter {
+  hashtable_t *hashtable;
+  int next_bin;
+  entry_t *ring[SCAN_PREFETCH]; // chains in flight
+  int head;
+  int count;
+};
+
 /* Create a new hashtable. */
 hashtable_t *ht_create(int size) {
 
@@ -53,26 +74,30 @@ hashtable_t *ht_create(int size) {
     hashtable->table[i] = NULL;
   }
 
+  /* Keys are hashed under a secret of the table's own. */
+  if (hash_secret(hashtable->hash_key)) {
+    free(hashtable->table);
+    free(hashtable);
+    return NULL;
+  }
+
   hashtable->size = size;
+  hashtable->old = NULL;
+  hashtable->old_size = 0;
+  hashtable->rehash_idx = 0;
+  hashtable->pause = 0;
 
   return hashtable;
 }
 
-// Potential collisions -- no time to check this for now!
-/* Hash a string for a particular hash table. */
+/* Hash a key to its bin, with SipHash under the table's secret. */
 int ht_hash(hashtable_t *hashtable, uint64_t key) {
+  return hash_range(siphash13(hashtable->hash_key, key), hashtable->size);
+}
 
-  unsigned long int hashval;
-  int i = 0;
-
-  /* Convert our string to an integer */
-  // while( hashval < ULONG_MAX && i < strlen( key ) ) {
-  // 	hashval = hashval << 8;
-  // 	hashval += key[ i ];
-  // 	i++;
-  // }
-
-  return key % hashtable->size;
+/* The bin of key in the table being rehashed. */
+static int ht_hash_old(hashtable_t *hashtable, uint64_t key) {
+  return hash_range(siphash13(hashtable->hash_key, key), hashtable->old_size);
 }
 
 static uint64_t hash(hashtable_t hashmap, uint64_t key) {
@@ -111,6 +136,68 @@ entry_t *ht_newpair(uint64_t key, char *value) {
   return newpair;
 }
 
+/* Find a key in a sorted chain. */
+static entry_t *ht_find(entry_t *pair, uint64_t key) {
+  while (pair != NULL && pair->key != 0 && key > pair->key) {
+    pair = pair->next;
+  }
+  if (pair == NULL || pair->key == 0 || key != pair->key)
+    return NULL;
+  return pair;
+}
+
+/* Link an existing pair into a sorted chain. */
+static void ht_link(entry_t **bin, entry_t *pair) {
+  while (*bin != NULL && (*bin)->key < pair->key) {
+    bin = &(*bin)->next;
+  }
+  pair->next = *bin;
+  *bin = pair;
+}
+
+/* Move up to n non-empty bins of the old table into the new one, splicing
+ * the nodes over as they are. Gives up after visiting 10 empty bins per bin
+ * asked for so a sparse old table doesn't make one operation slow. Returns 1
+ * while the rehash is still going. */
+static int ht_rehash_step(hashtable_t *hashtable, int n) {
+  int empty = n * 10;
+  entry_t *pair, *next;
+
+  if (hashtable->old == NULL)
+    return 0;
+  if (hashtable->pause > 0)
+    return 1;
+
+  while (n > 0 && hashtable->rehash_idx < hashtable->old_size) {
+    pair = hashtable->old[hashtable->rehash_idx];
+    hashtable->old[hashtable->rehash_idx++] = NULL;
+    if (pair == NULL) {
+      if (--empty == 0)
+        break;
+      continue;
+    }
+    for (; pair != NULL; pair = next) {
+      next = pair->next;
+      ht_link(&hashtable->table[ht_hash(hashtable, pair->key)], pair);
+    }
+    n--;
+  }
+
+  if (hashtable->rehash_idx < hashtable->old_size)
+    return 1;
+  free(hashtable->old);
+  hashtable->old = NULL;
+  hashtable->old_size = 0;
+  hashtable->rehash_idx = 0;
+  return 0;
+}
+
+/* Move whatever is left of a rehash in one go. */
+void ht_rehash_finish(hashtable_t *hashtable) {
+  while (hashtable->pause == 0 && ht_rehash_step(hashtable, 1024))
+    ;
+}
+
 /* Insert a key-value pair into a hash table. */
 void ht_set(hashtable_t *hashtable, uint64_t key, char *value) {
   int bin = 0;
@@ -120,6 +207,17 @@ void ht_set(hashtable_t *hashtable, uint64_t key, char *value) {
 
   // printf("Inserting %llu and %s\n", key, value);
 
+  ht_rehash_step(hashtable, REHASH_STEP);
+
+  /* A key whose old bin hasn't moved yet is updated where it is. */
+  if (hashtable->old != NULL &&
+      (next = ht_find(hashtable->old[ht_hash_old(hashtable, key)], key)) !=
+          NULL) {
+    free(next->value);
+    next->value = strdup(value);
+    return;
+  }
+
   bin = ht_hash(hashtable, key);
 
   next = hashtable->table[bin];
@@ -161,16 +259,18 @@ char *ht_get(hashtable_t *hashtable, uint64_t key) {
   int bin = 0;
   entry_t *pair;
 
+  ht_rehash_step(hashtable, REHASH_STEP);
+
   bin = ht_hash(hashtable, key);
 
-  /* Step through the bin, looking for our value. */
-  pair = hashtable->table[bin];
-  while (pair != NULL && pair->key != 0 && key > pair->key) {
-    pair = pair->next;
-  }
+  /* Step through the bin, looking for our value, then through its old bin
+   * while a rehash is going. */
+  pair = ht_find(hashtable->table[bin], key);
+  if (pair == NULL && hashtable->old != NULL)
+    pair = ht_find(hashtable->old[ht_hash_old(hashtable, key)], key);
 
   /* Did we actually find anything? */
-  if (pair == NULL || pair->key == 0 || key != pair->key) {
+  if (pair == NULL) {
     // return 1
     sprintf(tmp, "%c", 1);
     return tmp;
@@ -180,6 +280,128 @@ char *ht_get(hashtable_t *hashtable, uint64_t key) {
   }
 }
 
+/* Look up n keys at once, interleaving their chain walks: the bins of the
+ * next GET_MULTI_WINDOW keys are prefetched while up to GET_MULTI_WINDOW
+ * lookups step through their chains round robin, each node prefetched a
+ * round before it is read. out[i] gets what ht_get(hashtable, keys[i])
+ * would return. Returns the number of keys found. */
+int ht_get_multi(hashtable_t *hashtable, const uint64_t *keys, char **out,
+                 int n) {
+  entry_t *ring[GET_MULTI_WINDOW];
+  int idx[GET_MULTI_WINDOW]; // key of each lookup in flight
+  int bins[GET_MULTI_WINDOW]; // bins of the keys prefetched ahead
+  int next = 0, ahead = 0, head = 0, count = 0, found = 0;
+  entry_t *pair;
+
+  ht_rehash_step(hashtable, REHASH_STEP);
+  sprintf(tmp, "%c", 1);
+
+  for (;;) {
+    while (count < GET_MULTI_WINDOW && next < n) {
+      for (; ahead < n && ahead < next + GET_MULTI_WINDOW; ahead++) {
+        bins[ahead % GET_MULTI_WINDOW] = ht_hash(hashtable, keys[ahead]);
+        __builtin_prefetch(
+            &hashtable->table[bins[ahead % GET_MULTI_WINDOW]]);
+      }
+      out[next] = tmp;
+      pair = hashtable->table[bins[next % GET_MULTI_WINDOW]];
+      if (pair != NULL) {
+        __builtin_prefetch(pair);
+        ring[(head + count) % GET_MULTI_WINDOW] = pair;
+        idx[(head + count++) % GET_MULTI_WINDOW] = next;
+      }
+      next++;
+    }
+    if (count == 0)
+      break;
+
+    int i = idx[head];
+    pair = ring[head];
+    head = (head + 1) % GET_MULTI_WINDOW;
+    count--;
+    if (pair->key == keys[i]) {
+      out[i] = pair->value;
+      found++;
+    } else if (pair->key != 0 && keys[i] > pair->key && pair->next != NULL) {
+      __builtin_prefetch(pair->next);
+      ring[(head + count) % GET_MULTI_WINDOW] = pair->next;
+      idx[(head + count++) % GET_MULTI_WINDOW] = i;
+    }
+  }
+
+  /* Keys that haven't been moved out of the old table yet. */
+  for (int i = 0; hashtable->old != NULL && i < n; i++) {
+    if (out[i] != tmp)
+      continue;
+    pair = ht_find(hashtable->old[ht_hash_old(hashtable, keys[i])], keys[i]);
+    if (pair != NULL) {
+      out[i] = pair->value;
+      found++;
+    }
+  }
+  return found;
+}
+
+/* Iterate over all pairs, SCAN_PREFETCH chains at a time so that each node is
+ * prefetched well before it is read. Pairs come out in no particular order.
+ * A rehash is paused until the iterator has run to the end or is closed with
+ * ht_iter_close, and it walks the old table's remaining bins before the new
+ * table's. */
+void ht_iter_init(hashtable_t *hashtable, struct ht_iter *it) {
+  it->hashtable = hashtable;
+  it->next_bin = 0;
+  it->head = 0;
+  it->count = 0;
+  hashtable->pause++;
+}
+
+/* Lets the rehash go on. Iterators left before their end must be closed,
+ * closing one that ran to the end, or twice, does nothing. */
+void ht_iter_close(struct ht_iter *it) {
+  if (it->next_bin != INT_MAX) {
+    it->next_bin = INT_MAX;
+    it->count = 0;
+    it->hashtable->pause--;
+  }
+}
+
+int ht_iter_next(struct ht_iter *it, uint64_t *key, char **value) {
+  hashtable_t *hashtable = it->hashtable;
+  int nbins = hashtable->old_size + hashtable->size;
+  entry_t *pair;
+
+  while (it->count < SCAN_PREFETCH && it->next_bin < nbins) {
+    if (it->next_bin < hashtable->old_size)
+      pair = hashtable->old[it->next_bin++];
+    else
+      pair = hashtable->table[it->next_bin++ - hashtable->old_size];
+    if (pair != NULL) {
+      __builtin_prefetch(pair);
+      it->ring[(it->head + it->count++) % SCAN_PREFETCH] = pair;
+    }
+  }
+  if (it->count == 0) {
+    ht_iter_close(it);
+    return 0;
+  }
+
+  pair = it->ring[it->head];
+  it->head = (it->head + 1) % SCAN_PREFETCH;
+  it->count--;
+  *key = pair->key;
+  *value = pair->value;
+
+  if (pair->next != NULL) {
+    __builtin_prefetch(pair->next);
+    it->ring[(it->head + it->count++) % SCAN_PREFETCH] = pair->next;
+  }
+  return 1;
+}
+
+/* Grow a table to new_size bins. Only the new bin array is allocated here;
+ * the entries are spliced over a few bins at a time by the operations that
+ * follow (REHASH_STEP), and reads check both tables until they are done.
+ * Returns the same table. */
 hashtable_t *ht_expand(hashtable_t *hashtable, int new_size) {
 
   if (new_size < 1)
@@ -189,58 +411,88 @@ hashtable_t *ht_expand(hashtable_t *hashtable, int new_size) {
   if (hashtable->size > new_size)
     return NULL; // preserving existing data.
 
-  hashtable_t *new_hashtable = NULL;
+  entry_t **table = NULL;
 
-  /* Allocate the table itself. */
-  if ((new_hashtable = malloc(sizeof(hashtable_t))) == NULL) {
-    return NULL;
-  }
-  if ((new_hashtable->table = malloc(sizeof(entry_t *) * new_size)) == NULL) {
+  /* One rehash at a time: finish the previous one first. */
+  ht_rehash_finish(hashtable);
+  if (hashtable->old != NULL)
+    return NULL; // an iterator is still open
+
+  if ((table = calloc(new_size, sizeof(entry_t *))) == NULL) {
     return NULL;
   }
 
-  int i;
-  // Null initialize the new table.
-  for (i = 0; i < new_size; i++) {
-    new_hashtable->table[i] = NULL;
-  }
-  new_hashtable->size = new_size;
-
-  entry_t *pair = NULL;
-  // Now move old keys to new bins and free old entries
-  for (i = 0; i < hashtable->size; i++) {
-    pair = hashtable->table[i];
-    if (pair != NULL && pair->key != 0) {
-      ht_set(new_hashtable, pair->key, pair->value);
-      free(pair);
-    }
-  }
-  // free old hash table
-  free(hashtable);
-  return new_hashtable;
+  hashtable->old = hashtable->table;
+  hashtable->old_size = hashtable->size;
+  hashtable->rehash_idx = 0;
+  hashtable->table = table;
+  hashtable->size = new_size;
+  return hashtable;
 }
 
 // Implement the ability to have more than one hash table,
 // and have a method for moving data between hash tables by
 // atomically removing the entry from one table and adding it to the second.
-// Move data from ht1 to ht2 which are of same size.
-bool ht_move(hashtable_t *ht1, hashtable_t *ht2) {
-  // atomically move data
-  if (ht1->size != ht2->size)
+// Move all data from ht1 to ht2, which may be of any size and already hold
+// keys; policy says which value a key in both ends up with. The entries are
+// relinked into ht2's bins as they are, nothing is copied, and ht1 is freed.
+bool ht_move(hashtable_t *ht1, hashtable_t *ht2, int policy) {
+  entry_t *pair, *next, *old, **link = NULL;
+  int bin, last_bin = -1;
+
+  if (ht1 == ht2)
     return false;
+  ht_rehash_finish(ht1);
+  ht_rehash_finish(ht2);
+  if (ht1->old != NULL || ht2->old != NULL)
+    return false; // an iterator is still open
 
-  entry_t *pair = NULL;
   for (int i = 0; i < ht1->size; ++i) {
-    pair = ht1->table[i];
-    if (pair != NULL && pair->key != 0) {
-      ht_set(ht2, pair->key, pair->value);
-      free(pair);
+    for (pair = ht1->table[i]; pair != NULL; pair = next) {
+      next = pair->next;
+      bin = ht_hash(ht2, pair->key);
+
+      /* Source chains are sorted too, so the next pair for the same bin goes
+       * after this one. */
+      if (bin != last_bin)
+        link = &ht2->table[bin];
+      last_bin = bin;
+      while (*link != NULL && (*link)->key < pair->key) {
+        link = &(*link)->next;
+      }
+
+      if (*link != NULL && (*link)->key == pair->key) {
+        if (policy == HT_MOVE_KEEP) {
+          free(pair->value);
+          free(pair);
+          continue;
+        }
+        old = *link;
+        pair->next = old->next;
+        *link = pair;
+        free(old->value);
+        free(old);
+      } else {
+        pair->next = *link;
+        *link = pair;
+      }
+      link = &pair->next;
     }
+    last_bin = -1;
   }
+  free(ht1->table);
   free(ht1);
   return true;
 }
 
+// Typed tables of Test 7, the bin count fixed at compile time or not.
+struct val64 {
+  char b[64];
+};
+HT_TYPED_VOLATILE(tv_u64, uint64_t, uint64_t, ht_typed_mix, 18)
+HT_TYPED_VOLATILE(tv_u64r, uint64_t, uint64_t, ht_typed_mix, HT_TYPED_RUNTIME)
+HT_TYPED_VOLATILE(tv_v64, uint64_t, struct val64, ht_typed_mix, 18)
+
 void perf_test(hashtable_t *hashtable) {
   int test_size = 1000;
   printf("== Test 1: Insert %d keys with variable size values\n", test_size);
@@ -249,7 +501,7 @@ void perf_test(hashtable_t *hashtable) {
   for (uint64_t i = 1; i <= test_size; ++i) {
     cpString = calloc(i, sizeof(char));
     memset(cpString, 'V', i - 1);
-    cpString[i] = 0;
+    cpString[i - 1] = 0;
     ht_set(hashtable, i, cpString);
     free(cpString);
   }
@@ -266,6 +518,227 @@ void perf_test(hashtable_t *hashtable) {
          (w_end_time - w_begin_time) / test_size);
   printf(" === Average Get time: %llu ns ====\n",
          (r_end_time - r_begin_time) / test_size);
+
+  printf("== Test 3: Iterate over all %d keys\n", test_size);
+  struct ht_iter it;
+  uint64_t key, nkeys = 0;
+  char *value;
+  uint64_t s_begin_time = rdtsc();
+  ht_iter_init(hashtable, &it);
+  while (ht_iter_next(&it, &key, &value))
+    nkeys++;
+  uint64_t s_end_time = rdtsc();
+  printf(" ==== %lu keys scanned in %lu ns ====\n", nkeys,
+         s_end_time - s_begin_time);
+  // A scan given up early must not hold the rehash back.
+  ht_iter_init(hashtable, &it);
+  for (int i = 0; i < 10 && ht_iter_next(&it, &key, &value); i++)
+    ;
+  ht_iter_close(&it);
+  if (hashtable->pause != 0) {
+    printf("== Closed iterator still pauses the rehash ==\n");
+    exit(1);
+  }
+
+  int rh_keys = 1 << 16;
+  printf("== Test 4: Grow a table of %d keys from 1024 to %d bins\n", rh_keys,
+         rh_keys);
+  hashtable_t *stw = ht_create(1024);
+  hashtable_t *inc = ht_create(1024);
+  for (uint64_t i = 1; i <= rh_keys; ++i) {
+    ht_set(stw, i, "v");
+    ht_set(inc, i, "v");
+  }
+  uint64_t g_begin_time = rdtsc();
+  ht_expand(stw, rh_keys);
+  ht_rehash_finish(stw);
+  uint64_t g_end_time = rdtsc();
+  printf(" ==== Whole rehash at once: %lu ns ====\n", g_end_time - g_begin_time);
+
+  g_begin_time = rdtsc();
+  ht_expand(inc, rh_keys);
+  g_end_time = rdtsc();
+  uint64_t nops = 0, op_time, worst = 0, total = 0;
+  while (inc->old != NULL) {
+    op_time = rdtsc();
+    ht_get(inc, nops % rh_keys + 1);
+    op_time = rdtsc() - op_time;
+    if (op_time > worst)
+      worst = op_time;
+    total += op_time;
+    nops++;
+  }
+  printf(" ==== Incremental: expand %lu ns, done after %lu gets ====\n",
+         g_end_time - g_begin_time, nops);
+  printf(" ==== Gets during the rehash: average %lu ns, worst %lu ns ====\n",
+         total / nops, worst);
+
+  nkeys = 0;
+  for (uint64_t i = 1; i <= rh_keys; ++i) {
+    if (ht_get(stw, i)[0] == 'v' && ht_get(inc, i)[0] == 'v')
+      nkeys++;
+  }
+  printf(" ==== %lu/%d keys found in both tables ====\n", nkeys, rh_keys);
+
+  printf("== Test 5: Move %d keys into a table of %d bins holding half of "
+         "them\n",
+         rh_keys, rh_keys / 4);
+  hashtable_t *dst = ht_create(rh_keys / 4);
+  for (uint64_t i = 1; i <= rh_keys; i += 2)
+    ht_set(dst, i, "d");
+  char *moved = ht_get(inc, 2);
+  g_begin_time = rdtsc();
+  ht_move(inc, dst, HT_MOVE_KEEP);
+  g_end_time = rdtsc();
+  printf(" ==== Moved in %lu ns ====\n", g_end_time - g_begin_time);
+  nkeys = 0;
+  for (uint64_t i = 1; i <= rh_keys; ++i) {
+    if (ht_get(dst, i)[0] == (i % 2 ? 'd' : 'v'))
+      nkeys++;
+  }
+  printf(" ==== %lu/%d keys with the expected value, %s ====\n", nkeys, rh_keys,
+         ht_get(dst, 2) == moved ? "values not copied" : "values copied");
+
+  ht_move(dst, stw, HT_MOVE_REPLACE);
+  nkeys = 0;
+  for (uint64_t i = 1; i <= rh_keys; ++i) {
+    if (ht_get(stw, i)[0] == (i % 2 ? 'd' : 'v'))
+      nkeys++;
+  }
+  printf(" ==== Moved back with replace: %lu/%d keys ====\n", nkeys, rh_keys);
+
+  int mg_keys = 1 << 20, mg_n = 1 << 16, batch_sizes[] = {8, 16, 32, 64};
+  printf("== Test 6: Get %d keys of a table of %d, one at a time and in "
+         "batches\n",
+         mg_n, mg_keys);
+  hashtable_t *mg = ht_create(mg_keys / 4);
+  uint64_t *keys = malloc(mg_n * sizeof(uint64_t)), x = 7;
+  char **out = malloc(mg_n * sizeof(char *));
+  for (uint64_t i = 1; i <= mg_keys; ++i)
+    ht_set(mg, i * 7919, "m");
+  for (int i = 0; i < mg_n; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    keys[i] = ((x >> 33) % mg_keys + 1) * 7919 + (i % 4 == 0);
+  }
+  g_begin_time = rdtsc();
+  for (int i = 0; i < mg_n; i++)
+    out[i] = ht_get(mg, keys[i]);
+  g_end_time = rdtsc();
+  printf(" ==== ht_get: %lu ns/key ====\n", (g_end_time - g_begin_time) / mg_n);
+  for (int j = 0; j < 4; j++) {
+    nkeys = 0;
+    g_begin_time = rdtsc();
+    for (int i = 0; i < mg_n; i += batch_sizes[j])
+      nkeys += ht_get_multi(mg, keys + i, out + i, batch_sizes[j]);
+    g_end_time = rdtsc();
+    printf(" ==== Batches of %d: %lu ns/key, %lu/%d keys found ====\n",
+           batch_sizes[j], (g_end_time - g_begin_time) / mg_n, nkeys, mg_n);
+  }
+  nkeys = 0;
+  for (int i = 0; i < mg_n; i++)
+    if (out[i] == ht_get(mg, keys[i]))
+      nkeys++;
+  printf(" ==== %lu/%d keys agree with ht_get ====\n", nkeys, mg_n);
+  free(out);
+  free(keys);
+
+  int ty_keys = 1 << 20, ty_bins = 1 << 18;
+  uint64_t ty_ns[5][2], ty_found[5] = {0};
+  const char *ty_names[] = {"generic", "typed", "typed, runtime bins",
+                            "generic", "typed"};
+  printf("== Test 7: Put and get %d keys in %d bins, generic and typed\n",
+         ty_keys, ty_bins);
+  hashtable_t *gen8 = ht_create(ty_bins), *gen64 = ht_create(ty_bins);
+  struct tv_u64 *fix8 = tv_u64_create(0);
+  struct tv_u64r *run8 = tv_u64r_create(18);
+  struct tv_v64 *fix64 = tv_v64_create(0);
+  struct val64 v64;
+  // Scattered keys with random low bits, so that no table's bins are visited
+  // in order.
+  uint64_t *tk = malloc(ty_keys * sizeof(uint64_t));
+  for (int i = 0; i < ty_keys; i++)
+    tk[i] = ht_typed_mix(i + 1);
+  memset(v64.b, 'v', sizeof(v64.b) - 1);
+  v64.b[sizeof(v64.b) - 1] = 0;
+  for (int op = 0; op < 2; op++) {
+    g_begin_time = rdtsc();
+    for (uint64_t i = 0; i < ty_keys; i++)
+      if (op == 0)
+        ht_set(gen8, tk[i], "typed 8");
+      else
+        ty_found[0] += ht_get(gen8, tk[i])[0] == 't';
+    ty_ns[0][op] = (rdtsc() - g_begin_time) / ty_keys;
+    g_begin_time = rdtsc();
+    for (uint64_t i = 0; i < ty_keys; i++) {
+      uint64_t *v;
+      if (op == 0)
+        tv_u64_set(fix8, tk[i], &i);
+      else
+        ty_found[1] += (v = tv_u64_get(fix8, tk[i])) != NULL && *v == i;
+    }
+    ty_ns[1][op] = (rdtsc() - g_begin_time) / ty_keys;
+    g_begin_time = rdtsc();
+    for (uint64_t i = 0; i < ty_keys; i++) {
+      uint64_t *v;
+      if (op == 0)
+        tv_u64r_set(run8, tk[i], &i);
+      else
+        ty_found[2] += (v = tv_u64r_get(run8, tk[i])) != NULL && *v == i;
+    }
+    ty_ns[2][op] = (rdtsc() - g_begin_time) / ty_keys;
+    g_begin_time = rdtsc();
+    for (uint64_t i = 0; i < ty_keys; i++)
+      if (op == 0)
+        ht_set(gen64, tk[i], v64.b);
+      else
+        ty_found[3] += ht_get(gen64, tk[i])[0] == 'v';
+    ty_ns[3][op] = (rdtsc() - g_begin_time) / ty_keys;
+    g_begin_time = rdtsc();
+    for (uint64_t i = 0; i < ty_keys; i++) {
+      struct val64 *v;
+      if (op == 0)
+        tv_v64_set(fix64, tk[i], &v64);
+      else
+        ty_found[4] += (v = tv_v64_get(fix64, tk[i])) != NULL &&
+                       v->b[0] == 'v';
+    }
+    ty_ns[4][op] = (rdtsc() - g_begin_time) / ty_keys;
+  }
+  for (int j = 0; j < 5; j++)
+    printf(" ==== %d byte values, %s: put %lu ns, get %lu ns, %lu/%d keys "
+           "found ====\n",
+           j < 3 ? 8 : 64, ty_names[j], ty_ns[j][0], ty_ns[j][1], ty_found[j],
+           ty_keys);
+  tv_u64_free(fix8);
+  tv_u64r_free(run8);
+  tv_v64_free(fix64);
+  free(tk);
+
+  /* Keys that all shared bin 0 while bins were picked by key % size. */
+  int adv_keys = 1 << 14, adv_bins = 1 << 12;
+  printf("== Test 8: Put and get %d keys in %d bins, sequential and "
+         "multiples of the bin count\n",
+         adv_keys, adv_bins);
+  for (int set = 0; set < 2; set++) {
+    hashtable_t *adv = ht_create(adv_bins);
+    int longest = 0;
+    for (uint64_t i = 1; i <= adv_keys; i++)
+      ht_set(adv, set ? i * adv_bins : i, "a");
+    nkeys = 0;
+    g_begin_time = rdtsc();
+    for (uint64_t i = 1; i <= adv_keys; i++)
+      nkeys += ht_get(adv, set ? i * adv_bins : i)[0] == 'a';
+    g_end_time = rdtsc();
+    for (int b = 0; b < adv_bins; b++) {
+      int len = 0;
+      for (entry_t *pair = adv->table[b]; pair != NULL; pair = pair->next)
+        len++;
+      longest = len > longest ? len : longest;
+    }
+    printf(" ==== %s: longest chain %d, get %lu ns, %lu/%d keys found ====\n",
+           set ? "Multiples" : "Sequential", longest,
+           (g_end_time - g_begin_time) / adv_keys, nkeys, adv_keys);
+  }
 }
 
 int main(int argc, char **argv) {
@@ -293,7 +766,7 @@ int main(int argc, char **argv) {
 
   // Moving data to another hash table
   hashtable_t *ht3 = ht_create(8);
-  if (!ht_move(ht2, ht3))
+  if (!ht_move(ht2, ht3, HT_MOVE_REPLACE))
     printf("Moving data between ht failed!!");
 
   printf("%s\n", ht_get(ht3, 3));
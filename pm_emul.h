@@ -0,0 +1,337 @@
+/*
+ * Persistent memory latency emulation for benchmarking on machines where the
+ * pool is an ordinary file and flushes cost next to nothing.
+ *
+ * Include after libpmemobj.h. The pmemobj calls the engines make are routed
+ * through wrappers that charge extra time on top of the real work:
+ *  - reads: read_ns for every object whose cache line isn't in a small
+ *    per-thread model of the CPU caches, a PM_EMUL_MLP-th of that for
+ *    objects prefetched with pm_emul_prefetch, and read_mbps for bulk
+ *    copies out of the pool (pm_emul_read_bytes),
+ *  - writes: write_ns for every persistence barrier (drain, persist, the
+ *    commit of an outermost transaction, every undo log snapshot, publish
+ *    and atomic allocations) and write_mbps for the bytes flushed.
+ * Emulation is off until pm_emul_set or pm_emul_from_env turns it on, then
+ * each wrapper costs one branch.
+ *
+ *   HT_PM_EMUL=optane ./ht_tx hash
+ *   HT_PM_EMUL=read=300,write=100,read_bw=6000,write_bw=2000 ./ht_rp
+ */
+#ifndef PM_EMUL_H
+#define PM_EMUL_H
+
+#include <libpmemobj.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PM_EMUL_LINES 4096  // modelled cache, 256 KiB of lines per thread
+#define PM_EMUL_QUANTUM 500 // ns of owed delay paid off at once
+#define PM_EMUL_MLP 10      // cache misses a core keeps in flight at once
+
+// Optane DC 100 series, one DIMM, on top of DRAM
+#define PM_EMUL_OPTANE_READ_NS 225
+#define PM_EMUL_OPTANE_WRITE_NS 90
+#define PM_EMUL_OPTANE_READ_MBPS 6600
+#define PM_EMUL_OPTANE_WRITE_MBPS 2300
+
+struct pm_emul_cfg {
+  uint64_t read_ns;    // extra latency of a cache missing read
+  uint64_t write_ns;   // extra latency of a persistence barrier
+  uint64_t read_mbps;  // bandwidth of bulk reads, 0 for unlimited
+  uint64_t write_mbps; // bandwidth of flushed bytes, 0 for unlimited
+};
+
+struct pm_emul_stats {
+  uint64_t read_misses;
+  uint64_t barriers;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  uint64_t delay_ns; // emulated time added
+};
+
+static int pm_emul_on;
+static struct pm_emul_cfg pm_emul_cfg;
+static __thread struct pm_emul_stats pm_emul_stats;
+static __thread uintptr_t pm_emul_tags[PM_EMUL_LINES];
+static __thread int64_t pm_emul_debt;
+static __thread int pm_emul_tx_depth;
+
+static inline uint64_t pm_emul_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Owes ns of delay, and spins once a quantum has built up. Overshoot is
+// credited against the next charge, up to one quantum so that a preempted
+// spin doesn't make the following charges free.
+static inline void pm_emul_charge(uint64_t ns) {
+  pm_emul_stats.delay_ns += ns;
+  if ((pm_emul_debt += ns) < PM_EMUL_QUANTUM)
+    return;
+  uint64_t start = pm_emul_now(), now;
+  do
+    now = pm_emul_now();
+  while ((int64_t)(now - start) < pm_emul_debt);
+  pm_emul_debt -= now - start;
+  if (pm_emul_debt < -PM_EMUL_QUANTUM)
+    pm_emul_debt = -PM_EMUL_QUANTUM;
+}
+
+static inline void pm_emul_barrier(size_t bytes) {
+  if (!pm_emul_on)
+    return;
+  pm_emul_stats.barriers++;
+  pm_emul_stats.write_bytes += bytes;
+  pm_emul_charge(pm_emul_cfg.write_ns +
+                 (pm_emul_cfg.write_mbps ? bytes * 1000 / pm_emul_cfg.write_mbps
+                                         : 0));
+}
+
+static inline void pm_emul_write_bytes(size_t bytes) {
+  if (!pm_emul_on || !pm_emul_cfg.write_mbps)
+    return;
+  pm_emul_stats.write_bytes += bytes;
+  pm_emul_charge(bytes * 1000 / pm_emul_cfg.write_mbps);
+}
+
+// Charges a bulk copy of bytes out of the pool.
+static inline void pm_emul_read_bytes(size_t bytes) {
+  if (!pm_emul_on || !pm_emul_cfg.read_mbps)
+    return;
+  pm_emul_stats.read_bytes += bytes;
+  pm_emul_charge(bytes * 1000 / pm_emul_cfg.read_mbps);
+}
+
+static inline void pm_emul_touch(const void *addr) {
+  uintptr_t line = (uintptr_t)addr >> 6;
+  uintptr_t *tag = &pm_emul_tags[line % PM_EMUL_LINES];
+  if (*tag == line)
+    return;
+  *tag = line;
+  pm_emul_stats.read_misses++;
+  pm_emul_charge(pm_emul_cfg.read_ns);
+}
+
+// A prefetched miss overlaps with the others in flight, so it only costs
+// its share of the read latency, and the read that follows hits.
+static inline void pm_emul_touch_ahead(const void *addr) {
+  uintptr_t line = (uintptr_t)addr >> 6;
+  uintptr_t *tag = &pm_emul_tags[line % PM_EMUL_LINES];
+  if (*tag == line)
+    return;
+  *tag = line;
+  pm_emul_stats.read_misses++;
+  pm_emul_charge(pm_emul_cfg.read_ns / PM_EMUL_MLP);
+}
+
+static inline void pm_emul_set(const struct pm_emul_cfg *cfg) {
+  if (cfg == NULL) {
+    pm_emul_on = 0;
+    return;
+  }
+  pm_emul_cfg = *cfg;
+  pm_emul_on = 1;
+}
+
+static inline void pm_emul_get_stats(struct pm_emul_stats *stats) {
+  *stats = pm_emul_stats;
+}
+
+static inline void pm_emul_reset_stats(void) {
+  memset(&pm_emul_stats, 0, sizeof(pm_emul_stats));
+  memset(pm_emul_tags, 0, sizeof(pm_emul_tags));
+}
+
+/**
+ * Reads HT_PM_EMUL: "optane", or a comma separated list of read=, write=
+ * (ns), read_bw= and write_bw= (MB/s). Returns 1 if emulation is now on.
+ */
+static inline int pm_emul_from_env(void) {
+  const char *env = getenv("HT_PM_EMUL");
+  struct pm_emul_cfg cfg = {0};
+  char buf[256], *tok, *save;
+
+  if (env == NULL || *env == '\0')
+    return 0;
+  if (strcmp(env, "optane") == 0) {
+    cfg.read_ns = PM_EMUL_OPTANE_READ_NS;
+    cfg.write_ns = PM_EMUL_OPTANE_WRITE_NS;
+    cfg.read_mbps = PM_EMUL_OPTANE_READ_MBPS;
+    cfg.write_mbps = PM_EMUL_OPTANE_WRITE_MBPS;
+  } else {
+    snprintf(buf, sizeof(buf), "%s", env);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+      unsigned long long v;
+      if (sscanf(tok, "read=%llu", &v) == 1)
+        cfg.read_ns = v;
+      else if (sscanf(tok, "write=%llu", &v) == 1)
+        cfg.write_ns = v;
+      else if (sscanf(tok, "read_bw=%llu", &v) == 1)
+        cfg.read_mbps = v;
+      else if (sscanf(tok, "write_bw=%llu", &v) == 1)
+        cfg.write_mbps = v;
+      else
+        fprintf(stderr, "HT_PM_EMUL: ignoring %s\n", tok);
+    }
+  }
+  pm_emul_set(&cfg);
+  fprintf(stderr,
+          "emulating PM: read %lu ns, write %lu ns, read %lu MB/s, "
+          "write %lu MB/s\n",
+          cfg.read_ns, cfg.write_ns, cfg.read_mbps, cfg.write_mbps);
+  return 1;
+}
+
+/* Wrappers, defined before the names below are redirected to them. */
+
+static inline void *pm_emul_direct(PMEMoid oid) {
+  void *ptr = pmemobj_direct(oid);
+  if (pm_emul_on && ptr != NULL)
+    pm_emul_touch(ptr);
+  return ptr;
+}
+
+// Returns the address of oid and prefetches the object.
+static inline void *pm_emul_prefetch(PMEMoid oid) {
+  void *ptr = pmemobj_direct(oid);
+  if (ptr == NULL)
+    return NULL;
+  __builtin_prefetch(ptr);
+  if (pm_emul_on)
+    pm_emul_touch_ahead(ptr);
+  return ptr;
+}
+
+static inline void pm_emul_persist(PMEMobjpool *pop, const void *addr,
+                                   size_t len) {
+  pmemobj_persist(pop, addr, len);
+  pm_emul_barrier(len);
+}
+
+static inline void pm_emul_drain(PMEMobjpool *pop) {
+  pmemobj_drain(pop);
+  pm_emul_barrier(0);
+}
+
+static inline void *pm_emul_memcpy(PMEMobjpool *pop, void *dest,
+                                   const void *src, size_t len,
+                                   unsigned flags) {
+  void *ret = pmemobj_memcpy(pop, dest, src, len, flags);
+  if (flags & PMEMOBJ_F_MEM_NODRAIN)
+    pm_emul_write_bytes(len);
+  else
+    pm_emul_barrier(len);
+  return ret;
+}
+
+static inline void *pm_emul_memcpy_persist(PMEMobjpool *pop, void *dest,
+                                           const void *src, size_t len) {
+  void *ret = pmemobj_memcpy_persist(pop, dest, src, len);
+  pm_emul_barrier(len);
+  return ret;
+}
+
+static inline void *pm_emul_memset_persist(PMEMobjpool *pop, void *dest, int c,
+                                           size_t len) {
+  void *ret = pmemobj_memset_persist(pop, dest, c, len);
+  pm_emul_barrier(len);
+  return ret;
+}
+
+// Undo log snapshots are written and made durable before the caller's store.
+static inline int pm_emul_tx_add_range(PMEMoid oid, uint64_t off,
+                                       size_t size) {
+  int ret = pmemobj_tx_add_range(oid, off, size);
+  pm_emul_barrier(size);
+  return ret;
+}
+
+static inline int pm_emul_tx_add_range_direct(const void *ptr, size_t size) {
+  int ret = pmemobj_tx_add_range_direct(ptr, size);
+  pm_emul_barrier(size);
+  return ret;
+}
+
+static inline PMEMoid pm_emul_tx_strdup(const char *s, uint64_t type_num) {
+  pm_emul_write_bytes(strlen(s) + 1);
+  return pmemobj_tx_strdup(s, type_num);
+}
+
+// Transaction parameters aren't passed on, the engines only use TX_BEGIN.
+static inline int pm_emul_tx_begin(PMEMobjpool *pop, jmp_buf env, ...) {
+  pm_emul_tx_depth++;
+  return pmemobj_tx_begin(pop, env, TX_PARAM_NONE);
+}
+
+// Only the outermost transaction persists anything at commit.
+static inline void pm_emul_tx_process(void) {
+  if (pm_emul_tx_depth == 1 && pmemobj_tx_stage() == TX_STAGE_WORK)
+    pm_emul_barrier(0);
+  pmemobj_tx_process();
+}
+
+static inline int pm_emul_tx_end(void) {
+  pm_emul_tx_depth--;
+  return pmemobj_tx_end();
+}
+
+// Redo log, then the allocator metadata.
+static inline int pm_emul_publish(PMEMobjpool *pop, struct pobj_action *actv,
+                                  size_t actvcnt) {
+  int ret = pmemobj_publish(pop, actv, actvcnt);
+  pm_emul_barrier(0);
+  pm_emul_barrier(0);
+  return ret;
+}
+
+static inline int pm_emul_alloc(PMEMobjpool *pop, PMEMoid *oidp, size_t size,
+                                uint64_t type_num, pmemobj_constr constructor,
+                                void *arg) {
+  int ret = pmemobj_alloc(pop, oidp, size, type_num, constructor, arg);
+  pm_emul_barrier(size);
+  pm_emul_barrier(0);
+  return ret;
+}
+
+static inline void pm_emul_free(PMEMoid *oidp) {
+  pmemobj_free(oidp);
+  pm_emul_barrier(0);
+}
+
+#undef pmemobj_direct
+#define pmemobj_direct(oid) pm_emul_direct(oid)
+#undef pmemobj_persist
+#define pmemobj_persist(...) pm_emul_persist(__VA_ARGS__)
+#undef pmemobj_drain
+#define pmemobj_drain(pop) pm_emul_drain(pop)
+#undef pmemobj_memcpy
+#define pmemobj_memcpy(...) pm_emul_memcpy(__VA_ARGS__)
+#undef pmemobj_memcpy_persist
+#define pmemobj_memcpy_persist(...) pm_emul_memcpy_persist(__VA_ARGS__)
+#undef pmemobj_memset_persist
+#define pmemobj_memset_persist(...) pm_emul_memset_persist(__VA_ARGS__)
+#undef pmemobj_tx_add_range
+#define pmemobj_tx_add_range(...) pm_emul_tx_add_range(__VA_ARGS__)
+#undef pmemobj_tx_add_range_direct
+#define pmemobj_tx_add_range_direct(...) pm_emul_tx_add_range_direct(__VA_ARGS__)
+#undef pmemobj_tx_strdup
+#define pmemobj_tx_strdup(...) pm_emul_tx_strdup(__VA_ARGS__)
+#undef pmemobj_tx_begin
+#define pmemobj_tx_begin(...) pm_emul_tx_begin(__VA_ARGS__)
+#undef pmemobj_tx_process
+#define pmemobj_tx_process() pm_emul_tx_process()
+#undef pmemobj_tx_end
+#define pmemobj_tx_end() pm_emul_tx_end()
+#undef pmemobj_publish
+#define pmemobj_publish(...) pm_emul_publish(__VA_ARGS__)
+#undef pmemobj_alloc
+#define pmemobj_alloc(...) pm_emul_alloc(__VA_ARGS__)
+#undef pmemobj_free
+#define pmemobj_free(oidp) pm_emul_free(oidp)
+
+#endif